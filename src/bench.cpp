@@ -0,0 +1,371 @@
+#include "main.hpp"
+#include "framer.hpp"
+#include "protocol.hpp"
+#include "outbound.hpp"
+#include "connection_table.hpp"
+#include "timers.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::cout;
+using std::cerr;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::function;
+using std::make_shared;
+using std::to_string;
+using std::strcmp;
+
+constexpr const char FILTER_OPTION[] = "--filter";
+constexpr const char MIN_TIME_OPTION[] = "--min-time";
+constexpr const char SAMPLES_OPTION[] = "--samples";
+
+//Payload of every framed message, about a short chat line
+constexpr const size_t MESSAGE_SIZE = 64;
+constexpr const size_t FRAMES_PER_CHUNK = 256;
+constexpr const size_t FANOUT_RECIPIENTS = 64;
+constexpr const size_t TABLE_CONNECTIONS = 10000;
+
+struct bench_options {
+    //Only benchmarks whose name contains it
+    const char* filter = "";
+    uint64_t min_time_ns = 200 * 1000 * 1000;
+    size_t samples = 5;
+};
+
+//Keeps the compiler from proving a result unused and dropping the work
+template <typename T>
+static void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+//Runs the operation iterations times and returns how many items that covered, so results read per message, per recipient and so on
+using bench_body = function<uint64_t(uint64_t iterations)>;
+
+struct benchmark {
+    const char* name;
+    const char* unit;
+    bench_body body;
+};
+
+struct bench_result {
+    uint64_t items = 0;
+    //ns per item, one per sample
+    vector<double> samples;
+};
+
+static bench_result measure(const bench_body& body, const bench_options& options) {
+    //The first run builds whatever state the benchmark keeps, so it is left out of the calibration
+    uint64_t items = body(1);
+
+    //Doubles the iterations until one run takes a tenth of the sample time, then sizes samples from that
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    while (true) {
+        const uint64_t start = metrics_clock();
+        items = body(iterations);
+        elapsed = metrics_clock() - start;
+        if (elapsed * 10 >= options.min_time_ns || iterations >= (uint64_t(1) << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+    iterations = std::max<uint64_t>(1, static_cast<uint64_t>(static_cast<double>(iterations) * options.min_time_ns / std::max<uint64_t>(elapsed, 1)));
+
+    bench_result result;
+    for (size_t sample = 0; sample < options.samples; sample++) {
+        const uint64_t start = metrics_clock();
+        result.items = body(iterations);
+        result.samples.push_back(static_cast<double>(metrics_clock() - start) / std::max<uint64_t>(result.items, 1));
+    }
+    keep(items);
+    return result;
+}
+
+//FRAMES_PER_CHUNK frames of MESSAGE_SIZE, as one recv() would hand them over
+static string framed_chunk(frame_mode mode) {
+    string chunk;
+    const string message(MESSAGE_SIZE, 'x');
+    for (size_t i = 0; i < FRAMES_PER_CHUNK; i++) {
+        if (mode == frame_mode::text) {
+            chunk.append(message.c_str(), message.size() + 1);
+        } else {
+            append_frame(chunk, message_type::chat, message);
+        }
+    }
+    return chunk;
+}
+
+static uint64_t bench_framer(frame_mode mode, uint64_t iterations) {
+    static const string text = framed_chunk(frame_mode::text);
+    static const string binary = framed_chunk(frame_mode::binary);
+    const string& chunk = mode == frame_mode::text ? text : binary;
+
+    framer frames;
+    frames.set_mode(mode);
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        frames.append(chunk.data(), chunk.size());
+        string_view frame;
+        while (frames.next(frame)) {
+            total += frame.size();
+        }
+    }
+    keep(total);
+    return iterations * FRAMES_PER_CHUNK;
+}
+
+static uint64_t bench_format_address(uint64_t iterations) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7F000001);
+    size_t total = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        addr.sin_port = htons(static_cast<uint16_t>(i));
+        const string formatted = to_string(addr);
+        total += formatted.size();
+    }
+    keep(total);
+    return iterations;
+}
+
+//Local stream pairs, the server end of each non-blocking like an accepted connection
+struct socket_pairs {
+    vector<int> servers;
+    vector<int> clients;
+
+    ~socket_pairs() {
+        for (int sock : servers) {
+            close(sock);
+        }
+        for (int sock : clients) {
+            close(sock);
+        }
+    }
+
+    bool open(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) == -1) {
+                errno_to_cerr("socketpair(...)");
+                return false;
+            }
+            servers.push_back(pair[0]);
+            clients.push_back(pair[1]);
+        }
+        return true;
+    }
+};
+
+//One broadcast queued to and written for every recipient, the clients read back whatever arrived so the socket never fills
+static uint64_t bench_fanout(uint64_t iterations) {
+    static socket_pairs pairs;
+    static vector<outbound_queue> queues;
+    if (pairs.servers.empty()) {
+        if (!pairs.open(FANOUT_RECIPIENTS)) {
+            exit(EXIT_FAILURE);
+        }
+        queues.resize(FANOUT_RECIPIENTS);
+    }
+
+    const outbound_config config;
+    char drained[64 * 1024];
+    for (uint64_t i = 0; i < iterations; i++) {
+        const shared_message message = make_shared<const string>(MESSAGE_SIZE, 'x');
+        for (size_t recipient = 0; recipient < FANOUT_RECIPIENTS; recipient++) {
+            if (enqueue(queues[recipient], pairs.servers[recipient], message, config) == enqueue_result::queued) {
+                queues[recipient].flush(pairs.servers[recipient]);
+            }
+        }
+        //Reading every round would measure recv more than the fan-out
+        if (i % 64 == 63 || i + 1 == iterations) {
+            for (int client : pairs.clients) {
+                while (recv(client, drained, sizeof(drained), MSG_DONTWAIT) > 0) {
+                }
+            }
+        }
+    }
+    return iterations * FANOUT_RECIPIENTS;
+}
+
+struct bench_hot {
+    int sock = -1;
+    outbound_queue outbound;
+};
+
+struct bench_cold {
+    sockaddr_in addr = {};
+};
+
+using bench_table = connection_table<bench_hot, bench_cold>;
+
+//Filled once and kept across runs so only the operation itself is timed, handles in random order as events arrive
+struct filled_table {
+    bench_table table;
+    vector<connection_handle> handles;
+
+    filled_table() {
+        for (size_t i = 0; i < TABLE_CONNECTIONS; i++) {
+            bench_hot hot = {};
+            hot.sock = static_cast<int>(i);
+            handles.push_back(table.insert(std::move(hot), {}));
+        }
+        std::shuffle(handles.begin(), handles.end(), std::mt19937(1));
+    }
+};
+
+//An accept and a disconnect against a table holding TABLE_CONNECTIONS
+static uint64_t bench_table_churn(uint64_t iterations) {
+    static filled_table filled;
+    bench_table& table = filled.table;
+    vector<connection_handle>& handles = filled.handles;
+    static std::mt19937 random(1);
+    for (uint64_t i = 0; i < iterations; i++) {
+        const size_t victim = random() % handles.size();
+        table.erase(handles[victim]);
+        bench_hot hot = {};
+        hot.sock = static_cast<int>(i);
+        handles[victim] = table.insert(std::move(hot), {});
+    }
+    keep(table.size());
+    return iterations;
+}
+
+//Resolving the handle an event carries
+static uint64_t bench_table_lookup(uint64_t iterations) {
+    static filled_table filled;
+    bench_table& table = filled.table;
+    const vector<connection_handle>& handles = filled.handles;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        total += table.hot(handles[i % handles.size()])->sock;
+    }
+    keep(total);
+    return iterations;
+}
+
+//Walking the dense array the way a broadcast to the whole worker does
+static uint64_t bench_table_walk(uint64_t iterations) {
+    static filled_table filled;
+    bench_table& table = filled.table;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (size_t position = 0; position < table.size(); position++) {
+            total += table.hot_at(position).sock;
+        }
+    }
+    keep(total);
+    return iterations * TABLE_CONNECTIONS;
+}
+
+//Every connection's timer firing and being scheduled again, TABLE_CONNECTIONS of them spread over a few seconds
+static uint64_t bench_timer_wheel(uint64_t iterations) {
+    constexpr const uint64_t spread_ns = 5000000000;
+    static std::mt19937_64 random(1);
+    static uint64_t now = 1000000000;
+    static timer_wheel timers(now);
+    if (timers.size() == 0) {
+        for (size_t i = 0; i < TABLE_CONNECTIONS; i++) {
+            timers.schedule(i, now + random() % spread_ns);
+        }
+    }
+
+    static vector<uint64_t> expired;
+    uint64_t fired = 0;
+    while (fired < iterations) {
+        now += timer_wheel::TICK_NS;
+        timers.advance(now, expired);
+        for (uint64_t key : expired) {
+            timers.schedule(key, now + random() % spread_ns);
+        }
+        fired += expired.size();
+        expired.clear();
+    }
+    return fired;
+}
+
+static bool parse_bench_options(int option_count, char* options[], bench_options& parsed) {
+    for (int i = 0; i < option_count; i++) {
+        if (strcmp(options[i], FILTER_OPTION) == 0 && i + 1 < option_count) {
+            parsed.filter = options[++i];
+            continue;
+        }
+
+        if (strcmp(options[i], MIN_TIME_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long milliseconds = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || milliseconds == 0) {
+                cerr << MIN_TIME_OPTION << " expects a positive number of milliseconds\n";
+                return false;
+            }
+            parsed.min_time_ns = milliseconds * 1000 * 1000;
+            continue;
+        }
+
+        if (strcmp(options[i], SAMPLES_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long samples = strtoul(options[++i], &end, 10);
+            if (*end != '\0' || samples == 0) {
+                cerr << SAMPLES_OPTION << " expects a positive count\n";
+                return false;
+            }
+            parsed.samples = samples;
+            continue;
+        }
+
+        cerr << "Usage: bench [" << FILTER_OPTION << " name] [" << MIN_TIME_OPTION << " ms] [" << SAMPLES_OPTION << " n]\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    if (!parse_bench_options(argc - 1, argv + 1, options)) {
+        return EXIT_FAILURE;
+    }
+
+    const benchmark benchmarks[] = {
+        { "framer_text", "frame", [](uint64_t iterations) { return bench_framer(frame_mode::text, iterations); } },
+        { "framer_binary", "frame", [](uint64_t iterations) { return bench_framer(frame_mode::binary, iterations); } },
+        { "to_string_sockaddr_in", "call", bench_format_address },
+        { "fanout_socketpair", "recipient", bench_fanout },
+        { "connection_table_churn", "insert and erase", bench_table_churn },
+        { "connection_table_lookup", "lookup", bench_table_lookup },
+        { "connection_table_walk", "connection", bench_table_walk },
+        { "timer_wheel", "timer", bench_timer_wheel },
+    };
+
+    //The median is what to compare between builds, min is the best the machine managed
+    cout << "{\n  \"benchmarks\": [";
+    bool first = true;
+    for (const benchmark& bench : benchmarks) {
+        if (string_view(bench.name).find(options.filter) == string_view::npos) {
+            continue;
+        }
+
+        bench_result result = measure(bench.body, options);
+        std::sort(result.samples.begin(), result.samples.end());
+        cout << (first ? "\n" : ",\n") <<
+            "    { \"name\": \"" << bench.name << "\"" <<
+            ", \"unit\": \"" << bench.unit << "\"" <<
+            ", \"items\": " << result.items <<
+            ", \"ns_min\": " << result.samples.front() <<
+            ", \"ns_median\": " << result.samples[result.samples.size() / 2] <<
+            ", \"ns_max\": " << result.samples.back() << " }";
+        first = false;
+    }
+    cout << "\n  ]\n}\n";
+    return EXIT_SUCCESS;
+}
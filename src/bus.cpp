@@ -0,0 +1,116 @@
+#include "bus.hpp"
+#include "main.hpp"
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_acq_rel;
+
+bus_ring::bus_ring(size_t capacity)
+    : slots(new slot[capacity]), mask(capacity - 1), push_position(0) {
+    for (size_t i = 0; i < capacity; i++) {
+        slots[i].sequence.store(i, memory_order_relaxed);
+    }
+}
+
+bool bus_ring::push(const routed_message& message) {
+    size_t position = push_position.load(memory_order_relaxed);
+    slot* claimed;
+    while (true) {
+        claimed = &slots[position & mask];
+        const size_t sequence = claimed->sequence.load(memory_order_acquire);
+        const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (difference == 0) {
+            if (push_position.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            //The consumer has not freed this slot since the last lap
+            return false;
+        } else {
+            position = push_position.load(memory_order_relaxed);
+        }
+    }
+
+    claimed->message = message;
+    claimed->sequence.store(position + 1, memory_order_release);
+    return true;
+}
+
+bool bus_ring::pop(routed_message& message) {
+    slot& next = slots[pop_position & mask];
+    if (next.sequence.load(memory_order_acquire) != pop_position + 1) {
+        return false;
+    }
+
+    message = std::move(next.message);
+    next.message.message.reset();
+    next.sequence.store(pop_position + mask + 1, memory_order_release);
+    pop_position++;
+    return true;
+}
+
+message_bus::message_bus(size_t worker_count)
+    : mailboxes(new mailbox[worker_count]), count(worker_count) {}
+
+message_bus::~message_bus() {
+    for (size_t i = 0; i < count; i++) {
+        if (mailboxes[i].wake != -1 && close(mailboxes[i].wake) == -1) {
+            errno_to_cerr("close(wake)");
+        }
+    }
+}
+
+bool message_bus::open() {
+    for (size_t i = 0; i < count; i++) {
+        mailboxes[i].wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (mailboxes[i].wake == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool message_bus::send(size_t worker, const routed_message& message) {
+    mailbox& to = mailboxes[worker];
+    if (!to.ring.push(message)) {
+        return false;
+    }
+
+    //A receiver that emptied the ring leaves pending at or below zero, so exactly one sender after it sees zero
+    if (to.pending.fetch_add(1, memory_order_acq_rel) == 0) {
+        notify(worker);
+    }
+    return true;
+}
+
+void message_bus::notify(size_t worker) {
+    const uint64_t one = 1;
+    if (write(mailboxes[worker].wake, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        errno_to_cerr("write(wake)");
+    }
+}
+
+void message_bus::acknowledge(size_t worker) {
+    uint64_t wakeups;
+    if (read(mailboxes[worker].wake, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+        errno_to_cerr("read(wake)");
+    }
+}
+
+bool message_bus::receive(size_t worker, routed_message& message) {
+    mailbox& from = mailboxes[worker];
+    while (!from.ring.pop(message)) {
+        //Positive means a counted message waits behind a slot another sender is still filling
+        if (from.pending.load(memory_order_acquire) <= 0) {
+            return false;
+        }
+    }
+
+    from.pending.fetch_sub(1, memory_order_acq_rel);
+    return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "rooms.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+//Slots per worker ring, a power of two
+constexpr const size_t DEFAULT_BUS_CAPACITY = 1024;
+
+//Bounded multi-producer single-consumer ring, each slot carries a sequence number so producers only contend on one fetch position
+struct bus_ring {
+    bus_ring(size_t capacity = DEFAULT_BUS_CAPACITY);
+
+    //false when full
+    bool push(const routed_message& message);
+
+    //Only the owning worker may call this, false when empty
+    bool pop(routed_message& message);
+
+private:
+    struct slot {
+        std::atomic<size_t> sequence;
+        routed_message message;
+    };
+
+    std::unique_ptr<slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> push_position;
+    alignas(64) size_t pop_position = 0;
+};
+
+//One ring and eventfd per worker, any thread sends, only the owner receives
+struct message_bus {
+    message_bus(size_t worker_count);
+    ~message_bus();
+
+    message_bus(const message_bus&) = delete;
+    message_bus& operator=(const message_bus&) = delete;
+
+    //Creates the eventfds, false with errno set on failure
+    bool open();
+
+    size_t size() const {
+        return count;
+    }
+
+    //Readable whenever the worker has something to receive
+    int wake(size_t worker) const {
+        return mailboxes[worker].wake;
+    }
+
+    //false when the worker's ring is full, the caller should receive its own messages and retry so two full workers can not wait on each other
+    bool send(size_t worker, const routed_message& message);
+
+    //Wakes the worker without a message, for work handed over some other way
+    void notify(size_t worker);
+
+    //Clears the eventfd, call once per wakeup before receiving
+    void acknowledge(size_t worker);
+
+    //false once nothing more is ready for the worker
+    bool receive(size_t worker, routed_message& message);
+
+private:
+    struct mailbox {
+        bus_ring ring;
+        //Sent minus received, only the send taking it from zero writes the eventfd
+        alignas(64) std::atomic<int64_t> pending{0};
+        int wake = -1;
+    };
+
+    //Atomics pin mailboxes in place, so no vector
+    std::unique_ptr<mailbox[]> mailboxes;
+    size_t count;
+};
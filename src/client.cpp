@@ -1,27 +1,328 @@
 #include "main.hpp"
+#include "framer.hpp"
+#include "outbound.hpp"
+#include "protocol.hpp"
+#include "shm_ring.hpp"
+#include "transport.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
-#include <netdb.h>
-#include <unistd.h>
 #include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <unistd.h>
+#include <vector>
 
 using std::cout;
 using std::cerr;
-using std::cin;
 using std::endl;
 using std::string;
-using std::ref;
-using std::thread;
+using std::string_view;
+using std::vector;
+using std::make_shared;
+using std::count;
+
+//How long the server gets to answer BINARY_REQUEST or SHM_REQUEST before the client gives up
+constexpr const int BINARY_ANSWER_TIMEOUT_MS = 2000;
+//How long each address the server resolved to gets to complete the handshake
+constexpr const int CONNECT_TIMEOUT_MS = 5000;
+//Bytes taken from the input at a time
+constexpr const size_t INPUT_CHUNK_SIZE = 64 * 1024;
+//Input is left unread while this much is still waiting for the socket, so piping in a file never buffers all of it
+constexpr const size_t MAX_PENDING_OUTPUT = 256 * 1024;
+//Payload of one batch frame, well under what the server's framer holds
+constexpr const size_t MAX_BATCH_PAYLOAD = MAX_FRAME_SIZE / 2;
+
+bool send_all(int sock, const char* data, size_t size) {
+    while (size != 0) {
+        ssize_t written = send(sock, data, size, MSG_NOSIGNAL);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            pollfd writable = { sock, POLLOUT, 0 };
+            if (poll(&writable, 1, -1) == -1 && errno != EINTR) {
+                return false;
+            }
+            continue;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+//Asks for binary framing, text frames arriving before the answer are printed as usual, false when the server never answered
+static bool request_binary(int sock, framer& frames) {
+    if (!send_all(sock, BINARY_REQUEST, sizeof(BINARY_REQUEST))) {
+        errno_to_cerr("send(...)");
+        return false;
+    }
+
+    while (true) {
+        string_view frame;
+        while (frames.next(frame)) {
+            if (frame == BINARY_REQUEST) {
+                //Whatever is buffered behind the answer is already binary
+                frames.set_mode(frame_mode::binary);
+                return true;
+            }
+            cout << frame << '\n';
+        }
+
+        pollfd readable = { sock, POLLIN, 0 };
+        int ready = poll(&readable, 1, BINARY_ANSWER_TIMEOUT_MS);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return false;
+        }
+
+        ssize_t received = frames.fill(sock);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+    }
+}
+
+//Asks for a shared ring and attaches it, frames arriving before the answer are printed as usual, false when the server never handed one over
+static bool request_shared_ring(int sock, framer& frames, shm_ring& ring) {
+    const size_t request_size = sizeof(SHM_REQUEST) - (frames.mode() == frame_mode::packet ? 1 : 0);
+    if (!send_all(sock, SHM_REQUEST, request_size)) {
+        errno_to_cerr("send(...)");
+        return false;
+    }
+
+    vector<char> buffer(MAX_FRAME_SIZE);
+    int descriptors[SHM_DESCRIPTORS];
+    size_t descriptor_count = 0;
+    defer([&]() {
+        for (size_t i = 0; i < descriptor_count; i++) {
+            close(descriptors[i]);
+        }
+    });
+    while (true) {
+        string_view frame;
+        while (frames.next(frame)) {
+            if (frame != SHM_REQUEST) {
+                cout << frame << '\n';
+                continue;
+            }
+            if (descriptor_count != SHM_DESCRIPTORS) {
+                return false;
+            }
+            //The ring owns them from here, even when mapping fails
+            descriptor_count = 0;
+            if (!ring.attach(descriptors[0], descriptors[1], descriptors[2])) {
+                errno_to_cerr("mmap(ring)");
+                return false;
+            }
+            return true;
+        }
+
+        pollfd readable = { sock, POLLIN, 0 };
+        int ready = poll(&readable, 1, BINARY_ANSWER_TIMEOUT_MS);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return false;
+        }
+
+        //The descriptors ride on the answer, frames.fill() would read past them and the kernel would drop them
+        ssize_t received = receive_descriptors(sock, buffer.data(), buffer.size(), descriptors, SHM_DESCRIPTORS, descriptor_count);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (received <= 0 || frames.append(buffer.data(), received) != static_cast<size_t>(received)) {
+            return false;
+        }
+    }
+}
+
+//Everything waiting for the socket, framed bytes on a stream socket and a record per message on a seqpacket one
+struct client_output {
+    frame_mode mode = frame_mode::text;
+    string stream;
+    size_t sent = 0;
+    outbound_queue records;
+
+    size_t size() const {
+        return mode == frame_mode::packet ? records.bytes : stream.size() - sent;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void add(string_view message) {
+        switch (mode) {
+            case frame_mode::text:
+                stream.append(message);
+                stream.push_back('\0');
+                break;
+            case frame_mode::binary:
+                append_frame(stream, message_type::chat, message);
+                break;
+            case frame_mode::packet:
+                //An empty record would read as end of stream
+                if (!message.empty()) {
+                    records.push(make_shared<const string>(message));
+                }
+                break;
+        }
+    }
+
+    //Lines that arrived together, in binary as few batch frames as fit
+    void add_lines(const vector<string_view>& lines) {
+        if (mode != frame_mode::binary || lines.size() == 1) {
+            for (string_view line : lines) {
+                add(line);
+            }
+            return;
+        }
+
+        batch_builder batch;
+        size_t payload = 0;
+        for (string_view line : lines) {
+            if (payload != 0 && payload + line.size() + MAX_VARINT_SIZE > MAX_BATCH_PAYLOAD) {
+                batch.finish(stream);
+                payload = 0;
+            }
+            batch.add(line);
+            payload += line.size() + MAX_VARINT_SIZE;
+        }
+        batch.finish(stream);
+    }
+
+    //Writes until everything is out or the socket is full, false with errno set on a socket error
+    bool flush(int sock) {
+        while (!empty()) {
+            ssize_t written = mode == frame_mode::packet ? records.flush(sock) : send(sock, stream.data() + sent, stream.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (mode != frame_mode::packet) {
+                sent += written;
+            }
+        }
+        stream.clear();
+        sent = 0;
+        return true;
+    }
+};
+
+//Connected socket, non-blocking, to the first target that answers within CONNECT_TIMEOUT_MS, or -1 once every failure has been reported
+static int connect_any(const vector<client_target>& targets, bool& seqpacket) {
+    for (const client_target& target : targets) {
+        int sock = socket(target.family, target.type | SOCK_NONBLOCK | SOCK_CLOEXEC, target.protocol);
+        if (sock == -1) {
+            errno_to_cerr("socket(...)");
+            continue;
+        }
+
+        //Writable once the handshake finished either way, SO_ERROR tells which
+        bool connected = connect(sock, reinterpret_cast<const sockaddr*>(&target.addr), target.length) == 0;
+        if (!connected && errno == EINPROGRESS) {
+            pollfd writable = { sock, POLLOUT, 0 };
+            int ready;
+            do {
+                ready = poll(&writable, 1, CONNECT_TIMEOUT_MS);
+            } while (ready == -1 && errno == EINTR);
+
+            int error = ready == 0 ? ETIMEDOUT : 0;
+            socklen_t error_size = sizeof(error);
+            if (ready == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_size) == -1) {
+                error = errno;
+            }
+            connected = ready == 1 && error == 0;
+            errno = error;
+        }
+        if (connected) {
+            seqpacket = target.type == SOCK_SEQPACKET;
+            return sock;
+        }
+        errno_to_cerr("connect(...)");
+        close(sock);
+    }
+    return -1;
+}
 
-int client(const char ip[]) {
+//Shows what the server sent, above the prompt when a person is typing at it
+static void print_frame(string_view frame, bool bulk) {
+    if (bulk) {
+        cout << frame << '\n';
+        return;
+    }
+    int line_count = count(frame.begin(), frame.end(), '\n');
+    print_above(line_count);
+    cout << frame << '\n';
+    print_above_restore(line_count);
+}
+
+int client(const char ip[], const client_options& options) {
     if (ip == nullptr) {
-        cerr << "Must specify server IP Address." << endl;
+        cerr << "Must specify the server, a host name, IPv4 or IPv6 address, " << UNIX_PREFIX << "<path> or " << SEQPACKET_PREFIX << "<path>." << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<client_target> targets;
+    if (!resolve_target(ip, targets)) {
+        return EXIT_FAILURE;
+    }
+    if (options.shared && targets.front().family != AF_UNIX) {
+        cerr << "A shared ring needs a server on this host, connect through " << UNIX_PREFIX << " or " << SEQPACKET_PREFIX << '.' << endl;
         return EXIT_FAILURE;
     }
 
-    cout << "Client...\n";
-    int client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    //Files are read one after the other, stdin when there are none
+    size_t next_file = 0;
+    int input = STDIN_FILENO;
+    defer([&]() {
+        if (input != STDIN_FILENO && input != -1) {
+            close(input);
+        }
+    });
+    auto open_next_file = [&]() {
+        if (input != STDIN_FILENO && input != -1) {
+            close(input);
+        }
+        input = -1;
+        while (next_file < options.files.size()) {
+            const char* path = options.files[next_file++];
+            input = open(path, O_RDONLY | O_CLOEXEC);
+            if (input != -1) {
+                return;
+            }
+            string call = string("open(") + path + ")";
+            errno_to_cerr(call.c_str());
+        }
+    };
+    if (!options.files.empty()) {
+        open_next_file();
+        if (input == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!options.bulk) {
+        cout << "Client...\n";
+        cout << "Connecting..." << endl;
+    }
+    //A host may resolve to IPv6 and IPv4 addresses, the first that answers wins
+    bool seqpacket = false;
+    int client = connect_any(targets, seqpacket);
     if (client == -1) {
-        errno_to_cerr("socket(...)");
         return EXIT_FAILURE;
     }
     defer([&]() {
@@ -29,67 +330,141 @@ int client(const char ip[]) {
             errno_to_cerr("close(...)");
         }
     });
+    if (!options.bulk) {
+        cout << "Connected!\n";
+    }
 
-    int fcntl_flags = fcntl(client, F_GETFL, 0);
-    if (fcntl_flags == -1) {
-        errno_to_cerr("fcntl(..., F_GETFL, ...)");
+    framer frames;
+    if (seqpacket && options.binary) {
+        cerr << "Seqpacket connections keep message boundaries already, there is no binary framing to ask for." << endl;
+        return EXIT_FAILURE;
+    }
+    if (seqpacket) {
+        frames.set_mode(frame_mode::packet);
+    }
+    if (options.binary && !request_binary(client, frames)) {
+        cerr << "Server did not accept binary framing." << endl;
+        return EXIT_FAILURE;
+    }
+    shm_ring ring;
+    if (options.shared && !request_shared_ring(client, frames, ring)) {
+        cerr << "Server did not hand over a shared ring." << endl;
         return EXIT_FAILURE;
     }
 
-    fcntl_flags |= O_NONBLOCK;
+    client_output output;
+    output.mode = frames.mode();
+    output.records.set_mode(output.mode);
 
-    if (fcntl(client, F_SETFL, fcntl_flags) == -1) {
-        errno_to_cerr("fcntl(..., F_SETFL, ...)");
-        return EXIT_FAILURE;
+    //Frames that arrived with the answers to the requests above are already buffered
+    string_view frame;
+    while (frames.next(frame)) {
+        print_frame(frame, options.bulk);
     }
 
-    sockaddr_in local;
-    local.sin_family = AF_INET;
-    hostent* this_host = gethostbyname(ip);
-    *reinterpret_cast<uint32_t*>(&local.sin_addr) = *reinterpret_cast<const uint32_t*>(this_host->h_addr_list[0]);
-    local.sin_port = htons(PORT);
-    cout << "Connecting..." << endl;
+    //Everything happens on one poll(): server frames, input lines and whatever the socket can take
+    string input_buffer;
+    vector<char> chunk(INPUT_CHUNK_SIZE);
+    vector<string_view> lines;
+    bool input_open = true;
+    bool exiting = false;
+    bool shut_down = false;
+    if (!options.bulk) {
+        cout << ">" << std::flush;
+    }
     while (true) {
-        int result = connect(client, reinterpret_cast<sockaddr*>(&local), sizeof(local));
-        if (result == -1) {
-            if (errno != EWOULDBLOCK && errno != EINPROGRESS) {
-                errno_to_cerr("connect(...)");
+        //Once the input is done and written the server is told, it closes the connection after relaying everything
+        if ((exiting || !input_open) && output.empty() && !shut_down) {
+            if (exiting) {
+                return EXIT_SUCCESS;
+            }
+            if (shutdown(client, SHUT_WR) == -1) {
+                errno_to_cerr("shutdown(...)");
                 return EXIT_FAILURE;
             }
-            continue;
+            shut_down = true;
         }
-        break;
-    }
-    cout << "Connected!\n";
 
-    bool quit_reader = false;
-    bool reader_failure = false;
-    thread reader_thread = thread(reader, client, ref(quit_reader), ref(reader_failure));
-    defer([&]() {
-        if (reader_failure) {
-            errno_to_cerr("reader(...)");
+        const bool reading_input = input_open && !exiting && output.size() < MAX_PENDING_OUTPUT;
+        pollfd polled[2] = {
+            { client, static_cast<short>(POLLIN | (output.empty() ? 0 : POLLOUT)), 0 },
+            { reading_input ? input : -1, POLLIN, 0 },
+        };
+        if (poll(polled, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errno_to_cerr("poll(...)");
+            return EXIT_FAILURE;
         }
 
-        if (!reader_thread.joinable()) {
-            return;
+        if (polled[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t received = frames.fill(client, MSG_DONTWAIT);
+            if (received == 0) {
+                return EXIT_SUCCESS;
+            }
+            if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                errno_to_cerr("recv(...)");
+                return EXIT_FAILURE;
+            }
+            while (frames.next(frame)) {
+                if (frame == HEARTBEAT_PING) {
+                    if (!shut_down) {
+                        output.add(HEARTBEAT_PONG);
+                    }
+                    continue;
+                }
+                print_frame(frame, options.bulk);
+            }
         }
-        quit_reader = true;
-        reader_thread.join();
-    });
 
-    string line;
-    do {
-        cout << ">";
-        getline(cin, line);
-        if (quit_reader || reader_failure) {
-            break;
+        if (polled[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t read_size = read(input, chunk.data(), chunk.size());
+            if (read_size == -1 && errno != EINTR && errno != EAGAIN) {
+                errno_to_cerr("read(input)");
+                return EXIT_FAILURE;
+            }
+            if (read_size == 0) {
+                //A last line without a newline still counts
+                if (!input_buffer.empty()) {
+                    input_buffer.push_back('\n');
+                }
+                open_next_file();
+                input_open = input != -1;
+            } else if (read_size > 0) {
+                input_buffer.append(chunk.data(), read_size);
+            }
+
+            lines.clear();
+            size_t begin = 0;
+            for (size_t end = input_buffer.find('\n'); end != string::npos && !exiting; end = input_buffer.find('\n', begin)) {
+                lines.emplace_back(input_buffer.data() + begin, end - begin);
+                exiting = lines.back() == ".exit";
+                begin = end + 1;
+            }
+            if (!lines.empty()) {
+                if (options.shared) {
+                    //Messages keep their boundaries in the ring, a full one blocks on its eventfd until the server drained it
+                    for (string_view line : lines) {
+                        if (!ring.write(line)) {
+                            errno_to_cerr("write(ring)");
+                            return EXIT_FAILURE;
+                        }
+                    }
+                } else {
+                    output.add_lines(lines);
+                }
+                if (!options.bulk && !exiting) {
+                    cout << ">" << std::flush;
+                }
+            }
+            input_buffer.erase(0, begin);
         }
 
-        if (send(client, line.c_str(), line.size() + 1, 0) == -1) {
+        //Written straight away, POLLOUT only comes into it once the socket is full
+        if (!output.empty() && !output.flush(client)) {
             errno_to_cerr("send(...)");
             return EXIT_FAILURE;
         }
-    } while (line != ".exit" && !reader_failure && !quit_reader);
-
-    return EXIT_SUCCESS;
+    }
 }
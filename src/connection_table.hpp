@@ -0,0 +1,127 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+//Names a connection_table entry, a handle stops resolving once its entry is erased even after the slot is reused
+struct connection_handle {
+    uint32_t index = UINT32_MAX;
+    //Never 0 for a live entry, so a packed handle is never 0 or 1 either
+    uint32_t generation = 0;
+
+    //For epoll_data.u64 and the like
+    uint64_t pack() const {
+        return (static_cast<uint64_t>(generation) << 32) | index;
+    }
+
+    static connection_handle unpack(uint64_t packed) {
+        return { static_cast<uint32_t>(packed), static_cast<uint32_t>(packed >> 32) };
+    }
+
+    bool operator==(const connection_handle&) const = default;
+};
+
+//Slab of connections split into a dense array of hot fields, what a broadcast touches, and a parallel one of cold fields
+//Erasing moves the last entry into the hole so both arrays stay dense, positions and references are only valid until the next insert or erase
+template <typename Hot, typename Cold>
+struct connection_table {
+    connection_handle insert(Hot&& hot, Cold&& cold) {
+        uint32_t index;
+        if (free_head != NO_SLOT) {
+            index = free_head;
+            free_head = slots[index].position;
+        } else {
+            index = static_cast<uint32_t>(slots.size());
+            slots.push_back(slot());
+        }
+
+        slots[index].position = static_cast<uint32_t>(hot_entries.size());
+        hot_entries.push_back(std::move(hot));
+        cold_entries.push_back(std::move(cold));
+        owners.push_back(index);
+        return { index, slots[index].generation };
+    }
+
+    //false for a handle that no longer resolves
+    bool erase(connection_handle handle) {
+        if (!valid(handle)) {
+            return false;
+        }
+
+        const uint32_t position = slots[handle.index].position;
+        const uint32_t last = static_cast<uint32_t>(hot_entries.size() - 1);
+        if (position != last) {
+            hot_entries[position] = std::move(hot_entries[last]);
+            cold_entries[position] = std::move(cold_entries[last]);
+            owners[position] = owners[last];
+            slots[owners[position]].position = position;
+        }
+        hot_entries.pop_back();
+        cold_entries.pop_back();
+        owners.pop_back();
+
+        slot& freed = slots[handle.index];
+        if (++freed.generation == 0) {
+            freed.generation = 1;
+        }
+        freed.position = free_head;
+        free_head = handle.index;
+        return true;
+    }
+
+    bool valid(connection_handle handle) const {
+        return handle.index < slots.size() && slots[handle.index].generation == handle.generation && handle.generation != 0 && is_live(handle.index);
+    }
+
+    //nullptr for a handle that no longer resolves
+    Hot* hot(connection_handle handle) {
+        return valid(handle) ? &hot_entries[slots[handle.index].position] : nullptr;
+    }
+
+    Cold* cold(connection_handle handle) {
+        return valid(handle) ? &cold_entries[slots[handle.index].position] : nullptr;
+    }
+
+    size_t size() const {
+        return hot_entries.size();
+    }
+
+    bool empty() const {
+        return hot_entries.empty();
+    }
+
+    Hot& hot_at(size_t position) {
+        return hot_entries[position];
+    }
+
+    Cold& cold_at(size_t position) {
+        return cold_entries[position];
+    }
+
+    connection_handle handle_at(size_t position) const {
+        const uint32_t index = owners[position];
+        return { index, slots[index].generation };
+    }
+
+private:
+    static constexpr const uint32_t NO_SLOT = UINT32_MAX;
+
+    struct slot {
+        uint32_t generation = 1;
+        //Dense position while live, next free slot while free
+        uint32_t position = NO_SLOT;
+    };
+
+    bool is_live(uint32_t index) const {
+        const uint32_t position = slots[index].position;
+        return position < owners.size() && owners[position] == index;
+    }
+
+    std::vector<slot> slots;
+    uint32_t free_head = NO_SLOT;
+    std::vector<Hot> hot_entries;
+    std::vector<Cold> cold_entries;
+    //Slot index of every dense position
+    std::vector<uint32_t> owners;
+};
@@ -0,0 +1,222 @@
+#include "coroutine.hpp"
+#include "main.hpp"
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::coroutine_handle;
+using std::exchange;
+using std::size_t;
+using std::string_view;
+using std::vector;
+
+//Events per epoll_wait, not a connection limit
+constexpr const int MAX_COROUTINE_EVENTS = 64;
+
+coroutine_loop::~coroutine_loop() {
+    if (epoll != -1 && close(epoll) == -1) {
+        errno_to_cerr("close(epoll)");
+    }
+}
+
+bool coroutine_loop::open() {
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    return epoll != -1;
+}
+
+bool coroutine_loop::watch(int sock) {
+    if (watched.size() <= static_cast<size_t>(sock)) {
+        watched.resize(sock + 1);
+    }
+    watched[sock] = readiness();
+
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = sock;
+    return epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &event) != -1;
+}
+
+void coroutine_loop::forget(int sock) {
+    if (epoll_ctl(epoll, EPOLL_CTL_DEL, sock, nullptr) == -1) {
+        errno_to_cerr("epoll_ctl(EPOLL_CTL_DEL, ...)");
+    }
+
+    readiness& state = watched[sock];
+    state.forgotten = true;
+    if (state.reader) {
+        post(exchange(state.reader, {}));
+    }
+    if (state.writer) {
+        post(exchange(state.writer, {}));
+    }
+}
+
+void coroutine_loop::post(coroutine_handle<> handle) {
+    ready.push_back(handle);
+}
+
+bool coroutine_loop::run() {
+    epoll_event events[MAX_COROUTINE_EVENTS];
+    vector<coroutine_handle<>> resuming;
+    while (true) {
+        //Resuming may post more, those run on the next pass
+        while (!ready.empty() && !stopped) {
+            resuming.swap(ready);
+            for (coroutine_handle<>& handle : resuming) {
+                handle.resume();
+            }
+            resuming.clear();
+        }
+
+        if (stopped) {
+            stopped = false;
+            return true;
+        }
+
+        int count = epoll_wait(epoll, events, MAX_COROUTINE_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errno_to_cerr("epoll_wait(...)");
+            return false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            readiness& state = watched[events[i].data.fd];
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (state.reader) {
+                    post(exchange(state.reader, {}));
+                } else {
+                    state.readable = true;
+                }
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                if (state.writer) {
+                    post(exchange(state.writer, {}));
+                } else {
+                    state.writable = true;
+                }
+            }
+        }
+    }
+}
+
+bool readiness_awaitable::await_ready() noexcept {
+    coroutine_loop::readiness& state = loop.watched[sock];
+    bool& pending = write ? state.writable : state.readable;
+    return exchange(pending, false) || state.forgotten;
+}
+
+void readiness_awaitable::await_suspend(coroutine_handle<> awaiting) noexcept {
+    coroutine_loop::readiness& state = loop.watched[sock];
+    (write ? state.writer : state.reader) = awaiting;
+}
+
+bool readiness_awaitable::await_resume() noexcept {
+    return !loop.watched[sock].forgotten;
+}
+
+void coroutine_event::notify() {
+    set = true;
+    if (waiter) {
+        loop.post(exchange(waiter, {}));
+    }
+}
+
+//GCC 12 miscompiles a co_await inside an if condition, every result below goes through a local first
+task<int> async_accept(coroutine_loop& loop, int listener, peer_address& addr) {
+    while (true) {
+        addr.length = sizeof(addr.addr);
+        int sock = accept4(listener, addr.get(), &addr.length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock != -1) {
+            if (!loop.watch(sock)) {
+                errno_to_cerr("epoll_ctl(EPOLL_CTL_ADD, ...)");
+                close(sock);
+                continue;
+            }
+            co_return sock;
+        }
+
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return -1;
+        }
+        bool ready = co_await readable(loop, listener);
+        if (!ready) {
+            errno = EBADF;
+            co_return -1;
+        }
+    }
+}
+
+task<bool> async_connect(coroutine_loop& loop, int sock, const sockaddr* addr, socklen_t length) {
+    if (connect(sock, addr, length) == 0) {
+        co_return true;
+    }
+    if (errno != EINPROGRESS) {
+        co_return false;
+    }
+
+    //Writable once the handshake finished either way, SO_ERROR tells which
+    bool connected = co_await writable(loop, sock);
+    if (!connected) {
+        errno = EBADF;
+        co_return false;
+    }
+
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_size) == -1) {
+        co_return false;
+    }
+    errno = error;
+    co_return error == 0;
+}
+
+task<bool> async_read_frame(coroutine_loop& loop, int sock, framer& frames, string_view& frame) {
+    while (!frames.next(frame)) {
+        ssize_t received = frames.fill(sock);
+        if (received > 0) {
+            continue;
+        }
+        if (received == 0) {
+            co_return false;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return false;
+        }
+        bool ready = co_await readable(loop, sock);
+        if (!ready) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+task<bool> async_send(coroutine_loop& loop, int sock, outbound_queue& outbound) {
+    while (!outbound.empty()) {
+        if (outbound.flush(sock) != -1) {
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return false;
+        }
+        bool ready = co_await writable(loop, sock);
+        if (!ready) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
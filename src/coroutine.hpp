@@ -0,0 +1,230 @@
+#pragma once
+#include "framer.hpp"
+#include "outbound.hpp"
+#include "transport.hpp"
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <netinet/in.h>
+
+struct task_promise_base {
+    std::coroutine_handle<> continuation;
+    //Set by detach(), nothing awaits the task so it frees itself
+    bool detached = false;
+
+    struct final_awaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+            task_promise_base& promise = finished.promise();
+            if (promise.detached) {
+                finished.destroy();
+                return std::noop_coroutine();
+            }
+            return promise.continuation ? promise.continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    //Started eagerly, a task that finishes without waiting costs no suspension and no extra stack
+    std::suspend_never initial_suspend() noexcept {
+        return {};
+    }
+
+    final_awaiter final_suspend() noexcept {
+        return {};
+    }
+
+    //The server is built without relying on exceptions
+    void unhandled_exception() noexcept {
+        std::terminate();
+    }
+};
+
+template <typename T>
+struct task_promise : task_promise_base {
+    T value {};
+
+    void return_value(T result) {
+        value = std::move(result);
+    }
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+    void return_void() {}
+};
+
+//Coroutine that runs as soon as it is called, co_await resumes the awaiter once it returns
+template <typename T = void>
+struct task {
+    struct promise_type : task_promise<T> {
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    task(task&& other) noexcept
+        : coroutine(std::exchange(other.coroutine, {})) {}
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task() {
+        if (coroutine) {
+            coroutine.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return coroutine.done();
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        coroutine.promise().continuation = awaiting;
+    }
+
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(coroutine.promise().value);
+        }
+    }
+
+    //Frees itself once finished instead of waiting to be awaited
+    void detach() && {
+        if (!coroutine.done()) {
+            coroutine.promise().detached = true;
+            coroutine = {};
+        }
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle)
+        : coroutine(handle) {}
+
+    std::coroutine_handle<promise_type> coroutine;
+};
+
+//Single-threaded edge-triggered epoll loop resuming whichever coroutine waits on a ready descriptor
+struct coroutine_loop {
+    coroutine_loop() = default;
+    ~coroutine_loop();
+
+    coroutine_loop(const coroutine_loop&) = delete;
+    coroutine_loop& operator=(const coroutine_loop&) = delete;
+
+    //false with errno set on failure
+    bool open();
+
+    //Must come before any readable() or writable() on the descriptor
+    bool watch(int sock);
+
+    //Unregisters the descriptor, anyone still waiting on it resumes with false
+    void forget(int sock);
+
+    //Resumed from run() after the current event, never inline
+    void post(std::coroutine_handle<> handle);
+
+    //Returns false on an epoll failure, true once stop() was called
+    bool run();
+
+    void stop() {
+        stopped = true;
+    }
+
+    struct readiness {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        //Readiness that arrived with nobody waiting, consumed by the next await
+        bool readable = false;
+        bool writable = false;
+        bool forgotten = false;
+    };
+
+    //Indexed by descriptor
+    std::vector<readiness> watched;
+
+private:
+    int epoll = -1;
+    bool stopped = false;
+    std::vector<std::coroutine_handle<>> ready;
+};
+
+struct readiness_awaitable {
+    coroutine_loop& loop;
+    int sock;
+    bool write;
+
+    bool await_ready() noexcept;
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept;
+    //false once the descriptor was forgotten
+    bool await_resume() noexcept;
+};
+
+inline readiness_awaitable readable(coroutine_loop& loop, int sock) {
+    return { loop, sock, false };
+}
+
+inline readiness_awaitable writable(coroutine_loop& loop, int sock) {
+    return { loop, sock, true };
+}
+
+//Wakes one waiting coroutine, a notify with nobody waiting is kept for the next wait
+struct coroutine_event {
+    coroutine_event(coroutine_loop& event_loop)
+        : loop(event_loop) {}
+
+    void notify();
+
+    bool await_ready() noexcept {
+        return set;
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        waiter = awaiting;
+    }
+
+    void await_resume() noexcept {
+        set = false;
+    }
+
+private:
+    coroutine_loop& loop;
+    std::coroutine_handle<> waiter;
+    bool set = false;
+};
+
+//Accepted descriptor, non-blocking and watched, or -1 with errno set
+task<int> async_accept(coroutine_loop& loop, int listener, peer_address& addr);
+
+//sock must be non-blocking and watched, false with errno set when the connection failed
+task<bool> async_connect(coroutine_loop& loop, int sock, const sockaddr* addr, socklen_t length);
+
+//Next frame without its terminator, valid until the next read, false on end of stream or error
+task<bool> async_read_frame(coroutine_loop& loop, int sock, framer& frames, std::string_view& frame);
+
+//Writes the whole queue, false on a socket error or once the descriptor is forgotten
+task<bool> async_send(coroutine_loop& loop, int sock, outbound_queue& outbound);
+
+template <typename T>
+task<> complete_then_stop(coroutine_loop& loop, task<T> work, T& result) {
+    result = co_await std::move(work);
+    loop.stop();
+}
+
+//Drives the loop until work returns, for callers that are not coroutines themselves
+template <typename T>
+T run_until_complete(coroutine_loop& loop, task<T> work) {
+    T result {};
+    complete_then_stop(loop, std::move(work), result).detach();
+    loop.run();
+    return result;
+}
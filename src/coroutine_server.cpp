@@ -0,0 +1,192 @@
+#include "main.hpp"
+#include "server.hpp"
+#include "coroutine.hpp"
+#include "protocol.hpp"
+#include "rooms.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using std::cout;
+using std::cerr;
+using std::string;
+using std::string_view;
+using std::list;
+using std::shared_ptr;
+using std::make_shared;
+using std::to_string;
+using std::vector;
+
+//A peer that vanished fails every send queued for it, one call site must not flood the log
+static log_limiter send_failures;
+
+//Shared by its reader and writer coroutines, the socket closes once both are done
+struct coroutine_connection {
+    int sock = -1;
+    peer_address addr;
+    framer frames;
+    outbound_queue outbound;
+    coroutine_event queued;
+    bool closing = false;
+    room_membership rooms;
+
+    coroutine_connection(coroutine_loop& loop, int accepted, const peer_address& accepted_addr)
+        : sock(accepted), addr(accepted_addr), queued(loop) {
+        if (addr.packet) {
+            frames.set_mode(frame_mode::packet);
+            outbound.set_mode(frame_mode::packet);
+        }
+    }
+
+    ~coroutine_connection() {
+        if (close(sock) == -1) {
+            string call = "close(" + to_string(addr) + ")";
+            errno_to_cerr(call.c_str());
+        }
+    }
+};
+
+struct coroutine_server {
+    coroutine_loop loop;
+    outbound_config outbound;
+    list<shared_ptr<coroutine_connection>> connections;
+    //Every member is also in connections and leaves both at once, so the pointers never dangle
+    room_index<coroutine_connection*> rooms;
+};
+
+static void coroutine_broadcast(coroutine_server& server, const shared_message& message, room_id room) {
+    for (coroutine_connection* connection : server.rooms.members(room)) {
+        enqueue_result result = enqueue(connection->outbound, connection->sock, message, server.outbound);
+        if (result == enqueue_result::disconnect) {
+            log_write(log_level::warning, to_string(connection->addr) + " Slow consumer, disconnecting");
+            //Its reader sees end of stream and finishes the connection
+            shutdown(connection->sock, SHUT_RDWR);
+        } else if (result == enqueue_result::queued) {
+            connection->queued.notify();
+        }
+    }
+}
+
+static task<> coroutine_writer(coroutine_server& server, shared_ptr<coroutine_connection> connection) {
+    while (!connection->closing) {
+        if (connection->outbound.empty()) {
+            co_await connection->queued;
+            continue;
+        }
+
+        bool sent = co_await async_send(server.loop, connection->sock, connection->outbound);
+        if (!sent) {
+            if (!connection->closing) {
+                if (send_failures.allow()) {
+                    string call = "send(" + to_string(connection->addr) + ")";
+                    errno_to_cerr(call.c_str());
+                }
+                shutdown(connection->sock, SHUT_RDWR);
+            }
+            co_return;
+        }
+    }
+}
+
+static task<> coroutine_chat(coroutine_server& server, shared_ptr<coroutine_connection> connection) {
+    auto self = server.connections.insert(server.connections.end(), connection);
+    server.rooms.add(connection.get(), connection->rooms);
+    coroutine_writer(server, connection).detach();
+
+    string_view message;
+    while (true) {
+        bool received = co_await async_read_frame(server.loop, connection->sock, connection->frames, message);
+        if (!received) {
+            break;
+        }
+        if (negotiate_binary(message, connection->frames, connection->outbound)) {
+            connection->queued.notify();
+            continue;
+        }
+        if (server.rooms.handle(message, connection.get(), connection->rooms)) {
+            continue;
+        }
+        const uint64_t received_at = metrics_clock();
+
+        string out = "(" + to_string(connection->addr) + ") " + connection->rooms.current_prefix;
+        out.append(message);
+        log_chat(out);
+        coroutine_broadcast(server, make_shared<const string>(std::move(out)), connection->rooms.current);
+        metrics_record(distribution::broadcast_ns, metrics_clock() - received_at);
+
+        if (message.rfind(".exit", 0) == 0) {
+            break;
+        }
+    }
+
+    server.rooms.remove(connection.get(), connection->rooms);
+    server.connections.erase(self);
+    connection->closing = true;
+    //Best effort, a client that sent .exit still gets what was queued before it
+    if (!connection->outbound.empty()) {
+        connection->outbound.flush(connection->sock);
+    }
+    connection->queued.notify();
+    server.loop.forget(connection->sock);
+
+    if (shutdown(connection->sock, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        string call = "shutdown(" + to_string(connection->addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+    metrics_add(counter::disconnects);
+    log_write(log_level::info, to_string(connection->addr) + " Disconnected");
+}
+
+static task<> coroutine_accept(coroutine_server& server, int listener) {
+    accept_meter accepts;
+    while (true) {
+        peer_address addr;
+        int sock = co_await async_accept(server.loop, listener, addr);
+        if (sock == -1) {
+            errno_to_cerr("accept(...)");
+            server.loop.stop();
+            co_return;
+        }
+        if (!identify_peer(sock, addr)) {
+            errno_to_cerr("getsockopt(..., SO_PEERCRED, ...)");
+            server.loop.forget(sock);
+            close(sock);
+            continue;
+        }
+
+        metrics_add(counter::accepts);
+        //async_accept only suspends once the queue is empty, so every accept counts as its own drain
+        accepts.drained(1);
+        if (!tune_socket(sock, server.outbound)) {
+            errno_to_cerr("setsockopt(...)");
+        }
+        log_write(log_level::info, to_string(addr) + " Connected");
+        coroutine_chat(server, make_shared<coroutine_connection>(server.loop, sock, addr)).detach();
+    }
+}
+
+int coroutine_workers(const vector<int>& listeners, const server_options& options) {
+    coroutine_server server;
+    server.outbound = options.outbound;
+
+    if (!server.loop.open()) {
+        errno_to_cerr("epoll_create1(...)");
+        return EXIT_FAILURE;
+    }
+    //One accepting coroutine per listener, each suspends on its own readiness
+    for (int listener : listeners) {
+        if (!server.loop.watch(listener)) {
+            errno_to_cerr("epoll_ctl(EPOLL_CTL_ADD, listener)");
+            return EXIT_FAILURE;
+        }
+        coroutine_accept(server, listener).detach();
+    }
+    server.loop.run();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,728 @@
+#include "main.hpp"
+#include "server.hpp"
+#include "framer.hpp"
+#include "protocol.hpp"
+#include "bus.hpp"
+#include "metrics.hpp"
+#include "connection_table.hpp"
+#include "rooms.hpp"
+#include "shm_ring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using std::cout;
+using std::cerr;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::make_shared;
+using std::ref;
+using std::thread;
+using std::to_string;
+using std::size_t;
+using std::min;
+
+//Events per epoll_wait, not a connection limit
+constexpr const int MAX_EPOLL_EVENTS = 64;
+
+//Tags for epoll_data.u64, anything at or past 2^32 is a packed connection_handle
+constexpr const uint64_t LISTENER_TAG = 0;
+constexpr const uint64_t INBOX_TAG = 1;
+//RING_TAG_BASE + id for the data eventfd of the shared ring with that id
+constexpr const uint64_t RING_TAG_BASE = 2;
+
+//A peer that vanished fails every send queued for it, one call site must not flood the log
+static log_limiter send_failures;
+
+//Touched by every broadcast
+struct epoll_connection {
+    int sock = -1;
+    outbound_queue outbound;
+    bool dirty = false;
+    bool closing = false;
+};
+
+//Only touched when the connection itself is read from or reported on
+struct epoll_connection_details {
+    peer_address addr;
+    framer frames;
+    room_membership rooms;
+    connection_timeouts timeouts;
+    //Handed over on SHM_REQUEST, messages are read from it as well as from the socket
+    std::unique_ptr<shm_ring> ring;
+    uint32_t ring_id = 0;
+};
+
+using epoll_connection_table = connection_table<epoll_connection, epoll_connection_details>;
+
+//Connections are only ever touched by the worker owning them, other workers hand broadcasts over through the bus
+struct epoll_context {
+    message_bus bus;
+    vector<int> listeners;
+    //Set when every worker waits on the same listener
+    bool exclusive_accept = false;
+    //Local listeners every worker waits on, always exclusively
+    vector<int> shared_listeners;
+    bool pin_workers = false;
+    outbound_config outbound;
+    timeout_config timeouts;
+    //Bytes of each shared ring handed to a local client asking for one, 0 refuses them
+    size_t shm_ring_bytes = 0;
+
+    epoll_context(const int& worker_count)
+        : bus(worker_count), listeners(worker_count, -1) {}
+};
+
+struct epoll_worker_state {
+    int index = 0;
+    int epoll = -1;
+    epoll_connection_table connections;
+    room_index<connection_handle> rooms;
+    //Flushed and closed once the current batch of events is handled, so erasing never moves a connection an event is being handled for
+    //Connections still inside their flush window stay dirty across rounds and may have been closed meanwhile
+    vector<connection_handle> dirty;
+    //Earliest flush window end among the dirty connections held back, epoll_wait wakes up for it
+    uint64_t flush_deadline = 0;
+    vector<connection_handle> closed;
+    accept_meter accepts;
+    //Each connection keeps one timer pending while timeouts are enabled, keyed by its packed handle
+    timer_wheel timers;
+    vector<uint64_t> expired;
+    //Owner of each ring id, ids of rings closed since are reused first
+    vector<connection_handle> rings;
+    vector<uint32_t> free_rings;
+};
+
+static void epoll_close_later(epoll_worker_state& worker, connection_handle handle) {
+    epoll_connection& connection = *worker.connections.hot(handle);
+    if (!connection.closing) {
+        connection.closing = true;
+        worker.closed.push_back(handle);
+    }
+}
+
+//Writes until the queue is empty or the socket is full, EPOLLOUT resumes it after that
+static void epoll_flush(epoll_worker_state& worker, connection_handle handle) {
+    epoll_connection& connection = *worker.connections.hot(handle);
+    while (!connection.outbound.empty()) {
+        if (connection.outbound.flush(connection.sock) != -1) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            if (send_failures.allow()) {
+                string call = "worker[" + to_string(worker.index) + "]: sendmsg(" + to_string(worker.connections.cold(handle)->addr) + ")";
+                errno_to_cerr(call.c_str());
+            }
+            connection.outbound.clear();
+            epoll_close_later(worker, handle);
+        }
+        return;
+    }
+}
+
+static void epoll_enqueue(epoll_context& context, epoll_worker_state& worker, epoll_connection& connection, connection_handle handle, const shared_message& message) {
+    if (connection.closing) {
+        return;
+    }
+
+    enqueue_result result = enqueue(connection.outbound, connection.sock, message, context.outbound);
+    if (result == enqueue_result::disconnect) {
+        log_write(log_level::warning, "worker[" + to_string(worker.index) + "]: " + to_string(worker.connections.cold(handle)->addr) + " Slow consumer, disconnecting");
+        connection.outbound.clear();
+        epoll_close_later(worker, handle);
+    } else if (result == enqueue_result::queued && !connection.dirty) {
+        connection.dirty = true;
+        worker.dirty.push_back(handle);
+    }
+}
+
+//Queues only, every connection is flushed once after the batch however many messages it received
+static void epoll_deliver(epoll_context& context, epoll_worker_state& worker, const routed_message& message) {
+    const vector<connection_handle>& members = worker.rooms.members(message.room);
+    //Everyone here is in the room, walking the dense array beats resolving each handle
+    if (members.size() == worker.connections.size()) {
+        for (size_t i = 0; i < worker.connections.size(); i++) {
+            epoll_enqueue(context, worker, worker.connections.hot_at(i), worker.connections.handle_at(i), message.message);
+        }
+        return;
+    }
+
+    for (const connection_handle& handle : members) {
+        epoll_enqueue(context, worker, *worker.connections.hot(handle), handle, message.message);
+    }
+}
+
+static void epoll_receive_all(epoll_context& context, epoll_worker_state& worker) {
+    routed_message message;
+    while (context.bus.receive(worker.index, message)) {
+        epoll_deliver(context, worker, message);
+    }
+}
+
+static void epoll_publish(epoll_context& context, epoll_worker_state& worker, string&& out, room_id room) {
+    const routed_message message = { make_shared<const string>(std::move(out)), room };
+    for (size_t other = 0; other < context.bus.size(); other++) {
+        if (other == static_cast<size_t>(worker.index)) {
+            continue;
+        }
+
+        //The other worker may be just as full sending to this one, so keep receiving while waiting
+        while (!context.bus.send(other, message)) {
+            epoll_receive_all(context, worker);
+            std::this_thread::yield();
+        }
+    }
+
+    epoll_deliver(context, worker, message);
+}
+
+static void epoll_drain_inbox(epoll_context& context, epoll_worker_state& worker) {
+    context.bus.acknowledge(worker.index);
+    epoll_receive_all(context, worker);
+}
+
+//Edge-triggered: the listener must be drained until EAGAIN or the wakeup is lost
+static bool epoll_accept_all(epoll_context& context, epoll_worker_state& worker, int listener) {
+    uint64_t accepted = 0;
+    while (true) {
+        epoll_connection_details details;
+        int sock = accept4(listener, details.addr.get(), &details.addr.length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                worker.accepts.drained(accepted);
+                return true;
+            }
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            //Running out of descriptors or memory is transient, anything else means the listener is unusable
+            const int error = errno;
+            string call = "worker[" + to_string(worker.index) + "]: accept4(...)";
+            errno_to_cerr(call.c_str());
+            worker.accepts.drained(accepted);
+            return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+        }
+
+        if (!identify_peer(sock, details.addr)) {
+            string call = "worker[" + to_string(worker.index) + "]: getsockopt(..., SO_PEERCRED, ...)";
+            errno_to_cerr(call.c_str());
+            close(sock);
+            continue;
+        }
+        const peer_address addr = details.addr;
+        if (addr.packet) {
+            details.frames.set_mode(frame_mode::packet);
+        }
+        if (!tune_socket(sock, context.outbound)) {
+            string call = "worker[" + to_string(worker.index) + "]: setsockopt(" + to_string(addr) + ")";
+            errno_to_cerr(call.c_str());
+        }
+        epoll_connection connection = {};
+        connection.sock = sock;
+        connection_handle handle = worker.connections.insert(std::move(connection), std::move(details));
+        if (addr.packet) {
+            worker.connections.hot(handle)->outbound.set_mode(frame_mode::packet);
+        }
+        if (context.outbound.zerocopy_threshold != 0 && !worker.connections.hot(handle)->outbound.enable_zerocopy(sock, context.outbound.zerocopy_threshold)) {
+            string call = "worker[" + to_string(worker.index) + "]: setsockopt(" + to_string(addr) + ", SO_ZEROCOPY)";
+            errno_to_cerr(call.c_str());
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.u64 = handle.pack();
+        if (epoll_ctl(worker.epoll, EPOLL_CTL_ADD, sock, &event) == -1) {
+            string call = "worker[" + to_string(worker.index) + "]: epoll_ctl(EPOLL_CTL_ADD, " + to_string(addr) + ")";
+            errno_to_cerr(call.c_str());
+            close(sock);
+            worker.connections.erase(handle);
+            continue;
+        }
+        worker.rooms.add(handle, worker.connections.cold(handle)->rooms);
+        if (context.timeouts.enabled()) {
+            worker.timers.schedule(handle.pack(), start_timeouts(worker.connections.cold(handle)->timeouts, worker.connections.hot(handle)->outbound, context.timeouts, metrics_clock()));
+        }
+        accepted++;
+        metrics_add(counter::accepts);
+        log_write(log_level::info, to_string(addr) + " Connected");
+    }
+}
+
+//Broadcasts one message however it arrived, returns false once the connection should be dropped
+static bool epoll_relay(epoll_context& context, epoll_worker_state& worker, connection_handle handle, string_view message, uint64_t received_at) {
+    epoll_connection_details& details = *worker.connections.cold(handle);
+    if (message == HEARTBEAT_PONG) {
+        return true;
+    }
+    if (worker.rooms.handle(message, handle, details.rooms)) {
+        return true;
+    }
+
+    string out = "(" + to_string(details.addr) + ") " + details.rooms.current_prefix;
+    out.append(message);
+    log_chat(out);
+    epoll_publish(context, worker, std::move(out), details.rooms.current);
+    metrics_record(distribution::broadcast_ns, metrics_clock() - received_at);
+
+    return message.rfind(".exit", 0) != 0;
+}
+
+//Answers SHM_REQUEST with a new ring, false once the connection should be dropped
+//Refused requests are only logged, the client gives up waiting for the answer and keeps to its socket
+static bool epoll_open_ring(epoll_context& context, epoll_worker_state& worker, connection_handle handle) {
+    epoll_connection& connection = *worker.connections.hot(handle);
+    epoll_connection_details& details = *worker.connections.cold(handle);
+    const string worker_name = "worker[" + to_string(worker.index) + "]: ";
+    const string prefix = worker_name + to_string(details.addr);
+    if (context.shm_ring_bytes == 0 || details.addr.addr.ss_family != AF_UNIX || details.frames.mode() == frame_mode::binary || details.ring != nullptr) {
+        log_write(log_level::warning, prefix + " Shared ring refused");
+        return true;
+    }
+    //The answer must not overtake anything queued before it
+    epoll_flush(worker, handle);
+    if (!connection.outbound.empty()) {
+        log_write(log_level::warning, prefix + " Shared ring refused, replies still queued");
+        return true;
+    }
+
+    std::unique_ptr<shm_ring> ring = std::make_unique<shm_ring>();
+    if (!ring->create(context.shm_ring_bytes)) {
+        string call = worker_name + "memfd_create(" + to_string(details.addr) + ")";
+        errno_to_cerr(call.c_str());
+        return true;
+    }
+
+    uint32_t id;
+    if (!worker.free_rings.empty()) {
+        id = worker.free_rings.back();
+        worker.free_rings.pop_back();
+        worker.rings[id] = handle;
+    } else {
+        id = static_cast<uint32_t>(worker.rings.size());
+        worker.rings.push_back(handle);
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u64 = RING_TAG_BASE + id;
+    if (epoll_ctl(worker.epoll, EPOLL_CTL_ADD, ring->data_ready_fd(), &event) == -1) {
+        string call = worker_name + "epoll_ctl(EPOLL_CTL_ADD, ring, " + to_string(details.addr) + ")";
+        errno_to_cerr(call.c_str());
+        worker.free_rings.push_back(id);
+        return true;
+    }
+
+    //The client holds the same eventfds once they are sent, the ring is the server's only copy of them
+    const int descriptors[SHM_DESCRIPTORS] = { ring->memory_fd(), ring->data_ready_fd(), ring->space_ready_fd() };
+    const string_view answer(SHM_REQUEST, sizeof(SHM_REQUEST) - (details.frames.mode() == frame_mode::packet ? 1 : 0));
+    details.ring = std::move(ring);
+    details.ring_id = id;
+    if (!send_descriptors(connection.sock, answer, descriptors, SHM_DESCRIPTORS)) {
+        string call = worker_name + "sendmsg(" + to_string(details.addr) + ", SCM_RIGHTS)";
+        errno_to_cerr(call.c_str());
+        return false;
+    }
+    log_write(log_level::info, prefix + " Shared ring of " + to_string(context.shm_ring_bytes) + " bytes");
+    return true;
+}
+
+//Relays everything written to a connection's ring since it was last drained, returns false once the connection should be dropped
+static bool epoll_drain_ring(epoll_context& context, epoll_worker_state& worker, connection_handle handle) {
+    epoll_connection_details& details = *worker.connections.cold(handle);
+    uint64_t count;
+    if (read(details.ring->data_ready_fd(), &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        string call = "worker[" + to_string(worker.index) + "]: read(ring)";
+        errno_to_cerr(call.c_str());
+        return false;
+    }
+
+    const uint64_t received_at = metrics_clock();
+    details.timeouts.read_at = received_at;
+    bool keep = true;
+    if (!details.ring->drain([&](string_view message) { return keep = epoll_relay(context, worker, handle, message, received_at); })) {
+        log_write(log_level::warning, "worker[" + to_string(worker.index) + "]: " + to_string(details.addr) + " Corrupt shared ring, disconnecting");
+        return false;
+    }
+    return keep;
+}
+
+//Reads everything available and broadcasts each completed frame, returns false once the connection should be dropped
+static bool epoll_read_all(epoll_context& context, epoll_worker_state& worker, connection_handle handle) {
+    //Broadcasting neither inserts nor erases, so both stay put for the whole call
+    epoll_connection& connection = *worker.connections.hot(handle);
+    epoll_connection_details& details = *worker.connections.cold(handle);
+    while (true) {
+        ssize_t received = details.frames.fill(connection.sock);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            string call = "worker[" + to_string(worker.index) + "]: recv(" + to_string(details.addr) + ")";
+            errno_to_cerr(call.c_str());
+            return false;
+        } else if (received == 0) {
+            return false;
+        }
+
+        const uint64_t received_at = metrics_clock();
+        details.timeouts.read_at = received_at;
+        string_view message;
+        while (details.frames.next(message)) {
+            if (negotiate_binary(message, details.frames, connection.outbound)) {
+                if (!connection.dirty) {
+                    connection.dirty = true;
+                    worker.dirty.push_back(handle);
+                }
+                continue;
+            }
+            if (message == SHM_REQUEST) {
+                if (!epoll_open_ring(context, worker, handle)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!epoll_relay(context, worker, handle, message, received_at)) {
+                return false;
+            }
+        }
+    }
+}
+
+static void epoll_disconnect(epoll_worker_state& worker, connection_handle handle) {
+    epoll_connection& connection = *worker.connections.hot(handle);
+    const peer_address addr = worker.connections.cold(handle)->addr;
+
+    //Best effort, a client that sent .exit still gets what was queued before it
+    if (!connection.outbound.empty()) {
+        connection.outbound.flush(connection.sock);
+    }
+    if (epoll_ctl(worker.epoll, EPOLL_CTL_DEL, connection.sock, nullptr) == -1) {
+        string call = "worker[" + to_string(worker.index) + "]: epoll_ctl(EPOLL_CTL_DEL, " + to_string(addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+    //The client still holds the eventfd, closing it here would not take it out of the epoll set
+    epoll_connection_details& details = *worker.connections.cold(handle);
+    if (details.ring != nullptr) {
+        if (epoll_ctl(worker.epoll, EPOLL_CTL_DEL, details.ring->data_ready_fd(), nullptr) == -1) {
+            string call = "worker[" + to_string(worker.index) + "]: epoll_ctl(EPOLL_CTL_DEL, ring)";
+            errno_to_cerr(call.c_str());
+        }
+        worker.free_rings.push_back(details.ring_id);
+    }
+    if (shutdown(connection.sock, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        string call = "worker[" + to_string(worker.index) + "]: shutdown(" + to_string(addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+    if (close(connection.sock) == -1) {
+        string call = "worker[" + to_string(worker.index) + "]: close(" + to_string(addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+    metrics_add(counter::disconnects);
+    log_write(log_level::info, to_string(addr) + " Disconnected");
+
+    worker.rooms.remove(handle, worker.connections.cold(handle)->rooms);
+    worker.connections.erase(handle);
+}
+
+//Runs the timer of every connection due by now, evictions are closed with the rest of the round and heartbeats flushed with it
+static void epoll_expire(epoll_context& context, epoll_worker_state& worker, uint64_t now) {
+    worker.timers.advance(now, worker.expired);
+    for (uint64_t key : worker.expired) {
+        const connection_handle handle = connection_handle::unpack(key);
+        epoll_connection* connection = worker.connections.hot(handle);
+        //Closed since, nothing left to time
+        if (connection == nullptr || connection->closing) {
+            continue;
+        }
+        epoll_connection_details& details = *worker.connections.cold(handle);
+
+        uint64_t next = 0;
+        switch (check_timeouts(details.timeouts, connection->outbound, context.timeouts, now, next)) {
+            case timeout_action::idle:
+                log_write(log_level::warning, "worker[" + to_string(worker.index) + "]: " + to_string(details.addr) + " Idle, disconnecting");
+                metrics_add(counter::idle_timeouts);
+                epoll_close_later(worker, handle);
+                continue;
+            case timeout_action::stalled:
+                log_write(log_level::warning, "worker[" + to_string(worker.index) + "]: " + to_string(details.addr) + " Write stalled, disconnecting");
+                metrics_add(counter::write_timeouts);
+                connection->outbound.clear();
+                epoll_close_later(worker, handle);
+                continue;
+            case timeout_action::heartbeat:
+                metrics_add(counter::heartbeats);
+                epoll_enqueue(context, worker, *connection, handle, heartbeat_message());
+                break;
+            case timeout_action::none:
+                break;
+        }
+        if (!connection->closing) {
+            worker.timers.schedule(key, next);
+        }
+    }
+    worker.expired.clear();
+}
+
+//Cores are picked from the ones the process may run on, cycling when there are more workers than cores
+static void pin_to_core(const int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        string call = "worker[" + to_string(index) + "]: sched_getaffinity(...)";
+        errno_to_cerr(call.c_str());
+        return;
+    }
+
+    int remaining = index % CPU_COUNT(&allowed);
+    int core = 0;
+    for (; core < CPU_SETSIZE; core++) {
+        if (CPU_ISSET(core, &allowed) && remaining-- == 0) {
+            break;
+        }
+    }
+
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+    if (error != 0) {
+        errno = error;
+        string call = "worker[" + to_string(index) + "]: pthread_setaffinity_np(...)";
+        errno_to_cerr(call.c_str());
+    }
+}
+
+void epoll_worker(epoll_context& context, const int index, bool& worker_failure) {
+    worker_failure = false;
+
+    if (context.pin_workers) {
+        pin_to_core(index);
+    }
+
+    epoll_worker_state worker;
+    worker.index = index;
+    worker.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (worker.epoll == -1) {
+        string call = "worker[" + to_string(index) + "]: epoll_create1(...)";
+        errno_to_cerr(call.c_str());
+        worker_failure = true;
+        return;
+    }
+    defer([&]() {
+        for (size_t i = 0; i < worker.connections.size(); i++) {
+            close(worker.connections.hot_at(i).sock);
+        }
+        if (close(worker.epoll) == -1) {
+            errno_to_cerr("close(epoll)");
+        }
+    });
+
+    //Every listener shares LISTENER_TAG, an event for any of them drains them all
+    vector<int> listeners = { context.listeners[index] };
+    listeners.insert(listeners.end(), context.shared_listeners.begin(), context.shared_listeners.end());
+    for (size_t i = 0; i < listeners.size(); i++) {
+        epoll_event listener_event = {};
+        listener_event.events = EPOLLIN | EPOLLET | (i != 0 || context.exclusive_accept ? static_cast<uint32_t>(EPOLLEXCLUSIVE) : 0);
+        listener_event.data.u64 = LISTENER_TAG;
+        if (epoll_ctl(worker.epoll, EPOLL_CTL_ADD, listeners[i], &listener_event) == -1) {
+            string call = "worker[" + to_string(index) + "]: epoll_ctl(EPOLL_CTL_ADD, listener)";
+            errno_to_cerr(call.c_str());
+            worker_failure = true;
+            return;
+        }
+    }
+
+    epoll_event inbox_event = {};
+    inbox_event.events = EPOLLIN;
+    inbox_event.data.u64 = INBOX_TAG;
+    if (epoll_ctl(worker.epoll, EPOLL_CTL_ADD, context.bus.wake(index), &inbox_event) == -1) {
+        string call = "worker[" + to_string(index) + "]: epoll_ctl(EPOLL_CTL_ADD, wake)";
+        errno_to_cerr(call.c_str());
+        worker_failure = true;
+        return;
+    }
+
+    epoll_event events[MAX_EPOLL_EVENTS];
+    const outbound_config& outbound = context.outbound;
+    worker.timers = timer_wheel(metrics_clock());
+    while (true) {
+        int ready;
+        const uint64_t deadline = min(worker.dirty.empty() ? UINT64_MAX : worker.flush_deadline, worker.timers.next_deadline());
+        if (deadline == UINT64_MAX) {
+            ready = epoll_wait(worker.epoll, events, MAX_EPOLL_EVENTS, -1);
+        } else {
+            //Flush windows are microseconds, finer than epoll_wait's timeout
+            const uint64_t now = metrics_clock();
+            const uint64_t wait_ns = deadline > now ? deadline - now : 0;
+            const timespec timeout = { static_cast<time_t>(wait_ns / 1000000000), static_cast<long>(wait_ns % 1000000000) };
+            ready = epoll_pwait2(worker.epoll, events, MAX_EPOLL_EVENTS, &timeout, nullptr);
+        }
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            string call = "worker[" + to_string(index) + "]: epoll_wait(...)";
+            errno_to_cerr(call.c_str());
+            worker_failure = true;
+            return;
+        }
+
+        const uint64_t now = outbound.flush_window_us == 0 ? 0 : metrics_clock();
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.u64 == LISTENER_TAG) {
+                for (int listener : listeners) {
+                    if (!epoll_accept_all(context, worker, listener)) {
+                        worker_failure = true;
+                        return;
+                    }
+                }
+                continue;
+            }
+
+            if (events[i].data.u64 == INBOX_TAG) {
+                epoll_drain_inbox(context, worker);
+                continue;
+            }
+
+            if (events[i].data.u64 < (uint64_t(1) << 32)) {
+                const connection_handle handle = worker.rings[events[i].data.u64 - RING_TAG_BASE];
+                epoll_connection* connection = worker.connections.hot(handle);
+                if (connection != nullptr && !connection->closing && !epoll_drain_ring(context, worker, handle)) {
+                    epoll_close_later(worker, handle);
+                }
+                continue;
+            }
+
+            const connection_handle handle = connection_handle::unpack(events[i].data.u64);
+            epoll_connection* connection = worker.connections.hot(handle);
+            if (connection == nullptr || connection->closing) {
+                continue;
+            }
+
+            //Zerocopy completions raise EPOLLERR without anything being wrong
+            bool keep = !(events[i].events & EPOLLERR) || (connection->outbound.zerocopy_threshold != 0 && connection->outbound.reap_zerocopy(connection->sock));
+            //A queue still inside its window is left to the dirty pass
+            if (keep && (events[i].events & EPOLLOUT) && connection->outbound.due(now, outbound)) {
+                epoll_flush(worker, handle);
+            }
+            if (keep && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                keep = epoll_read_all(context, worker, handle);
+            }
+
+            if (!keep) {
+                epoll_close_later(worker, handle);
+            }
+        }
+
+        if (worker.timers.size() != 0) {
+            epoll_expire(context, worker, metrics_clock());
+        }
+
+        size_t held = 0;
+        worker.flush_deadline = UINT64_MAX;
+        for (const connection_handle& handle : worker.dirty) {
+            epoll_connection* connection = worker.connections.hot(handle);
+            if (connection == nullptr) {
+                continue;
+            }
+            if (!connection->closing && !connection->outbound.due(now, outbound)) {
+                worker.flush_deadline = min(worker.flush_deadline, connection->outbound.deadline(outbound));
+                worker.dirty[held++] = handle;
+                continue;
+            }
+            connection->dirty = false;
+            if (!connection->closing) {
+                epoll_flush(worker, handle);
+            }
+        }
+        worker.dirty.resize(held);
+
+        //Flushing may close more connections, so this runs last
+        for (const connection_handle& handle : worker.closed) {
+            epoll_disconnect(worker, handle);
+        }
+        worker.closed.clear();
+    }
+}
+
+static int run_epoll_workers(epoll_context& context) {
+    if (!context.bus.open()) {
+        errno_to_cerr("eventfd(...)");
+        return EXIT_FAILURE;
+    }
+
+    vector<thread> workers;
+    std::unique_ptr<bool[]> worker_failures = std::make_unique<bool[]>(context.bus.size());
+    for (size_t i = 0; i < context.bus.size(); i++) {
+        workers.emplace_back(epoll_worker, ref(context), i, ref(worker_failures[i]));
+    }
+
+    int result = EXIT_SUCCESS;
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+        if (worker_failures[i]) {
+            result = EXIT_FAILURE;
+        }
+    }
+
+    return result;
+}
+
+int epoll_workers(const vector<int>& listeners, const server_options& options) {
+    epoll_context context = epoll_context(MAX_HARDWARE_CONCURRENCY);
+    context.pin_workers = options.pin_workers;
+    context.outbound = options.outbound;
+    context.timeouts = options.timeouts;
+    context.shm_ring_bytes = options.shm_ring_bytes;
+    context.exclusive_accept = true;
+    for (int& worker_listener : context.listeners) {
+        worker_listener = listeners[0];
+    }
+    context.shared_listeners.assign(listeners.begin() + 1, listeners.end());
+
+    return run_epoll_workers(context);
+}
+
+int sharded_workers(const vector<int>& listeners, const server_options& options) {
+    epoll_context context = epoll_context(MAX_HARDWARE_CONCURRENCY);
+    context.pin_workers = options.pin_workers;
+    context.outbound = options.outbound;
+    context.timeouts = options.timeouts;
+    context.shm_ring_bytes = options.shm_ring_bytes;
+    context.listeners[0] = listeners[0];
+    //Local sockets have no SO_REUSEPORT hashing, workers take turns on them like epoll workers do
+    context.shared_listeners.assign(listeners.begin() + 1, listeners.end());
+    defer([&]() {
+        for (size_t i = 1; i < context.listeners.size(); i++) {
+            if (context.listeners[i] != -1 && close(context.listeners[i]) == -1) {
+                errno_to_cerr("close(listener)");
+            }
+        }
+    });
+
+    //The kernel hashes incoming connections across every SO_REUSEPORT listener, no worker ever accepts for another
+    for (size_t i = 1; i < context.listeners.size(); i++) {
+        context.listeners[i] = open_listener(true, options);
+        if (context.listeners[i] == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return run_epoll_workers(context);
+}
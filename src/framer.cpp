@@ -0,0 +1,207 @@
+#include "framer.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+using std::size_t;
+using std::string_view;
+using std::memchr;
+using std::memcpy;
+using std::memmove;
+
+//Packet mode keeps each record's length in front of it in the buffer, frames stay views into the one buffer
+using packet_length = uint32_t;
+
+framer::framer(size_t buffer_capacity)
+    : capacity(buffer_capacity) {}
+
+bool framer::make_room() {
+    //Allocated on first use so idle or placeholder connections cost nothing
+    if (!buffer) {
+        buffer.reset(new char[capacity]);
+    }
+
+    if (begin == end) {
+        begin = scanned = end = batch_end = 0;
+        return true;
+    }
+
+    //A record is read whole or cut short, so packet mode wants all the free space in one piece
+    if (end != capacity && (mode_ != frame_mode::packet || begin == 0)) {
+        return true;
+    }
+
+    if (begin == 0) {
+        return false;
+    }
+
+    memmove(buffer.get(), buffer.get() + begin, end - begin);
+    if (mode_ == frame_mode::text) {
+        scanned -= begin;
+    }
+    if (batch_end != 0) {
+        batch_end -= begin;
+    }
+    end -= begin;
+    begin = 0;
+    return true;
+}
+
+ssize_t framer::fill(int sock, int flags) {
+    if (!make_room()) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (mode_ == frame_mode::packet) {
+        return fill_packet(sock, flags);
+    }
+
+    ssize_t received = recv(sock, buffer.get() + end, capacity - end, flags);
+    if (received > 0) {
+        end += received;
+        metrics_add(counter::bytes_in, received);
+    }
+    return received;
+}
+
+ssize_t framer::fill_packet(int sock, int flags) {
+    if (capacity - end <= sizeof(packet_length)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    iovec payload = { buffer.get() + end + sizeof(packet_length), capacity - end - sizeof(packet_length) };
+    msghdr header = {};
+    header.msg_iov = &payload;
+    header.msg_iovlen = 1;
+    ssize_t received = recvmsg(sock, &header, flags);
+    if (received > 0 && (header.msg_flags & MSG_TRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (received > 0) {
+        const packet_length length = received;
+        memcpy(buffer.get() + end, &length, sizeof(length));
+        end += sizeof(length) + received;
+        metrics_add(counter::bytes_in, received);
+    }
+    return received;
+}
+
+size_t framer::append(const char* data, size_t size) {
+    if (!make_room()) {
+        return 0;
+    }
+
+    if (mode_ == frame_mode::packet) {
+        //The whole record or nothing
+        if (capacity - end < sizeof(packet_length) + size) {
+            return 0;
+        }
+        const packet_length length = size;
+        memcpy(buffer.get() + end, &length, sizeof(length));
+        memcpy(buffer.get() + end + sizeof(length), data, size);
+        end += sizeof(length) + size;
+        metrics_add(counter::bytes_in, size);
+        return size;
+    }
+
+    size_t copied = capacity - end < size ? capacity - end : size;
+    memcpy(buffer.get() + end, data, copied);
+    end += copied;
+    metrics_add(counter::bytes_in, copied);
+    return copied;
+}
+
+bool framer::next(string_view& frame) {
+    if (mode_ == frame_mode::binary) {
+        return next_binary(frame);
+    }
+
+    if (mode_ == frame_mode::packet) {
+        if (begin == end) {
+            return false;
+        }
+        packet_length length;
+        memcpy(&length, buffer.get() + begin, sizeof(length));
+        frame = string_view(buffer.get() + begin + sizeof(length), length);
+        begin += sizeof(length) + length;
+        metrics_add(counter::frames_in);
+        return true;
+    }
+
+    if (scanned == end) {
+        return false;
+    }
+
+    //glibc's memchr is vectorized, far cheaper than testing a byte at a time
+    const char* terminator = static_cast<const char*>(memchr(buffer.get() + scanned, '\0', end - scanned));
+    if (terminator == nullptr) {
+        scanned = end;
+        return false;
+    }
+
+    const size_t terminator_index = terminator - buffer.get();
+    frame = string_view(buffer.get() + begin, terminator_index - begin);
+    begin = scanned = terminator_index + 1;
+    metrics_add(counter::frames_in);
+    return true;
+}
+
+bool framer::next_binary(string_view& frame) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(buffer.get());
+    while (true) {
+        if (batch_end != 0) {
+            uint64_t length;
+            const size_t length_size = decode_varint(bytes + begin, batch_end - begin, length);
+            if (length_size == 0 || length > batch_end - begin - length_size) {
+                //Ran out of batch, or the lengths inside it do not add up, either way the rest is skipped
+                begin = batch_end;
+                batch_end = 0;
+                continue;
+            }
+
+            frame = string_view(buffer.get() + begin + length_size, length);
+            begin += length_size + length;
+            if (begin == batch_end) {
+                batch_end = 0;
+            }
+            metrics_add(counter::frames_in);
+            return true;
+        }
+
+        uint64_t length;
+        const size_t length_size = decode_varint(bytes + begin, end - begin, length);
+        //A header that never ends keeps the buffer from draining, fill() then fails with EMSGSIZE
+        if (length_size == 0 || length > end - begin - length_size) {
+            return false;
+        }
+
+        const size_t payload = begin + length_size + 1;
+        const size_t payload_end = begin + length_size + length;
+        if (length == 0) {
+            //No type byte, nothing to deliver
+            begin += length_size;
+            continue;
+        }
+
+        switch (static_cast<message_type>(bytes[begin + length_size])) {
+            case message_type::chat:
+                frame = string_view(buffer.get() + payload, payload_end - payload);
+                begin = payload_end;
+                metrics_add(counter::frames_in);
+                return true;
+            case message_type::batch:
+                begin = payload;
+                batch_end = payload == payload_end ? 0 : payload_end;
+                continue;
+            default:
+                //Types from a newer peer are skipped whole
+                begin = payload_end;
+                continue;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "protocol.hpp"
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <sys/types.h>
+
+//Largest frame a connection may send, NUL-terminated, length-prefixed or one record
+constexpr const size_t MAX_FRAME_SIZE = 64 * 1024;
+
+//Splits a byte stream into NUL-terminated or length-prefixed frames inside one fixed buffer allocated once per connection, frames are views that stay valid until the next fill() or append()
+struct framer {
+    framer(size_t buffer_capacity = MAX_FRAME_SIZE);
+
+    framer(framer&&) = default;
+    framer& operator=(framer&&) = default;
+
+    //One recv() into the free space, same results as recv(), -1 with EMSGSIZE once a single frame outgrows the buffer
+    //In packet mode one record, -1 with EMSGSIZE for one longer than the free space rather than a silently cut short frame
+    ssize_t fill(int sock, int flags = 0);
+
+    //Copies bytes received elsewhere, returns how many fit, in packet mode data is one whole record or nothing is copied
+    size_t append(const char* data, size_t size);
+
+    //Next complete message without its terminator or header, the messages of a batch one at a time, false once only a partial frame remains
+    bool next(std::string_view& frame);
+
+    //Bytes already buffered are read in the new mode
+    void set_mode(frame_mode new_mode) {
+        mode_ = new_mode;
+    }
+
+    frame_mode mode() const {
+        return mode_;
+    }
+
+    bool empty() const {
+        return begin == end;
+    }
+
+private:
+    //Moves a trailing partial frame to the front, returns false when no space could be made
+    bool make_room();
+
+    ssize_t fill_packet(int sock, int flags);
+
+    bool next_binary(std::string_view& frame);
+
+    std::unique_ptr<char[]> buffer;
+    size_t capacity = 0;
+    size_t begin = 0;
+    //Bytes before scanned hold no terminator, so each byte is searched once however the frame arrives
+    size_t scanned = 0;
+    size_t end = 0;
+    frame_mode mode_ = frame_mode::text;
+    //While inside a batch begin walks its messages and batch_end is where the batch frame ends, 0 otherwise
+    size_t batch_end = 0;
+};
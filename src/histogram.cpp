@@ -0,0 +1,82 @@
+#include "histogram.hpp"
+#include <algorithm>
+#include <bit>
+
+using std::size_t;
+using std::bit_width;
+
+histogram::histogram()
+    : counts(HISTOGRAM_BUCKET_COUNT) {}
+
+size_t histogram::index_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKET_COUNT) {
+        return value;
+    }
+    //Keeps the top HISTOGRAM_SUB_BUCKET_BITS + 1 bits, the leading one selects the power of two
+    const unsigned shift = bit_width(value) - 1 - HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKET_COUNT + ((value >> shift) - HISTOGRAM_SUB_BUCKET_COUNT);
+}
+
+uint64_t histogram::highest_in(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKET_COUNT) {
+        return index;
+    }
+    const unsigned shift = index / HISTOGRAM_SUB_BUCKET_COUNT - 1;
+    const uint64_t lowest = (index % HISTOGRAM_SUB_BUCKET_COUNT + HISTOGRAM_SUB_BUCKET_COUNT) << shift;
+    return lowest + ((uint64_t(1) << shift) - 1);
+}
+
+void histogram::record(uint64_t value, uint64_t times) {
+    if (times == 0) {
+        return;
+    }
+    counts[index_of(value)] += times;
+    total += times;
+    smallest = std::min(smallest, value);
+    largest = std::max(largest, value);
+    sum += static_cast<double>(value) * times;
+}
+
+void histogram::merge(const histogram& other) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    smallest = std::min(smallest, other.smallest);
+    largest = std::max(largest, other.largest);
+    sum += other.sum;
+}
+
+void histogram::clear() {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = 0;
+    smallest = UINT64_MAX;
+    largest = 0;
+    sum = 0;
+}
+
+uint64_t histogram::min() const {
+    return total == 0 ? 0 : smallest;
+}
+
+double histogram::mean() const {
+    return total == 0 ? 0 : sum / total;
+}
+
+uint64_t histogram::percentile(double fraction) const {
+    if (total == 0) {
+        return 0;
+    }
+
+    //Rank of the value wanted, at least the first one
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            //Never report past the largest value actually recorded
+            return std::min(highest_in(i), largest);
+        }
+    }
+    return largest;
+}
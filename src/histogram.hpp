@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//Bits of precision kept below each power of two, 7 keeps every bucket within 1% of the values it holds
+constexpr const unsigned HISTOGRAM_SUB_BUCKET_BITS = 7;
+constexpr const uint64_t HISTOGRAM_SUB_BUCKET_COUNT = uint64_t(1) << HISTOGRAM_SUB_BUCKET_BITS;
+
+//Values below HISTOGRAM_SUB_BUCKET_COUNT get one bucket each, every power of two above that gets HISTOGRAM_SUB_BUCKET_COUNT
+constexpr const size_t HISTOGRAM_BUCKET_COUNT = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKET_COUNT;
+
+//Log-linear histogram in the style of HdrHistogram, exact below 2^HISTOGRAM_SUB_BUCKET_BITS and bounded relative error above, with a fixed footprint whatever the range of values
+struct histogram {
+    histogram();
+
+    //times records the same value more than once, as when adding up bucket counts kept elsewhere
+    void record(uint64_t value, uint64_t times = 1);
+
+    //Adds every value other recorded
+    void merge(const histogram& other);
+
+    void clear();
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const;
+
+    uint64_t max() const {
+        return largest;
+    }
+
+    double mean() const;
+
+    //Highest value in the bucket holding the given fraction of recorded values, 0.999 for p999
+    uint64_t percentile(double fraction) const;
+
+    //Buckets are ordered by value, highest_in(i) is the largest value bucket i holds
+    size_t bucket_count() const {
+        return counts.size();
+    }
+
+    uint64_t bucket(size_t index) const {
+        return counts[index];
+    }
+
+    static uint64_t highest_in(size_t index);
+
+    //Bucket a value falls in, for callers keeping their own counts
+    static size_t index_of(uint64_t value);
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t smallest = UINT64_MAX;
+    uint64_t largest = 0;
+    //Kept as a double, sums of nanosecond latencies overflow 64 bits in long runs
+    double sum = 0;
+};
@@ -0,0 +1,403 @@
+#include "history.hpp"
+#include "main.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::shared_ptr;
+using std::make_shared;
+using std::lock_guard;
+using std::mutex;
+using std::to_string;
+using std::memcpy;
+using std::min;
+
+//Messages per write, each takes up to two vectors and the kernel rejects more than IOV_MAX
+constexpr const size_t MAX_REPLAY_MESSAGES = 256 < IOV_MAX / 2 ? 256 : IOV_MAX / 2;
+//Digits of a segment file name, every uint64_t fits and names sort like the offsets they start at
+constexpr const int SEGMENT_NAME_DIGITS = 20;
+
+static size_t record_size(size_t length) {
+    return (sizeof(uint32_t) + length + 1 + 3) & ~size_t(3);
+}
+
+static uint32_t record_length(const char* record) {
+    uint32_t length;
+    memcpy(&length, record, sizeof(length));
+    return length;
+}
+
+//Bytes a stored message takes on the wire
+static size_t wire_size(size_t length, frame_mode mode) {
+    switch (mode) {
+        case frame_mode::text:
+            return length + 1;
+        case frame_mode::binary:
+            return frame_header_size(length) + length;
+        default:
+            return length;
+    }
+}
+
+bool parse_history_command(string_view message, history_request& request) {
+    if (!message.starts_with(HISTORY_COMMAND)) {
+        return false;
+    }
+    string_view argument = message.substr(sizeof(HISTORY_COMMAND) - 1);
+    request.since = argument.starts_with(HISTORY_SINCE);
+    if (request.since) {
+        argument.remove_prefix(sizeof(HISTORY_SINCE) - 1);
+    }
+
+    //Anything but a number is an ordinary message that happens to start like the command
+    const std::from_chars_result parsed = std::from_chars(argument.data(), argument.data() + argument.size(), request.value);
+    return !argument.empty() && parsed.ec == std::errc() && parsed.ptr == argument.data() + argument.size();
+}
+
+history_segment::~history_segment() {
+    if (data != nullptr) {
+        munmap(data, size);
+    }
+    if (ends != nullptr) {
+        munmap(ends, capacity * sizeof(uint32_t));
+    }
+}
+
+static string segment_path(const string& directory, uint64_t first) {
+    char name[SEGMENT_NAME_DIGITS + 1];
+    std::snprintf(name, sizeof(name), "%0*llu", SEGMENT_NAME_DIGITS, static_cast<unsigned long long>(first));
+    return directory + '/' + name;
+}
+
+//Maps file at path, sized to size when creating it and taking whatever size it has otherwise, nullptr with errno set
+static void* map_file(const string& path, bool create, size_t& size) {
+    const int file = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (file == -1) {
+        return nullptr;
+    }
+    defer([&]() {
+        close(file);
+    });
+
+    if (create) {
+        //Blocks are allocated now rather than by the page faults of whoever appends
+        if (ftruncate(file, size) == -1) {
+            return nullptr;
+        }
+        posix_fallocate(file, 0, size);
+    } else {
+        struct stat status;
+        if (fstat(file, &status) == -1) {
+            return nullptr;
+        }
+        size = status.st_size;
+    }
+
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    return address == MAP_FAILED ? nullptr : address;
+}
+
+//nullptr once the failure has been reported
+static shared_ptr<history_segment> map_segment(const string& directory, uint64_t first, bool create, size_t size) {
+    shared_ptr<history_segment> segment = make_shared<history_segment>();
+    segment->first = first;
+    segment->path = segment_path(directory, first);
+    segment->size = size;
+    segment->data = static_cast<char*>(map_file(segment->path + ".log", create, segment->size));
+    //Every record takes at least 8 bytes, so this many ends always suffice
+    size_t index_size = segment->size / 8 * sizeof(uint32_t);
+    segment->ends = segment->data == nullptr ? nullptr : static_cast<uint32_t*>(map_file(segment->path + ".idx", create, index_size));
+    if (segment->ends == nullptr) {
+        string call = "mmap(" + segment->path + ")";
+        errno_to_cerr(call.c_str());
+        return nullptr;
+    }
+    segment->capacity = index_size / sizeof(uint32_t);
+    if (create) {
+        return segment;
+    }
+
+    //Ends only grow and unused ones are 0, anything a crash left half written is dropped from the back
+    segment->count = std::partition_point(segment->ends, segment->ends + segment->capacity, [](uint32_t end) { return end != 0; }) - segment->ends;
+    while (segment->count != 0) {
+        const size_t last = segment->count - 1;
+        const size_t start = last == 0 ? 0 : segment->ends[last - 1];
+        const size_t end = segment->ends[last];
+        if (end <= segment->size && start + sizeof(uint32_t) <= end && start + record_size(record_length(segment->data + start)) == end) {
+            break;
+        }
+        segment->count--;
+    }
+    return segment;
+}
+
+static void remove_segment(const history_segment& segment) {
+    for (const char* extension : { ".log", ".idx" }) {
+        const string file = segment.path + extension;
+        if (unlink(file.c_str()) == -1 && errno != ENOENT) {
+            string call = "unlink(" + file + ")";
+            errno_to_cerr(call.c_str());
+        }
+    }
+}
+
+bool message_history::add_segment(uint64_t first) {
+    shared_ptr<history_segment> segment = map_segment(path, first, true, segment_size);
+    if (segment == nullptr) {
+        return false;
+    }
+    segments.push_back(std::move(segment));
+
+    //A replay still reading the oldest keeps it mapped until it is done
+    while (segments.size() > segment_count) {
+        remove_segment(*segments.front());
+        segments.erase(segments.begin());
+    }
+    return true;
+}
+
+bool message_history::open(const string& directory, size_t size, size_t count) {
+    segment_size = size;
+    segment_count = count;
+    if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+        string call = "mkdir(" + directory + ")";
+        errno_to_cerr(call.c_str());
+        return false;
+    }
+
+    DIR* listing = opendir(directory.c_str());
+    if (listing == nullptr) {
+        string call = "opendir(" + directory + ")";
+        errno_to_cerr(call.c_str());
+        return false;
+    }
+    vector<uint64_t> found;
+    for (dirent* entry = readdir(listing); entry != nullptr; entry = readdir(listing)) {
+        const string_view name = entry->d_name;
+        uint64_t first;
+        if (name.size() == SEGMENT_NAME_DIGITS + 4 && name.ends_with(".log") && std::from_chars(name.data(), name.data() + SEGMENT_NAME_DIGITS, first).ptr == name.data() + SEGMENT_NAME_DIGITS) {
+            found.push_back(first);
+        }
+    }
+    closedir(listing);
+    std::sort(found.begin(), found.end());
+
+    for (uint64_t first : found) {
+        shared_ptr<history_segment> segment = map_segment(directory, first, false, 0);
+        if (segment == nullptr) {
+            return false;
+        }
+        //A segment that does not carry on from the one before starts the history over from it
+        if (!segments.empty() && segments.back()->first + segments.back()->count != first) {
+            for (const shared_ptr<history_segment>& stale : segments) {
+                remove_segment(*stale);
+            }
+            segments.clear();
+        }
+        segments.push_back(std::move(segment));
+    }
+
+    path = directory;
+    next = segments.empty() ? 0 : segments.back()->first + segments.back()->count;
+    if (segments.empty() || segments.back()->count == segments.back()->capacity) {
+        return add_segment(next);
+    }
+    while (segments.size() > segment_count) {
+        remove_segment(*segments.front());
+        segments.erase(segments.begin());
+    }
+    return true;
+}
+
+void message_history::append(string_view message) {
+    const size_t size = record_size(message.size());
+    lock_guard<mutex> guard(lock);
+    history_segment* segment = segments.back().get();
+    size_t used = segment->count == 0 ? 0 : segment->ends[segment->count - 1];
+    if (segment->count == segment->capacity || used + size > segment->size) {
+        if (size > segment_size || !add_segment(next)) {
+            return;
+        }
+        segment = segments.back().get();
+        used = 0;
+    }
+
+    const uint32_t length = message.size();
+    memcpy(segment->data + used, &length, sizeof(length));
+    memcpy(segment->data + used + sizeof(length), message.data(), message.size());
+    segment->data[used + sizeof(length) + message.size()] = '\0';
+    segment->ends[segment->count] = used + size;
+    segment->count++;
+    next++;
+}
+
+void message_history::start(history_cursor& cursor) {
+    lock_guard<mutex> guard(lock);
+    const uint64_t oldest = segments.front()->first;
+    const history_request& wanted = cursor.wanted_messages;
+    uint64_t from;
+    if (wanted.since) {
+        from = std::clamp(wanted.value, oldest, next);
+    } else {
+        from = next - min(wanted.value, next - oldest);
+    }
+
+    cursor.requested = false;
+    cursor.segments.clear();
+    for (const shared_ptr<history_segment>& segment : segments) {
+        if (segment->first + segment->count > from) {
+            cursor.segments.push_back(segment);
+        }
+    }
+    cursor.segment = 0;
+    cursor.index = cursor.segments.empty() || from < cursor.segments.front()->first ? 0 : from - cursor.segments.front()->first;
+    cursor.end_index = cursor.segments.empty() ? 0 : cursor.segments.back()->count;
+    cursor.sent = 0;
+    cursor.trailer = HISTORY_COMMAND + to_string(next);
+}
+
+//Steps past segments the replay is done with, false once every message is out
+static bool next_message(const vector<shared_ptr<const history_segment>>& segments, size_t end_index, size_t& segment, size_t& index) {
+    while (segment < segments.size()) {
+        const size_t end = segment + 1 == segments.size() ? end_index : segments[segment]->count;
+        if (index < end) {
+            return true;
+        }
+        segment++;
+        index = 0;
+    }
+    return false;
+}
+
+ssize_t history_cursor::send_packets(int sock) {
+    iovec vectors[MAX_REPLAY_MESSAGES];
+    mmsghdr headers[MAX_REPLAY_MESSAGES] = {};
+    size_t count = 0;
+    size_t walked_segment = segment;
+    size_t walked_index = index;
+    while (count < MAX_REPLAY_MESSAGES && next_message(segments, end_index, walked_segment, walked_index)) {
+        const char* record = segments[walked_segment]->record(walked_index++);
+        vectors[count++] = { const_cast<char*>(record) + sizeof(uint32_t), record_length(record) };
+    }
+    if (count < MAX_REPLAY_MESSAGES) {
+        vectors[count++] = { trailer.data(), trailer.size() };
+    }
+    for (size_t i = 0; i < count; i++) {
+        headers[i].msg_hdr.msg_iov = &vectors[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int sent_records = sendmmsg(sock, headers, count, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent_records <= 0) {
+        return sent_records;
+    }
+    size_t written = 0;
+    for (int i = 0; i < sent_records; i++) {
+        written += headers[i].msg_len;
+        if (next_message(segments, end_index, segment, index)) {
+            index++;
+        } else {
+            trailer.clear();
+            segments.clear();
+        }
+    }
+    metrics_add(counter::bytes_out, written);
+    return written;
+}
+
+ssize_t history_cursor::send(int sock, frame_mode mode) {
+    if (mode == frame_mode::packet) {
+        return send_packets(sock);
+    }
+
+    //Messages go out of the mapping itself, only binary headers are built here
+    iovec vectors[MAX_REPLAY_MESSAGES * 2 + 2];
+    uint8_t headers[MAX_REPLAY_MESSAGES + 1][MAX_FRAME_HEADER_SIZE];
+    size_t count = 0;
+    size_t messages = 0;
+    size_t skip = sent;
+    size_t walked_segment = segment;
+    size_t walked_index = index;
+    auto add = [&](const char* payload, size_t length) {
+        if (mode == frame_mode::text) {
+            vectors[count++] = { const_cast<char*>(payload) + skip, length + 1 - skip };
+        } else {
+            const size_t header_size = encode_frame_header(message_type::chat, length, headers[messages]);
+            if (skip < header_size) {
+                vectors[count++] = { headers[messages] + skip, header_size - skip };
+                skip = 0;
+            } else {
+                skip -= header_size;
+            }
+            vectors[count++] = { const_cast<char*>(payload) + skip, length - skip };
+        }
+        skip = 0;
+        messages++;
+    };
+    while (messages < MAX_REPLAY_MESSAGES && next_message(segments, end_index, walked_segment, walked_index)) {
+        const char* record = segments[walked_segment]->record(walked_index++);
+        add(record + sizeof(uint32_t), record_length(record));
+    }
+    if (messages < MAX_REPLAY_MESSAGES) {
+        add(trailer.c_str(), trailer.size());
+    }
+
+    msghdr header = {};
+    header.msg_iov = vectors;
+    header.msg_iovlen = count;
+    //The trailer leaves without MSG_MORE, the kernel would otherwise hold back the end of the replay
+    const int more = messages == MAX_REPLAY_MESSAGES ? MSG_MORE : 0;
+    const ssize_t written = sendmsg(sock, &header, MSG_NOSIGNAL | MSG_DONTWAIT | more);
+    if (written <= 0) {
+        return written;
+    }
+    metrics_add(counter::bytes_out, written);
+
+    size_t remaining = written;
+    while (remaining != 0) {
+        const bool message = next_message(segments, end_index, segment, index);
+        const size_t left = (message ? wire_size(record_length(segments[segment]->record(index)), mode) : wire_size(trailer.size(), mode)) - sent;
+        if (remaining < left) {
+            sent += remaining;
+            break;
+        }
+        remaining -= left;
+        sent = 0;
+        if (message) {
+            index++;
+        } else {
+            trailer.clear();
+            segments.clear();
+        }
+    }
+    return written;
+}
+
+bool advance_replay(message_history& history, history_cursor& cursor, bool queue_empty, int sock, frame_mode mode) {
+    if (cursor.pending() && queue_empty) {
+        history.start(cursor);
+    }
+    while (cursor.streaming()) {
+        if (cursor.send(sock, mode) != -1) {
+            continue;
+        }
+        if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include "protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+//Every relayed message is appended to memory-mapped segment files in one directory, numbered by an offset that keeps counting across restarts
+//".history <count>" replays the last count messages, ".history since <offset>" every one from offset on, both end with ".history <next offset>"
+//A client saving that offset asks for what it missed after reconnecting, messages broadcast while its replay starts may reach it twice
+constexpr const char HISTORY_COMMAND[] = ".history ";
+constexpr const char HISTORY_SINCE[] = "since ";
+
+//Data bytes of one segment file, and segments kept before the oldest is deleted
+constexpr const size_t DEFAULT_HISTORY_SEGMENT_SIZE = 16 * 1024 * 1024;
+constexpr const size_t DEFAULT_HISTORY_SEGMENTS = 16;
+constexpr const size_t MIN_HISTORY_SEGMENT_SIZE = 1024 * 1024;
+constexpr const size_t MAX_HISTORY_SEGMENT_SIZE = 1024 * 1024 * 1024;
+
+struct history_request {
+    //Last count messages, or from offset on
+    bool since = false;
+    uint64_t value = 0;
+};
+
+//Recognizes HISTORY_COMMAND, false when message is not one and should be relayed
+bool parse_history_command(std::string_view message, history_request& request);
+
+//Messages first to first + count, each stored as a 4 byte length, the message and a NUL, at a 4 byte boundary
+//The NUL makes a stored message its own text frame, so a text replay is sent straight out of the mapping
+//The .idx file beside it holds where each message ends, so any offset is found without scanning
+struct history_segment {
+    uint64_t first = 0;
+    char* data = nullptr;
+    size_t size = 0;
+    uint32_t* ends = nullptr;
+    size_t capacity = 0;
+    //Only grows, under message_history's lock, while this is the newest segment
+    size_t count = 0;
+    std::string path;
+
+    ~history_segment();
+
+    //Where the message at index starts, its length first
+    const char* record(size_t index) const {
+        return data + (index == 0 ? 0 : ends[index - 1]);
+    }
+};
+
+//A replay in progress on one connection, written by its owner ahead of anything it queued
+//Requested first, it only starts once the queue is empty so nothing queued before the request ends up behind it
+struct history_cursor {
+    bool pending() const {
+        return requested;
+    }
+
+    bool streaming() const {
+        return !trailer.empty();
+    }
+
+    bool active() const {
+        return requested || streaming();
+    }
+
+    void request(const history_request& wanted) {
+        requested = true;
+        wanted_messages = wanted;
+    }
+
+    //One non-blocking write of as much of the replay as fits, bytes written or -1 with EAGAIN once the socket is full
+    //In packet mode one sendmmsg() of a record per message instead
+    ssize_t send(int sock, frame_mode mode);
+
+private:
+    friend struct message_history;
+
+    ssize_t send_packets(int sock);
+
+    bool requested = false;
+    history_request wanted_messages;
+    //Segments the replay covers, kept mapped while it runs even after the history deleted them
+    std::vector<std::shared_ptr<const history_segment>> segments;
+    size_t segment = 0;
+    //Next message of segments[segment], and where the newest segment's share ends
+    size_t index = 0;
+    size_t end_index = 0;
+    //Bytes of the message, or of the trailer once every message is out, already written
+    size_t sent = 0;
+    //".history <next offset>" sent last, empty once the replay is done
+    std::string trailer;
+};
+
+//Appends from every thread are serialized by one lock, each is a copy into the mapping
+//Replays read the mapped segments without it, a snapshot of where they end is all they take under it
+struct message_history {
+    //Opens or creates directory and maps what earlier runs left there, false once the failure has been reported
+    bool open(const std::string& directory, size_t segment_size, size_t segment_count);
+
+    bool enabled() const {
+        return !path.empty();
+    }
+
+    //Stored at the next offset, lost instead when it outgrows a segment or the next segment could not be created
+    void append(std::string_view message);
+
+    //Snapshots what cursor.request() asked for so the replay can start
+    void start(history_cursor& cursor);
+
+private:
+    //false once the failure has been reported
+    bool add_segment(uint64_t first);
+
+    std::mutex lock;
+    std::string path;
+    size_t segment_size = DEFAULT_HISTORY_SEGMENT_SIZE;
+    size_t segment_count = DEFAULT_HISTORY_SEGMENTS;
+    std::vector<std::shared_ptr<history_segment>> segments;
+    uint64_t next = 0;
+};
+
+//Called by a connection's owner before it flushes the queue, which must be left alone while the cursor is streaming
+//False with errno set on a socket error
+bool advance_replay(message_history& history, history_cursor& cursor, bool queue_empty, int sock, frame_mode mode);
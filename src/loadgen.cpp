@@ -0,0 +1,452 @@
+#include "main.hpp"
+#include "coroutine.hpp"
+#include "histogram.hpp"
+#include "transport.hpp"
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::cout;
+using std::cerr;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::unique_ptr;
+using std::make_unique;
+using std::make_shared;
+using std::from_chars;
+using std::to_string;
+
+constexpr const char CONNECTIONS_OPTION[] = "--connections";
+constexpr const char RATE_OPTION[] = "--rate";
+constexpr const char SIZE_OPTION[] = "--size";
+constexpr const char DURATION_OPTION[] = "--duration";
+constexpr const char WARMUP_OPTION[] = "--warmup";
+constexpr const char ENGINE_OPTION[] = "--engine";
+
+//How often the pacer schedules open loop sends and checks the clock
+constexpr const long PACER_TICK_NS = 1000 * 1000;
+//Time after the last send for broadcasts still in flight to arrive
+constexpr const uint64_t DRAIN_NS = 1000 * 1000 * 1000;
+
+struct loadgen_options {
+    const char* host = nullptr;
+    //Only copied into the report, names the server method being measured
+    const char* engine = "unknown";
+    size_t connections = 10;
+    //Messages per second per connection, 0 sends the next one as soon as the previous echo returns
+    double rate = 0;
+    size_t size = 64;
+    double duration = 10;
+    double warmup = 1;
+};
+
+struct loadgen_connection {
+    int sock = -1;
+    size_t index = 0;
+    framer frames;
+    outbound_queue outbound;
+    coroutine_event queued;
+    //Closed loop only, the connection's own message came back
+    coroutine_event echoed;
+    //Open loop only, messages scheduled so far
+    uint64_t scheduled = 0;
+
+    loadgen_connection(coroutine_loop& loop, int connected, size_t connection_index)
+        : sock(connected), index(connection_index), queued(loop), echoed(loop) {}
+
+    ~loadgen_connection() {
+        if (close(sock) == -1) {
+            errno_to_cerr("close(...)");
+        }
+    }
+};
+
+struct loadgen {
+    coroutine_loop loop;
+    loadgen_options options;
+    //Every address the server argument resolved to, in the order to try them
+    vector<client_target> targets;
+    //The first that answered, later connections start from it
+    size_t target = 0;
+    vector<unique_ptr<loadgen_connection>> connections;
+
+    bool sending = true;
+    uint64_t start = 0;
+    //Only messages stamped inside [measured, end) are counted
+    uint64_t measured = 0;
+    uint64_t end = 0;
+
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t errors = 0;
+    //Nanoseconds from a message's stamp until each recipient read it
+    histogram latency;
+};
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool parse_count(const char* text, size_t& value) {
+    char* end = nullptr;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (*end != '\0' || parsed == 0) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+static bool parse_seconds(const char* text, double& value) {
+    char* end = nullptr;
+    double parsed = strtod(text, &end);
+    if (*end != '\0' || parsed < 0) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+static bool parse_loadgen_options(int option_count, char* options[], loadgen_options& parsed) {
+    for (int i = 0; i < option_count; i++) {
+        const bool has_value = i + 1 < option_count;
+        if (strcmp(options[i], CONNECTIONS_OPTION) == 0 && has_value) {
+            if (!parse_count(options[++i], parsed.connections)) {
+                cerr << CONNECTIONS_OPTION << " expects a positive count\n";
+                return false;
+            }
+        } else if (strcmp(options[i], RATE_OPTION) == 0 && has_value) {
+            if (!parse_seconds(options[++i], parsed.rate)) {
+                cerr << RATE_OPTION << " expects messages per second per connection, 0 for closed loop\n";
+                return false;
+            }
+        } else if (strcmp(options[i], SIZE_OPTION) == 0 && has_value) {
+            if (!parse_count(options[++i], parsed.size) || parsed.size >= MAX_FRAME_SIZE / 2) {
+                cerr << SIZE_OPTION << " expects a payload size in bytes below " << MAX_FRAME_SIZE / 2 << '\n';
+                return false;
+            }
+        } else if (strcmp(options[i], DURATION_OPTION) == 0 && has_value) {
+            if (!parse_seconds(options[++i], parsed.duration) || parsed.duration == 0) {
+                cerr << DURATION_OPTION << " expects a positive number of seconds\n";
+                return false;
+            }
+        } else if (strcmp(options[i], WARMUP_OPTION) == 0 && has_value) {
+            if (!parse_seconds(options[++i], parsed.warmup)) {
+                cerr << WARMUP_OPTION << " expects a number of seconds\n";
+                return false;
+            }
+        } else if (strcmp(options[i], ENGINE_OPTION) == 0 && has_value) {
+            parsed.engine = options[++i];
+        } else {
+            cerr << "Unknown loadgen option '" << options[i] << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+//Payload is "<connection> <sequence> <stamp> " padded with x up to the configured size
+static void loadgen_send(loadgen& run, loadgen_connection& connection, uint64_t sequence, uint64_t stamp) {
+    string payload = to_string(connection.index) + ' ' + to_string(sequence) + ' ' + to_string(stamp) + ' ';
+    if (payload.size() < run.options.size) {
+        payload.resize(run.options.size, 'x');
+    }
+    connection.outbound.push(make_shared<const string>(std::move(payload)));
+    connection.queued.notify();
+
+    if (stamp >= run.measured && stamp < run.end) {
+        run.sent++;
+    }
+}
+
+//false for frames that did not come from a loadgen connection
+static bool parse_echo(string_view frame, uint64_t& sender, uint64_t& stamp) {
+    //Every server method prefixes a broadcast with the sender's address and a space
+    size_t prefix = frame.find(' ');
+    if (prefix == string_view::npos) {
+        return false;
+    }
+    const char* position = frame.data() + prefix + 1;
+    const char* const last = frame.data() + frame.size();
+
+    uint64_t sequence = 0;
+    for (uint64_t* field : { &sender, &sequence, &stamp }) {
+        auto [end, error] = from_chars(position, last, *field);
+        if (error != std::errc() || end == last || *end != ' ') {
+            return false;
+        }
+        position = end + 1;
+    }
+    return true;
+}
+
+static task<> loadgen_writer(loadgen& run, loadgen_connection& connection) {
+    while (true) {
+        if (connection.outbound.empty()) {
+            co_await connection.queued;
+            continue;
+        }
+
+        bool sent = co_await async_send(run.loop, connection.sock, connection.outbound);
+        if (!sent) {
+            errno_to_cerr("send(...)");
+            run.errors++;
+            co_return;
+        }
+    }
+}
+
+static task<> loadgen_reader(loadgen& run, loadgen_connection& connection) {
+    string_view frame;
+    while (true) {
+        bool received = co_await async_read_frame(run.loop, connection.sock, connection.frames, frame);
+        if (!received) {
+            if (run.sending) {
+                errno_to_cerr("recv(...)");
+                run.errors++;
+            }
+            co_return;
+        }
+
+        const uint64_t now = now_ns();
+        uint64_t sender = 0;
+        uint64_t stamp = 0;
+        if (!parse_echo(frame, sender, stamp)) {
+            continue;
+        }
+
+        if (stamp >= run.measured && stamp < run.end) {
+            run.delivered++;
+            run.latency.record(now - stamp);
+        }
+        if (sender == connection.index && run.options.rate == 0) {
+            connection.echoed.notify();
+        }
+    }
+}
+
+static task<> loadgen_closed_loop(loadgen& run, loadgen_connection& connection) {
+    uint64_t sequence = 0;
+    while (run.sending) {
+        loadgen_send(run, connection, sequence++, now_ns());
+        co_await connection.echoed;
+    }
+}
+
+//Open loop messages carry the time they were due rather than the time they went out, so a stalled server cannot hide its stall by slowing the sender down
+static void loadgen_schedule(loadgen& run, uint64_t now) {
+    const uint64_t due = static_cast<uint64_t>((now - run.start) * run.options.rate / 1e9);
+    for (unique_ptr<loadgen_connection>& connection : run.connections) {
+        for (; connection->scheduled < due; connection->scheduled++) {
+            uint64_t stamp = run.start + static_cast<uint64_t>(connection->scheduled * 1e9 / run.options.rate);
+            loadgen_send(run, *connection, connection->scheduled, stamp);
+        }
+    }
+}
+
+//Drives the clock until the run and its drain period are over
+static task<bool> loadgen_pacer(loadgen& run) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer == -1) {
+        errno_to_cerr("timerfd_create(...)");
+        co_return false;
+    }
+    defer([&]() {
+        if (close(timer) == -1) {
+            errno_to_cerr("close(timer)");
+        }
+    });
+
+    itimerspec interval = {};
+    interval.it_interval.tv_nsec = PACER_TICK_NS;
+    interval.it_value.tv_nsec = PACER_TICK_NS;
+    if (!run.loop.watch(timer) || timerfd_settime(timer, 0, &interval, nullptr) == -1) {
+        errno_to_cerr("timerfd_settime(...)");
+        co_return false;
+    }
+
+    while (true) {
+        bool ready = co_await readable(run.loop, timer);
+        uint64_t expirations = 0;
+        if (!ready || (read(timer, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)) {
+            errno_to_cerr("read(timer)");
+            co_return false;
+        }
+
+        const uint64_t now = now_ns();
+        if (run.sending && now >= run.end) {
+            run.sending = false;
+            for (unique_ptr<loadgen_connection>& connection : run.connections) {
+                connection->echoed.notify();
+            }
+        }
+        if (!run.sending) {
+            if (now >= run.end + DRAIN_NS) {
+                run.loop.forget(timer);
+                co_return true;
+            }
+            continue;
+        }
+
+        if (run.options.rate != 0) {
+            loadgen_schedule(run, now);
+        }
+    }
+}
+
+//Adds connection index on the first target from run.target that answers, false once none did
+static task<bool> loadgen_connect(loadgen& run, size_t index) {
+    for (; run.target < run.targets.size(); run.target++) {
+        const client_target& target = run.targets[run.target];
+        int sock = socket(target.family, target.type | SOCK_NONBLOCK | SOCK_CLOEXEC, target.protocol);
+        if (sock == -1) {
+            errno_to_cerr("socket(...)");
+            continue;
+        }
+        unique_ptr<loadgen_connection> connection = make_unique<loadgen_connection>(run.loop, sock, index);
+
+        //Small messages must not sit in Nagle's buffer, that would be measured as server latency, a local socket has none
+        int enable = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) == -1 && errno != EOPNOTSUPP) {
+            errno_to_cerr("setsockopt(..., TCP_NODELAY, ...)");
+        }
+        if (!run.loop.watch(sock)) {
+            errno_to_cerr("epoll_ctl(EPOLL_CTL_ADD, ...)");
+            co_return false;
+        }
+        bool connected = co_await async_connect(run.loop, sock, reinterpret_cast<const sockaddr*>(&target.addr), target.length);
+        if (!connected) {
+            errno_to_cerr("connect(...)");
+            run.loop.forget(sock);
+            continue;
+        }
+
+        if (target.type == SOCK_SEQPACKET) {
+            connection->frames.set_mode(frame_mode::packet);
+            connection->outbound.set_mode(frame_mode::packet);
+        }
+        run.connections.push_back(std::move(connection));
+        co_return true;
+    }
+    co_return false;
+}
+
+static task<bool> loadgen_run(loadgen& run) {
+    for (size_t i = 0; i < run.options.connections; i++) {
+        bool connected = co_await loadgen_connect(run, i);
+        if (!connected) {
+            co_return false;
+        }
+    }
+
+    run.start = now_ns();
+    run.measured = run.start + static_cast<uint64_t>(run.options.warmup * 1e9);
+    run.end = run.measured + static_cast<uint64_t>(run.options.duration * 1e9);
+
+    for (unique_ptr<loadgen_connection>& connection : run.connections) {
+        loadgen_reader(run, *connection).detach();
+        loadgen_writer(run, *connection).detach();
+        if (run.options.rate == 0) {
+            loadgen_closed_loop(run, *connection).detach();
+        }
+    }
+
+    bool paced = co_await loadgen_pacer(run);
+    co_return paced;
+}
+
+static void latency_to_json(const histogram& latency) {
+    auto microseconds = [](double nanoseconds) {
+        return nanoseconds / 1000;
+    };
+
+    cout <<
+        "  \"latency_us\": {\n" <<
+        "    \"count\": " << latency.count() << ",\n" <<
+        "    \"min\": " << microseconds(latency.min()) << ",\n" <<
+        "    \"mean\": " << microseconds(latency.mean()) << ",\n" <<
+        "    \"p50\": " << microseconds(latency.percentile(0.5)) << ",\n" <<
+        "    \"p90\": " << microseconds(latency.percentile(0.9)) << ",\n" <<
+        "    \"p99\": " << microseconds(latency.percentile(0.99)) << ",\n" <<
+        "    \"p999\": " << microseconds(latency.percentile(0.999)) << ",\n" <<
+        "    \"max\": " << microseconds(latency.max()) << "\n" <<
+        "  },\n";
+
+    //Only buckets that hold something, as [highest value in the bucket, count]
+    cout << "  \"histogram_us\": [";
+    bool first = true;
+    for (size_t i = 0; i < latency.bucket_count(); i++) {
+        if (latency.bucket(i) == 0) {
+            continue;
+        }
+        cout << (first ? "\n" : ",\n") << "    [" << microseconds(histogram::highest_in(i)) << ", " << latency.bucket(i) << "]";
+        first = false;
+    }
+    cout << "\n  ]\n";
+}
+
+static void loadgen_to_json(const loadgen& run) {
+    const double seconds = run.options.duration;
+    const uint64_t expected = run.sent * run.options.connections;
+
+    cout <<
+        "{\n" <<
+        "  \"engine\": \"" << run.options.engine << "\",\n" <<
+        "  \"connections\": " << run.options.connections << ",\n" <<
+        "  \"mode\": \"" << (run.options.rate == 0 ? "closed" : "open") << "\",\n" <<
+        "  \"rate_per_connection\": " << run.options.rate << ",\n" <<
+        "  \"size\": " << run.options.size << ",\n" <<
+        "  \"duration_s\": " << seconds << ",\n" <<
+        "  \"sent\": " << run.sent << ",\n" <<
+        "  \"delivered\": " << run.delivered << ",\n" <<
+        "  \"expected\": " << expected << ",\n" <<
+        "  \"errors\": " << run.errors << ",\n" <<
+        "  \"sent_per_s\": " << run.sent / seconds << ",\n" <<
+        "  \"delivered_per_s\": " << run.delivered / seconds << ",\n";
+    latency_to_json(run.latency);
+    cout << "}\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: loadgen <host, IPv4 or IPv6 address, " << UNIX_PREFIX << "path or " << SEQPACKET_PREFIX << "path> [" <<
+            CONNECTIONS_OPTION << " n] [" <<
+            RATE_OPTION << " per second] [" <<
+            SIZE_OPTION << " bytes] [" <<
+            DURATION_OPTION << " s] [" <<
+            WARMUP_OPTION << " s] [" <<
+            ENGINE_OPTION << " name]\n";
+        return EXIT_FAILURE;
+    }
+
+    loadgen run;
+    run.options.host = argv[1];
+    if (!parse_loadgen_options(argc - 2, argv + 2, run.options)) {
+        return EXIT_FAILURE;
+    }
+
+    if (!resolve_target(run.options.host, run.targets)) {
+        return EXIT_FAILURE;
+    }
+
+    if (!run.loop.open()) {
+        errno_to_cerr("epoll_create1(...)");
+        return EXIT_FAILURE;
+    }
+    if (!run_until_complete(run.loop, loadgen_run(run))) {
+        return EXIT_FAILURE;
+    }
+
+    loadgen_to_json(run);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,268 @@
+#include "log.hpp"
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::to_string;
+using std::atomic;
+using std::mutex;
+using std::lock_guard;
+using std::vector;
+using std::unique_ptr;
+using std::thread;
+
+//Bytes per thread and destination, a power of two, records that do not fit are dropped and counted
+constexpr const size_t LOG_RING_CAPACITY = 256 * 1024;
+//How long the writer sleeps once every ring is empty, records wait at most this long
+constexpr const std::chrono::milliseconds LOG_IDLE_INTERVAL = std::chrono::milliseconds(5);
+//Vectors per writev, two per ring since a ring may wrap
+constexpr const size_t MAX_LOG_VECTORS = 256 < IOV_MAX ? 256 : IOV_MAX;
+
+enum destination {
+    standard_output,
+    standard_error,
+};
+
+constexpr const int DESTINATION_FDS[] = { STDOUT_FILENO, STDERR_FILENO };
+constexpr const size_t DESTINATION_COUNT = sizeof(DESTINATION_FDS) / sizeof(DESTINATION_FDS[0]);
+
+//Single producer, the thread owning it, and single consumer, the writer thread
+struct log_ring {
+    unique_ptr<char[]> bytes = unique_ptr<char[]>(new char[LOG_RING_CAPACITY]);
+    //Only ever increase, positions are taken modulo the capacity
+    atomic<size_t> head = 0;
+    atomic<size_t> tail = 0;
+
+    //The line and its newline, or nothing when the ring lacks room for both
+    bool push(string_view line) {
+        const size_t position = head.load(std::memory_order_relaxed);
+        if (LOG_RING_CAPACITY - (position - tail.load(std::memory_order_acquire)) < line.size() + 1) {
+            return false;
+        }
+        copy_in(position, line.data(), line.size());
+        copy_in(position + line.size(), "\n", 1);
+        head.store(position + line.size() + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    void copy_in(size_t position, const char* data, size_t size) {
+        const size_t offset = position & (LOG_RING_CAPACITY - 1);
+        const size_t before_end = LOG_RING_CAPACITY - offset < size ? LOG_RING_CAPACITY - offset : size;
+        memcpy(bytes.get() + offset, data, before_end);
+        memcpy(bytes.get(), data + before_end, size - before_end);
+    }
+};
+
+struct log_slot {
+    log_ring rings[DESTINATION_COUNT];
+    atomic<uint64_t> dropped = 0;
+};
+
+//Slots outlive their threads so a record is never lost to a thread exiting, the lock is only taken by a thread's first record and by the writer
+static mutex slots_lock;
+static vector<unique_ptr<log_slot>> slots;
+
+static atomic<bool> running = false;
+static atomic<bool> stopping = false;
+static atomic<log_level> threshold = log_level::info;
+static atomic<bool> echo = true;
+static thread writer;
+
+static log_slot& own_slot() {
+    static thread_local log_slot* slot = nullptr;
+    if (slot == nullptr) {
+        lock_guard<mutex> guard(slots_lock);
+        slots.push_back(std::make_unique<log_slot>());
+        slot = slots.back().get();
+    }
+    return *slot;
+}
+
+static void write_direct(destination to, string_view line) {
+    string terminated = string(line) + '\n';
+    size_t written = 0;
+    while (written < terminated.size()) {
+        ssize_t result = write(DESTINATION_FDS[to], terminated.data() + written, terminated.size() - written);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        written += result;
+    }
+}
+
+static void record(destination to, string_view line) {
+    if (!running.load(std::memory_order_acquire) || line.size() + 1 > LOG_RING_CAPACITY / 2) {
+        write_direct(to, line);
+        return;
+    }
+
+    log_slot& slot = own_slot();
+    if (!slot.rings[to].push(line)) {
+        slot.dropped.store(slot.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+//One writev per destination gathering every ring, returns the bytes written
+static size_t log_drain() {
+    struct span {
+        log_ring* ring;
+        size_t size;
+    };
+
+    size_t total = 0;
+    uint64_t dropped = 0;
+    lock_guard<mutex> guard(slots_lock);
+    for (size_t to = 0; to < DESTINATION_COUNT; to++) {
+        iovec vectors[MAX_LOG_VECTORS];
+        span spans[MAX_LOG_VECTORS];
+        size_t vector_count = 0;
+        size_t span_count = 0;
+        for (unique_ptr<log_slot>& slot : slots) {
+            if (to == 0) {
+                dropped += slot->dropped.exchange(0, std::memory_order_relaxed);
+            }
+
+            log_ring& ring = slot->rings[to];
+            const size_t tail = ring.tail.load(std::memory_order_relaxed);
+            const size_t size = ring.head.load(std::memory_order_acquire) - tail;
+            if (size == 0) {
+                continue;
+            }
+            if (vector_count + 2 > MAX_LOG_VECTORS) {
+                break;
+            }
+
+            const size_t offset = tail & (LOG_RING_CAPACITY - 1);
+            const size_t before_end = LOG_RING_CAPACITY - offset < size ? LOG_RING_CAPACITY - offset : size;
+            vectors[vector_count++] = { ring.bytes.get() + offset, before_end };
+            if (before_end != size) {
+                vectors[vector_count++] = { ring.bytes.get(), size - before_end };
+            }
+            spans[span_count++] = { &ring, size };
+        }
+
+        if (vector_count == 0) {
+            continue;
+        }
+
+        ssize_t written = writev(DESTINATION_FDS[to], vectors, vector_count);
+        if (written == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            //Nowhere to report it, discard rather than spin on a broken descriptor
+            written = 0;
+            for (size_t i = 0; i < span_count; i++) {
+                written += spans[i].size;
+            }
+        }
+
+        //A short write leaves the rest in the rings for the next round
+        size_t remaining = written;
+        for (size_t i = 0; i < span_count && remaining != 0; i++) {
+            const size_t consumed = spans[i].size < remaining ? spans[i].size : remaining;
+            spans[i].ring->tail.store(spans[i].ring->tail.load(std::memory_order_relaxed) + consumed, std::memory_order_release);
+            remaining -= consumed;
+        }
+        total += written;
+    }
+
+    if (dropped != 0) {
+        write_direct(standard_error, to_string(dropped) + " log records dropped");
+    }
+    return total;
+}
+
+static void log_writer() {
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (log_drain() == 0) {
+            std::this_thread::sleep_for(LOG_IDLE_INTERVAL);
+        }
+    }
+    while (log_drain() != 0) {}
+}
+
+bool parse_log_level(const char* name, log_level& level) {
+    if (strcmp(name, "debug") == 0) {
+        level = log_level::debug;
+    } else if (strcmp(name, "info") == 0) {
+        level = log_level::info;
+    } else if (strcmp(name, "warning") == 0) {
+        level = log_level::warning;
+    } else if (strcmp(name, "error") == 0) {
+        level = log_level::error;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void log_start(log_level level, bool echo_chat) {
+    threshold = level;
+    echo = echo_chat;
+    if (running) {
+        return;
+    }
+    stopping = false;
+    writer = thread(log_writer);
+    running.store(true, std::memory_order_release);
+}
+
+void log_stop() {
+    if (!running) {
+        return;
+    }
+    //Records made from here on bypass the rings, the writer empties them before returning
+    running = false;
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+}
+
+bool log_enabled(log_level level) {
+    return level >= threshold.load(std::memory_order_relaxed);
+}
+
+void log_write(log_level level, string_view line) {
+    if (log_enabled(level)) {
+        record(level >= log_level::warning ? standard_error : standard_output, line);
+    }
+}
+
+void log_chat(string_view line) {
+    if (echo.load(std::memory_order_relaxed)) {
+        record(standard_output, line);
+    }
+}
+
+bool log_limiter::allow() {
+    const uint64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t current = second.load(std::memory_order_relaxed);
+    if (now != current && second.compare_exchange_strong(current, now, std::memory_order_relaxed)) {
+        allowed.store(0, std::memory_order_relaxed);
+        const uint64_t missed = suppressed.exchange(0, std::memory_order_relaxed);
+        if (missed != 0) {
+            log_write(log_level::warning, to_string(missed) + " similar records suppressed");
+        }
+    }
+
+    if (allowed.fetch_add(1, std::memory_order_relaxed) < limit) {
+        return true;
+    }
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+enum class log_level {
+    debug,
+    info,
+    warning,
+    error,
+};
+
+bool parse_log_level(const char* name, log_level& level);
+
+//Starts the background writer, until then and after log_stop() records are written straight to their descriptor
+void log_start(log_level threshold, bool echo_chat);
+
+//Writes out everything already recorded and stops the background writer
+void log_stop();
+
+bool log_enabled(log_level level);
+
+//One line without its newline, debug and info go to stdout, warning and error to stderr
+void log_write(log_level level, std::string_view line);
+
+//Chat messages the server relays, to stdout unless echoing was turned off
+void log_chat(std::string_view line);
+
+//Lets through a burst of records per second from one call site and counts the rest, the first record let through in a later second reports how many were suppressed
+struct log_limiter {
+    log_limiter(uint32_t records_per_second = 10)
+        : limit(records_per_second) {}
+
+    bool allow();
+
+private:
+    const uint32_t limit;
+    std::atomic<uint64_t> second = 0;
+    std::atomic<uint32_t> allowed = 0;
+    std::atomic<uint64_t> suppressed = 0;
+};
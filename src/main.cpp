@@ -1,17 +1,14 @@
 #include "main.hpp"
-#include <cerrno>
 #include <cstddef>
 #include <cstdlib>
 #include <iostream>
 #include <cstring>
 
 using std::size_t;
-using std::cout;
 using std::cerr;
 using std::endl;
 using std::strncmp;
-using std::string;
-using std::count;
+using std::strcmp;
 
 constexpr const char SERVER_ARGUMENT[] = "server";
 constexpr const size_t SERVER_ARGUMENT_LENGTH = sizeof(SERVER_ARGUMENT) / sizeof(SERVER_ARGUMENT[0]) - 1;
@@ -19,51 +16,36 @@ constexpr const size_t SERVER_ARGUMENT_LENGTH = sizeof(SERVER_ARGUMENT) / sizeof
 constexpr const char CLIENT_ARGUMENT[] = "client";
 constexpr const size_t CLIENT_ARGUMENT_LENGTH = sizeof(CLIENT_ARGUMENT) / sizeof(CLIENT_ARGUMENT[0]) - 1;
 
+constexpr const char BINARY_OPTION[] = "--binary";
+constexpr const char SHM_OPTION[] = "--shm";
+constexpr const char BULK_OPTION[] = "--bulk";
 
-void reader(int sock, bool& quit_reader, bool& reader_failure) {
-    string str;
-    constexpr const size_t chunk_size = 16;
-    bool resize_required = true;
-    reader_failure = false;
-    while (!quit_reader) {
-        if (resize_required) {
-            str.resize(str.size() + chunk_size);
-            resize_required = false;
+//Options after the server, any other argument is a file to send in bulk
+static bool parse_client_options(int option_count, char* options[], client_options& parsed) {
+    for (int i = 0; i < option_count; i++) {
+        if (strcmp(options[i], BINARY_OPTION) == 0) {
+            parsed.binary = true;
+        } else if (strcmp(options[i], SHM_OPTION) == 0) {
+            parsed.shared = true;
+        } else if (strcmp(options[i], BULK_OPTION) == 0) {
+            parsed.bulk = true;
+        } else if (options[i][0] != '-') {
+            parsed.files.push_back(options[i]);
+        } else {
+            cerr << "Unknown client option '" << options[i] << "'\n";
+            return false;
         }
+    }
 
-        int received = recv(sock, &*str.end() - chunk_size, chunk_size, 0);
-
-        if (received == -1) {
-            if (errno != EWOULDBLOCK) {
-                errno_to_cerr("recv(...)");
-                reader_failure = true;
-                return;
-            }
-            continue;
-        } else if (received == 0) {
-            break;
-        }
-        resize_required = true;
-
-        if (received != chunk_size) {
-            str.resize(str.size() - chunk_size + received);
-        }
-
-        if (str.back() != '\0') {
-            continue;
-        }
-
-        int line_count = count(str.begin(), str.end(), '\n');
-        print_above(line_count);
-        cout << str << '\n';
-        print_above_restore(line_count);
-
-        if (str == ".exit") {
-            break;
-        }
-        str.clear();
+    if (parsed.binary && parsed.shared) {
+        cerr << BINARY_OPTION << " and " << SHM_OPTION << " do not go together, the ring keeps message boundaries already\n";
+        return false;
     }
-    quit_reader = true;
+    if (!parsed.files.empty() && !parsed.bulk) {
+        cerr << "Files are only sent with " << BULK_OPTION << '\n';
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char* argv[]) {
@@ -73,11 +55,18 @@ int main(int argc, char* argv[]) {
     }
 
     if (strncmp(argv[1], SERVER_ARGUMENT, SERVER_ARGUMENT_LENGTH) == 0) {
-        return server(argc < 3 ? nullptr : argv[2]);
+        if (argc < 3) {
+            return server(nullptr, 0, nullptr);
+        }
+        return server(argv[2], argc - 3, argv + 3);
     }
 
     if (strncmp(argv[1], CLIENT_ARGUMENT, CLIENT_ARGUMENT_LENGTH) == 0) {
-        return client(argc < 3 ? nullptr : argv[2]);
+        client_options parsed;
+        if (argc > 3 && !parse_client_options(argc - 3, argv + 3, parsed)) {
+            return EXIT_FAILURE;
+        }
+        return client(argc < 3 ? nullptr : argv[2], parsed);
     }
 
     cerr << "Must specify either:" << SERVER_ARGUMENT << "|" << CLIENT_ARGUMENT << endl;
@@ -1,10 +1,13 @@
 #pragma once
+#include "log.hpp"
 #include <functional>
 #include <string>
 #include <netinet/ip.h>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 struct defer_container {
     std::function<void()> function;
@@ -37,15 +40,17 @@ namespace std {
     }
 }
 
+//Logged at error level, so a server running the background logger never waits on stderr
 static void errno_to_cerr(const char* const call) {
-    using std::cerr;
-    using std::endl;
+    using std::string;
+    using std::to_string;
 
-    const char* const error_name = strerrorname_np(errno);
+    const int error = errno;
+    const char* const error_name = strerrorname_np(error);
     if (error_name) {
-        std::cerr << call << "; failure: (" << errno << "): " << error_name << endl;
+        log_write(log_level::error, string(call) + "; failure: (" + to_string(error) + "): " + error_name);
     } else {
-        cerr << call << "; failure: " << errno << endl;
+        log_write(log_level::error, string(call) + "; failure: " + to_string(error));
     }
 }
 
@@ -87,9 +92,19 @@ static void print_above_restore(int line_count = 1, bool current_was_empty = fal
         flush;
 }
 
-void reader(int sock, bool& quit_reader, bool& reader_failure);
+//Writes all of data on the non-blocking socket
+bool send_all(int sock, const char* data, size_t size);
 
-int server(const char concurrency_method[]);
+int server(const char concurrency_method[], int option_count, char* options[]);
 
-int client(const char ip[]);
+struct client_options {
+    bool binary = false;
+    //Writes every line into a shm_ring instead of the socket, only offered over a local socket
+    bool shared = false;
+    //No prompt, input is taken as fast as the server takes it and the client leaves once the server closed the connection after it
+    bool bulk = false;
+    //Read one after the other instead of stdin
+    std::vector<const char*> files;
+};
 
+int client(const char ip[], const client_options& options);
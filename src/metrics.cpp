@@ -0,0 +1,216 @@
+#include "metrics.hpp"
+#include "main.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::string;
+using std::to_string;
+using std::atomic;
+using std::mutex;
+using std::lock_guard;
+using std::vector;
+using std::unique_ptr;
+using std::thread;
+
+constexpr const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "accepts",
+    "frames_in",
+    "bytes_in",
+    "bytes_out",
+    "send_errors",
+    "dropped",
+    "disconnects",
+    "zerocopy_sends",
+    "zerocopy_copied",
+    "migrations",
+    "idle_timeouts",
+    "write_timeouts",
+    "heartbeats",
+    "throttled",
+    "admission_rejects",
+};
+
+constexpr const char* const DISTRIBUTION_NAMES[DISTRIBUTION_COUNT] = {
+    "broadcast_ns",
+    "outbound_depth",
+    "accept_batch",
+    "accepts_per_s",
+};
+
+//Only its own thread writes a slot, so a relaxed load and store stands in for a locked increment
+struct metrics_slot {
+    atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    unique_ptr<atomic<uint64_t>[]> buckets[DISTRIBUTION_COUNT];
+
+    metrics_slot() {
+        for (unique_ptr<atomic<uint64_t>[]>& distribution_buckets : buckets) {
+            distribution_buckets.reset(new atomic<uint64_t>[HISTOGRAM_BUCKET_COUNT]());
+        }
+    }
+};
+
+//Slots outlive their threads so nothing recorded is lost, the lock is only taken by a thread's first record and by readers
+static mutex slots_lock;
+static vector<unique_ptr<metrics_slot>> slots;
+
+static metrics_slot& own_slot() {
+    static thread_local metrics_slot* slot = nullptr;
+    if (slot == nullptr) {
+        lock_guard<mutex> guard(slots_lock);
+        slots.push_back(std::make_unique<metrics_slot>());
+        slot = slots.back().get();
+    }
+    return *slot;
+}
+
+static void bump(atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void metrics_add(counter which, uint64_t amount) {
+    bump(own_slot().counters[static_cast<size_t>(which)], amount);
+}
+
+void metrics_record(distribution which, uint64_t value) {
+    bump(own_slot().buckets[static_cast<size_t>(which)][histogram::index_of(value)], 1);
+}
+
+uint64_t metrics_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void accept_meter::drained(uint64_t accepted) {
+    constexpr const uint64_t window_ns = 1000000000;
+    if (accepted != 0) {
+        metrics_record(distribution::accept_batch, accepted);
+    }
+    if (accepted == 0 && window_accepts == 0) {
+        return;
+    }
+
+    const uint64_t now = metrics_clock();
+    if (window_accepts != 0 && now - window_start >= window_ns) {
+        metrics_record(distribution::accepts_per_s, window_accepts);
+        window_accepts = 0;
+    }
+    if (window_accepts == 0) {
+        window_start = now;
+    }
+    window_accepts += accepted;
+}
+
+metrics_snapshot read_metrics() {
+    metrics_snapshot snapshot;
+    lock_guard<mutex> guard(slots_lock);
+    for (const unique_ptr<metrics_slot>& slot : slots) {
+        for (size_t i = 0; i < COUNTER_COUNT; i++) {
+            snapshot.counters[i] += slot->counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < DISTRIBUTION_COUNT; i++) {
+            for (size_t bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; bucket++) {
+                snapshot.distributions[i].record(histogram::highest_in(bucket), slot->buckets[i][bucket].load(std::memory_order_relaxed));
+            }
+        }
+    }
+    return snapshot;
+}
+
+string metrics_to_json(const metrics_snapshot& snapshot) {
+    string json = "{";
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        json += string("\"") + COUNTER_NAMES[i] + "\":" + to_string(snapshot.counters[i]) + ',';
+    }
+
+    for (size_t i = 0; i < DISTRIBUTION_COUNT; i++) {
+        const histogram& values = snapshot.distributions[i];
+        json += string("\"") + DISTRIBUTION_NAMES[i] + "\":{" +
+            "\"count\":" + to_string(values.count()) +
+            ",\"min\":" + to_string(values.min()) +
+            ",\"mean\":" + to_string(static_cast<uint64_t>(values.mean())) +
+            ",\"p50\":" + to_string(values.percentile(0.5)) +
+            ",\"p99\":" + to_string(values.percentile(0.99)) +
+            ",\"p999\":" + to_string(values.percentile(0.999)) +
+            ",\"max\":" + to_string(values.max()) + '}';
+        json += i + 1 == DISTRIBUTION_COUNT ? "}\n" : ",";
+    }
+    return json;
+}
+
+static void metrics_server(int listener) {
+    while (true) {
+        int sock = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                errno_to_cerr("stats: accept4(...)");
+            }
+            continue;
+        }
+
+        const string json = metrics_to_json(read_metrics());
+        size_t written = 0;
+        while (written < json.size()) {
+            ssize_t sent = send(sock, json.data() + written, json.size() - written, MSG_NOSIGNAL);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                errno_to_cerr("stats: send(...)");
+                break;
+            }
+            written += sent;
+        }
+
+        if (close(sock) == -1) {
+            errno_to_cerr("stats: close(...)");
+        }
+    }
+}
+
+bool serve_metrics(const char* path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        return false;
+    }
+
+    //A socket file left by an earlier run would make bind fail, anything else at the path is not ours to delete and fails with EEXIST
+    struct stat status;
+    if (lstat(path, &status) == 0 && !S_ISSOCK(status.st_mode)) {
+        close(listener);
+        errno = EEXIST;
+        return false;
+    }
+    if (unlink(path) == -1 && errno != ENOENT) {
+        const int error = errno;
+        close(listener);
+        errno = error;
+        return false;
+    }
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(listener, SOMAXCONN) == -1) {
+        const int error = errno;
+        close(listener);
+        errno = error;
+        return false;
+    }
+
+    //Blocks in accept for as long as the server runs, nothing ever joins it
+    thread(metrics_server, listener).detach();
+    return true;
+}
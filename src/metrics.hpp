@@ -0,0 +1,75 @@
+#pragma once
+#include "histogram.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum class counter : size_t {
+    accepts,
+    frames_in,
+    bytes_in,
+    bytes_out,
+    send_errors,
+    //Broadcasts a slow consumer missed under the drop policy
+    dropped,
+    disconnects,
+    //Writes sent with MSG_ZEROCOPY, and of those the ones the kernel ended up copying anyway, as it does over loopback
+    zerocopy_sends,
+    zerocopy_copied,
+    //Connections the async server moved to a less loaded worker
+    migrations,
+    //Connections evicted for reading nothing or writing nothing for too long, and heartbeats sent to quiet ones
+    idle_timeouts,
+    write_timeouts,
+    heartbeats,
+    //Reads put off because a connection or the whole server ran over its rate, and connections refused while fan-out ran late
+    throttled,
+    admission_rejects,
+    count,
+};
+
+enum class distribution : size_t {
+    //Nanoseconds from the recv that completed a frame until its broadcast was queued everywhere
+    broadcast_ns,
+    //Bytes a recipient had queued once a broadcast was added to it
+    outbound_depth,
+    //Connections taken by one drain of the listener
+    accept_batch,
+    //Connections one accepting thread took in each second it accepted anything, its max is the peak rate a storm got
+    accepts_per_s,
+    count,
+};
+
+constexpr const size_t COUNTER_COUNT = static_cast<size_t>(counter::count);
+constexpr const size_t DISTRIBUTION_COUNT = static_cast<size_t>(distribution::count);
+
+//Recording only ever writes the calling thread's own slot, there is no lock or shared cache line on the hot path
+void metrics_add(counter which, uint64_t amount = 1);
+
+void metrics_record(distribution which, uint64_t value);
+
+//Monotonic nanoseconds for timing distribution::broadcast_ns
+uint64_t metrics_clock();
+
+//Per accepting thread, feeds distribution::accept_batch and distribution::accepts_per_s
+struct accept_meter {
+    uint64_t window_start = 0;
+    uint64_t window_accepts = 0;
+
+    //After every drain of the listener, and with 0 when idle so the last busy second is not held back until the next connection
+    void drained(uint64_t accepted);
+};
+
+//Sum of every thread's slot, values recorded while reading land in this snapshot or the next
+struct metrics_snapshot {
+    uint64_t counters[COUNTER_COUNT] = {};
+    //Values are bucket bounds, within 1% of what was recorded
+    histogram distributions[DISTRIBUTION_COUNT];
+};
+
+metrics_snapshot read_metrics();
+
+std::string metrics_to_json(const metrics_snapshot& snapshot);
+
+//Serves a JSON snapshot to every connection on a local stream socket at path for the rest of the process, false with errno set when the socket could not be opened
+bool serve_metrics(const char* path);
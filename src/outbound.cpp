@@ -0,0 +1,318 @@
+#include "outbound.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+using std::size_t;
+using std::strcmp;
+
+//Messages per sendmsg, each takes up to two vectors and the kernel rejects more than IOV_MAX
+constexpr const size_t MAX_FLUSH_MESSAGES = 64 < IOV_MAX / 2 ? 64 : IOV_MAX / 2;
+
+bool parse_slow_consumer_policy(const char* name, slow_consumer_policy& policy) {
+    if (strcmp(name, "drop") == 0) {
+        policy = slow_consumer_policy::drop;
+    } else if (strcmp(name, "disconnect") == 0) {
+        policy = slow_consumer_policy::disconnect;
+    } else if (strcmp(name, "block") == 0) {
+        policy = slow_consumer_policy::block;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool tune_socket(int sock, const outbound_config& config) {
+    const int enable = 1;
+    //A local socket has no Nagle to disable
+    if (config.tcp_nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) == -1 && errno != EOPNOTSUPP) {
+        return false;
+    }
+    if (config.send_buffer != 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &config.send_buffer, sizeof(config.send_buffer)) == -1) {
+        return false;
+    }
+    return true;
+}
+
+size_t outbound_queue::wire_size(size_t index) const {
+    const size_t size = messages[index]->size();
+    if (packet) {
+        return size;
+    }
+    if (!binary || index < text_messages) {
+        return size + 1;
+    }
+    return frame_header_size(size) + size;
+}
+
+void outbound_queue::push(const shared_message& message) {
+    messages.push_back(message);
+    bytes += wire_size(messages.size() - 1);
+}
+
+void outbound_queue::set_mode(frame_mode mode) {
+    packet = mode == frame_mode::packet;
+    binary = mode == frame_mode::binary;
+    text_messages = binary ? messages.size() : 0;
+}
+
+void outbound_queue::pop() {
+    bytes -= wire_size(0) - sent;
+    sent = 0;
+    messages.pop_front();
+    if (text_messages != 0) {
+        text_messages--;
+    }
+}
+
+void outbound_queue::clear() {
+    messages.clear();
+    sent = 0;
+    bytes = 0;
+    text_messages = 0;
+}
+
+void outbound_queue::truncate(size_t count) {
+    while (messages.size() > count) {
+        bytes -= wire_size(messages.size() - 1);
+        messages.pop_back();
+    }
+    if (text_messages > messages.size()) {
+        text_messages = messages.size();
+    }
+    if (messages.empty()) {
+        sent = 0;
+    }
+}
+
+ssize_t outbound_queue::flush_packets(int sock) {
+    const size_t count = messages.size() < MAX_FLUSH_MESSAGES ? messages.size() : MAX_FLUSH_MESSAGES;
+    iovec vectors[MAX_FLUSH_MESSAGES];
+    mmsghdr headers[MAX_FLUSH_MESSAGES] = {};
+    for (size_t index = 0; index < count; index++) {
+        vectors[index] = { const_cast<char*>(messages[index]->data()), messages[index]->size() };
+        headers[index].msg_hdr.msg_iov = &vectors[index];
+        headers[index].msg_hdr.msg_iovlen = 1;
+    }
+
+    //Stops at the first record that does not fit, an error after that is reported by the next call
+    const int sent_records = sendmmsg(sock, headers, count, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent_records <= 0) {
+        if (sent_records == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            metrics_add(counter::send_errors);
+        }
+        return sent_records;
+    }
+
+    size_t written = 0;
+    for (int index = 0; index < sent_records; index++) {
+        written += headers[index].msg_len;
+        pop();
+    }
+    metrics_add(counter::bytes_out, written);
+    total_written += written;
+    return written;
+}
+
+ssize_t outbound_queue::flush(int sock) {
+    if (packet) {
+        return flush_packets(sock);
+    }
+
+    //A binary message takes a vector for its header and one for its payload
+    iovec vectors[MAX_FLUSH_MESSAGES * 2];
+    uint8_t headers[MAX_FLUSH_MESSAGES][MAX_FRAME_HEADER_SIZE];
+    size_t count = 0;
+    bool large = false;
+    bool framed = false;
+    for (size_t index = 0; index < messages.size() && index < MAX_FLUSH_MESSAGES; index++) {
+        const std::string& message = *messages[index];
+        size_t skip = index == 0 ? sent : 0;
+        large = large || (zerocopy_threshold != 0 && message.size() >= zerocopy_threshold);
+        if (!binary || index < text_messages) {
+            vectors[count++] = { const_cast<char*>(message.c_str()) + skip, message.size() + 1 - skip };
+            continue;
+        }
+        framed = true;
+
+        const size_t header_size = encode_frame_header(message_type::chat, message.size(), headers[index]);
+        if (skip < header_size) {
+            vectors[count++] = { headers[index] + skip, header_size - skip };
+            skip = 0;
+        } else {
+            skip -= header_size;
+        }
+        vectors[count++] = { const_cast<char*>(message.data()) + skip, message.size() - skip };
+    }
+
+    //sendmsg is writev with flags, MSG_NOSIGNAL turns a vanished peer into EPIPE instead of SIGPIPE
+    msghdr header = {};
+    header.msg_iov = vectors;
+    header.msg_iovlen = count;
+    const int more = messages.size() > MAX_FLUSH_MESSAGES ? MSG_MORE : 0;
+    //The kernel reads a zerocopy write after sendmsg returns, so the headers on this stack rule it out
+    bool zerocopy = large && !framed;
+    ssize_t written = sendmsg(sock, &header, MSG_NOSIGNAL | MSG_DONTWAIT | more | (zerocopy ? MSG_ZEROCOPY : 0));
+    if (written == -1 && zerocopy && errno == ENOBUFS) {
+        //Over the locked memory limit, copying still works
+        zerocopy = false;
+        written = sendmsg(sock, &header, MSG_NOSIGNAL | MSG_DONTWAIT | more);
+    }
+    if (written <= 0) {
+        if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            metrics_add(counter::send_errors);
+        }
+        return written;
+    }
+    metrics_add(counter::bytes_out, written);
+    total_written += written;
+
+    if (zerocopy) {
+        size_t covered = 0;
+        for (size_t index = 0; covered < static_cast<size_t>(written); index++) {
+            pinned.emplace_back(zerocopy_sends, messages[index]);
+            covered += wire_size(index) - (index == 0 ? sent : 0);
+        }
+        zerocopy_sends++;
+        metrics_add(counter::zerocopy_sends);
+    }
+
+    size_t remaining = written;
+    while (remaining != 0) {
+        const size_t front_left = wire_size(0) - sent;
+        if (remaining < front_left) {
+            sent += remaining;
+            bytes -= remaining;
+            break;
+        }
+        remaining -= front_left;
+        pop();
+    }
+    return written;
+}
+
+bool outbound_queue::flush_below(int sock, size_t limit, int timeout_ms) {
+    const uint64_t deadline = metrics_clock() + static_cast<uint64_t>(timeout_ms) * 1000000;
+    while (full(limit)) {
+        if (flush(sock) != -1) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+
+        const uint64_t now = metrics_clock();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        pollfd writable = { sock, POLLOUT, 0 };
+        if (poll(&writable, 1, static_cast<int>((deadline - now + 999999) / 1000000)) == -1 && errno != EINTR) {
+            return false;
+        }
+        //Zerocopy completions raise POLLERR too
+        if ((writable.revents & POLLERR) && zerocopy_threshold != 0 && reap_zerocopy(sock)) {
+            writable.revents &= ~POLLERR;
+        }
+        if (writable.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            errno = EPIPE;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool outbound_queue::enable_zerocopy(int sock, size_t threshold) {
+    const int enable = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == -1) {
+        //Local sockets always copy, which is what they are left doing
+        return errno == EOPNOTSUPP;
+    }
+    zerocopy_threshold = threshold;
+    return true;
+}
+
+bool outbound_queue::reap_zerocopy(int sock) {
+    while (true) {
+        char control[CMSG_SPACE(sizeof(sock_extended_err))];
+        msghdr header = {};
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &header, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+
+        for (cmsghdr* message = CMSG_FIRSTHDR(&header); message != nullptr; message = CMSG_NXTHDR(&header, message)) {
+            if (!((message->cmsg_level == SOL_IP && message->cmsg_type == IP_RECVERR) || (message->cmsg_level == SOL_IPV6 && message->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            const sock_extended_err* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(message));
+            if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY || error->ee_errno != 0) {
+                errno = error->ee_errno != 0 ? error->ee_errno : EIO;
+                return false;
+            }
+
+            //Writes ee_info through ee_data are done with their pages, in order for TCP, the difference keeps wraparound harmless
+            const uint32_t last = error->ee_data;
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                metrics_add(counter::zerocopy_copied, last - error->ee_info + 1);
+            }
+            while (!pinned.empty() && static_cast<int32_t>(pinned.front().first - last) <= 0) {
+                pinned.pop_front();
+            }
+        }
+    }
+
+    //The error queue only explains part of POLLERR, a pending socket error is the rest
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_size) == -1) {
+        return false;
+    }
+    if (error != 0) {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+enqueue_result enqueue(outbound_queue& queue, int sock, const shared_message& message, const outbound_config& config) {
+    if (queue.full(config.limit)) {
+        switch (config.policy) {
+            case slow_consumer_policy::drop:
+                metrics_add(counter::dropped);
+                return enqueue_result::dropped;
+            case slow_consumer_policy::disconnect:
+                return enqueue_result::disconnect;
+            case slow_consumer_policy::block:
+                if (!queue.flush_below(sock, config.limit, BLOCK_TIMEOUT_MS)) {
+                    return enqueue_result::disconnect;
+                }
+                break;
+        }
+    }
+
+    if (queue.empty() && config.flush_window_us != 0) {
+        queue.queued_at = metrics_clock();
+    }
+    queue.push(message);
+    metrics_record(distribution::outbound_depth, queue.bytes);
+    return enqueue_result::queued;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <sys/types.h>
+
+//One immutable payload shared by every recipient, sent with the NUL terminator std::string keeps after its data or behind a binary header
+using shared_message = std::shared_ptr<const std::string>;
+
+//What a broadcast does to a recipient whose queue already holds the limit
+enum class slow_consumer_policy {
+    drop,
+    disconnect,
+    block,
+};
+
+//Queued bytes per connection before the slow consumer policy applies
+constexpr const size_t DEFAULT_OUTBOUND_LIMIT = 1024 * 1024;
+//How long block waits for a reader to make room before disconnecting it instead
+constexpr const int BLOCK_TIMEOUT_MS = 1000;
+
+struct outbound_config {
+    size_t limit = DEFAULT_OUTBOUND_LIMIT;
+    slow_consumer_policy policy = slow_consumer_policy::disconnect;
+    //A queue is held back for up to this long after its oldest message so bursts leave in few large writes, 0 writes right away
+    uint64_t flush_window_us = 0;
+    //A held back queue is written early once it holds this much, 0 always waits out the window
+    size_t flush_bytes = 0;
+    //Disables Nagle, held back writes already coalesce and Nagle would only delay them further
+    bool tcp_nodelay = false;
+    //SO_SNDBUF for every connection, 0 keeps the kernel's autotuning
+    int send_buffer = 0;
+    //Writes carrying a message at least this large use MSG_ZEROCOPY, 0 never does
+    size_t zerocopy_threshold = 0;
+};
+
+bool parse_slow_consumer_policy(const char* name, slow_consumer_policy& policy);
+
+//Applies the socket options of config to an accepted connection, false with errno set by the failing setsockopt, TCP only ones are skipped on local sockets
+bool tune_socket(int sock, const outbound_config& config);
+
+//Per-connection send queue, not synchronized
+struct outbound_queue {
+    std::deque<shared_message> messages;
+    //Bytes of the front message already written
+    size_t sent = 0;
+    //Bytes still to be written across every queued message
+    size_t bytes = 0;
+    //metrics_clock() when the oldest unwritten message was queued, only kept while a flush window is configured
+    uint64_t queued_at = 0;
+    //Bytes written over the queue's lifetime, a write deadline only needs to see it move
+    uint64_t total_written = 0;
+    bool binary = false;
+    //Every message is a record of its own, set before anything is queued
+    bool packet = false;
+    //Leading messages queued before the switch to binary, still written as text
+    size_t text_messages = 0;
+    //0 unless enable_zerocopy() set up the socket
+    size_t zerocopy_threshold = 0;
+    //Messages a zerocopy write may still be reading from, each with the number the kernel gave that write, oldest first
+    //A closed connection drops them early, the kernel then only still reads them for a peer that is going away
+    std::deque<std::pair<uint32_t, shared_message>> pinned;
+    //Number the kernel gives the next zerocopy write, counted the same way it does
+    uint32_t zerocopy_sends = 0;
+
+    bool empty() const {
+        return messages.empty();
+    }
+
+    bool full(size_t limit) const {
+        return bytes >= limit;
+    }
+
+    //When the flush window of the oldest message runs out
+    uint64_t deadline(const outbound_config& config) const {
+        return queued_at + config.flush_window_us * 1000;
+    }
+
+    //Whether the queue should be written at now rather than wait for more, a partly written queue always is
+    bool due(uint64_t now, const outbound_config& config) const {
+        return config.flush_window_us == 0 || sent != 0 || (config.flush_bytes != 0 && bytes >= config.flush_bytes) || now >= deadline(config);
+    }
+
+    void push(const shared_message& message);
+
+    //Messages pushed from here on are written in the new mode, the ones already queued keep theirs
+    void set_mode(frame_mode mode);
+
+    //Drops the front message once something else has written it
+    void pop();
+
+    void clear();
+
+    //Keeps only the first count messages, for when the rest will never be written
+    void truncate(size_t count);
+
+    //One non-blocking scatter-gather write of as many queued messages as fit, -1 with EAGAIN once the socket is full
+    //MSG_MORE marks every write the rest of the queue follows, so the kernel only sends a short segment for the last one
+    //In packet mode one sendmmsg() of a record per message instead, the kernel never writes part of one
+    ssize_t flush(int sock);
+
+    //Blocks on the socket until the queue is back under the limit, false on a socket error or with ETIMEDOUT once timeout_ms ran out
+    bool flush_below(int sock, size_t limit, int timeout_ms);
+
+    //Sets SO_ZEROCOPY so writes carrying a message of at least threshold bytes are sent from the message itself, false with errno set
+    //The caller must then call reap_zerocopy() whenever the socket reports an error, a local socket is left copying and still succeeds
+    bool enable_zerocopy(int sock, size_t threshold);
+
+    //Releases the messages every completion on the error queue covers, false with errno set when the socket has a real error
+    bool reap_zerocopy(int sock);
+
+private:
+    //Bytes the message at index takes on the wire
+    size_t wire_size(size_t index) const;
+
+    ssize_t flush_packets(int sock);
+};
+
+enum class enqueue_result {
+    queued,
+    dropped,
+    disconnect,
+};
+
+//Queues the message for sock subject to the slow consumer policy, block may wait in flush_below for up to BLOCK_TIMEOUT_MS
+//Only takes the time when a flush window is configured and the queue was empty
+enqueue_result enqueue(outbound_queue& queue, int sock, const shared_message& message, const outbound_config& config);
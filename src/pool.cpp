@@ -0,0 +1,93 @@
+#include "pool.hpp"
+
+using std::size_t;
+using std::function;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+//Set on pool threads so submit() can find the calling thread's own deque
+static thread_local const work_stealing_pool* current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+work_stealing_pool::work_stealing_pool(size_t thread_count)
+    : queues(new queue[thread_count]), queue_count(thread_count) {
+    for (size_t i = 0; i < thread_count; i++) {
+        threads.emplace_back(&work_stealing_pool::run, this, i);
+    }
+}
+
+work_stealing_pool::~work_stealing_pool() {
+    {
+        lock_guard<mutex> guard(idle_lock);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void work_stealing_pool::submit(function<void()> task) {
+    //Counted first so queued never drops below the tasks actually in the deques
+    queued++;
+    const size_t index = current_pool == this ? current_index : next_queue++ % queue_count;
+    {
+        lock_guard<mutex> guard(queues[index].lock);
+        queues[index].tasks.push_back(std::move(task));
+    }
+
+    if (sleepers != 0) {
+        //Taking the lock orders this notify after a sleeper's last look at queued
+        { lock_guard<mutex> guard(idle_lock); }
+        idle.notify_one();
+    }
+}
+
+bool work_stealing_pool::take(size_t index, function<void()>& task) {
+    {
+        queue& own = queues[index];
+        lock_guard<mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t offset = 1; offset < queue_count; offset++) {
+        queue& victim = queues[(index + offset) % queue_count];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void work_stealing_pool::run(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    function<void()> task;
+    while (true) {
+        if (take(index, task)) {
+            queued--;
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        unique_lock<mutex> guard(idle_lock);
+        sleepers++;
+        idle.wait(guard, [&]() {
+            return queued != 0 || stopping;
+        });
+        sleepers--;
+        if (stopping) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Fixed set of threads with a deque each, a thread runs its own newest task first and steals the oldest from the others when it runs dry
+struct work_stealing_pool {
+    work_stealing_pool(size_t thread_count);
+    ~work_stealing_pool();
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    //Pool threads push onto their own deque, any other thread spreads tasks round-robin
+    void submit(std::function<void()> task);
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void run(size_t index);
+    bool take(size_t index, std::function<void()>& task);
+
+    std::unique_ptr<queue[]> queues;
+    size_t queue_count;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_queue = 0;
+
+    //Queued anywhere, a thread only sleeps once it reads zero after announcing itself in sleepers
+    std::atomic<size_t> queued = 0;
+    std::atomic<size_t> sleepers = 0;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    bool stopping = false;
+};
@@ -0,0 +1,74 @@
+#include "protocol.hpp"
+#include "framer.hpp"
+#include "outbound.hpp"
+#include <memory>
+
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::make_shared;
+
+size_t encode_varint(uint64_t value, uint8_t* out) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    out[size++] = static_cast<uint8_t>(value);
+    return size;
+}
+
+size_t decode_varint(const uint8_t* data, size_t size, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; i < size && i < MAX_VARINT_SIZE; i++) {
+        value |= static_cast<uint64_t>(data[i] & 0x7F) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+size_t frame_header_size(size_t payload_size) {
+    size_t size = 1;
+    for (uint64_t length = payload_size + 1; length >= 0x80; length >>= 7) {
+        size++;
+    }
+    return size + 1;
+}
+
+size_t encode_frame_header(message_type type, size_t payload_size, uint8_t* out) {
+    size_t size = encode_varint(payload_size + 1, out);
+    out[size++] = static_cast<uint8_t>(type);
+    return size;
+}
+
+void append_frame(string& out, message_type type, string_view payload) {
+    uint8_t header[MAX_FRAME_HEADER_SIZE];
+    const size_t header_size = encode_frame_header(type, payload.size(), header);
+    out.append(reinterpret_cast<const char*>(header), header_size);
+    out.append(payload);
+}
+
+void batch_builder::add(string_view message) {
+    uint8_t length[MAX_VARINT_SIZE];
+    payload.append(reinterpret_cast<const char*>(length), encode_varint(message.size(), length));
+    payload.append(message);
+}
+
+void batch_builder::finish(string& out) {
+    append_frame(out, message_type::batch, payload);
+    payload.clear();
+}
+
+bool negotiate_binary(string_view message, framer& frames, outbound_queue& outbound) {
+    static const shared_message answer = make_shared<const string>(BINARY_REQUEST);
+    if (message != BINARY_REQUEST || frames.mode() != frame_mode::text) {
+        return false;
+    }
+
+    outbound.push(answer);
+    outbound.set_mode(frame_mode::binary);
+    frames.set_mode(frame_mode::binary);
+    return true;
+}
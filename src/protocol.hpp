@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+//A connection starts in text mode, NUL-terminated frames, and switches to binary once it sends BINARY_REQUEST as a text frame
+//The server answers with BINARY_REQUEST as a text frame, every byte after it in either direction is binary
+//A binary frame is a varint length covering a type byte and the payload, so nothing is scanned for a terminator
+constexpr const char BINARY_REQUEST[] = ".binary";
+
+//Sent by a server checking on a quiet connection, in whatever framing the connection uses, a client answers with HEARTBEAT_PONG
+//Neither is relayed, the answer only shows the client is still there
+constexpr const char HEARTBEAT_PING[] = ".ping";
+constexpr const char HEARTBEAT_PONG[] = ".pong";
+
+enum class frame_mode {
+    text,
+    binary,
+    //Set on SOCK_SEQPACKET connections from the start, each record is one message with neither terminator nor header
+    //A record of zero bytes reads as end of stream, so none is ever sent
+    packet,
+};
+
+enum class message_type : uint8_t {
+    //Payload is one chat message
+    chat = 1,
+    //Payload is any number of chat messages, each behind its own varint length
+    batch = 2,
+};
+
+//LEB128, 7 bits a byte, at most 10 bytes for 64 bits
+constexpr const size_t MAX_VARINT_SIZE = 10;
+//Length and type byte
+constexpr const size_t MAX_FRAME_HEADER_SIZE = MAX_VARINT_SIZE + 1;
+
+//Bytes written to out, which must hold MAX_VARINT_SIZE
+size_t encode_varint(uint64_t value, uint8_t* out);
+
+//Bytes the varint took, 0 when size ends before it does or it runs past MAX_VARINT_SIZE
+size_t decode_varint(const uint8_t* data, size_t size, uint64_t& value);
+
+//Bytes encode_frame_header() writes for a payload of payload_size bytes
+size_t frame_header_size(size_t payload_size);
+
+//Bytes written to out, which must hold MAX_FRAME_HEADER_SIZE, for a frame whose payload is payload_size bytes
+size_t encode_frame_header(message_type type, size_t payload_size, uint8_t* out);
+
+void append_frame(std::string& out, message_type type, std::string_view payload);
+
+//Builds a batch frame one message at a time
+struct batch_builder {
+    void add(std::string_view message);
+
+    bool empty() const {
+        return payload.empty();
+    }
+
+    //Appends the batch frame to out and starts a new batch
+    void finish(std::string& out);
+
+private:
+    std::string payload;
+};
+
+struct framer;
+struct outbound_queue;
+
+//Handles BINARY_REQUEST arriving on a text connection by queueing the answer and switching both directions, true when message was the request
+//The answer still has to be flushed like any other queued message
+bool negotiate_binary(std::string_view message, framer& frames, outbound_queue& outbound);
@@ -0,0 +1,57 @@
+#include "rate_limit.hpp"
+#include <algorithm>
+
+using std::lock_guard;
+using std::mutex;
+using std::max;
+using std::min;
+
+uint64_t token_bucket::take(uint64_t rate, uint64_t amount, uint64_t now) {
+    const double capacity = static_cast<double>(rate);
+    tokens = refilled_at == 0 ? capacity : min(capacity, tokens + capacity * (now - refilled_at) / 1e9);
+    refilled_at = now;
+    tokens -= static_cast<double>(amount);
+    if (tokens >= 0) {
+        return 0;
+    }
+    return now + static_cast<uint64_t>(-tokens * 1e9 / capacity) + 1;
+}
+
+uint64_t rate_limiter::charge(connection_rate& connection, uint64_t messages, uint64_t bytes, uint64_t now) {
+    uint64_t resume = 0;
+    if (config.connection_messages != 0) {
+        resume = max(resume, connection.messages.take(config.connection_messages, messages, now));
+    }
+    if (config.connection_bytes != 0) {
+        resume = max(resume, connection.bytes.take(config.connection_bytes, bytes, now));
+    }
+    if (!config.global_limited()) {
+        return resume;
+    }
+
+    lock_guard<mutex> guard(global_lock);
+    if (config.global_messages != 0) {
+        resume = max(resume, global_messages.take(config.global_messages, messages, now));
+    }
+    if (config.global_bytes != 0) {
+        resume = max(resume, global_bytes.take(config.global_bytes, bytes, now));
+    }
+    return resume;
+}
+
+void rate_limiter::record_fanout(uint64_t latest_ns, uint64_t now) {
+    if (config.admission_ns == 0) {
+        return;
+    }
+    //A sample from a quiet spell long ago says nothing about now, the average starts over
+    const uint64_t previous = stale(now) ? latest_ns : fanout_ns.load(std::memory_order_relaxed);
+    fanout_ns.store(previous - previous / 8 + latest_ns / 8, std::memory_order_relaxed);
+    fanout_at.store(now, std::memory_order_relaxed);
+}
+
+bool rate_limiter::admit(uint64_t now) const {
+    if (config.admission_ns == 0 || stale(now)) {
+        return true;
+    }
+    return fanout_ns.load(std::memory_order_relaxed) <= config.admission_ns;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+//Sustained rates per second, 0 leaves that bucket unlimited, each bucket holds one second's worth for bursts
+struct rate_config {
+    uint64_t connection_messages = 0;
+    uint64_t connection_bytes = 0;
+    //Shared by every connection of the server
+    uint64_t global_messages = 0;
+    uint64_t global_bytes = 0;
+    //New connections are refused while recent broadcasts took longer than this to fan out, 0 admits every one
+    uint64_t admission_ns = 0;
+
+    bool connection_limited() const {
+        return connection_messages != 0 || connection_bytes != 0;
+    }
+
+    bool global_limited() const {
+        return global_messages != 0 || global_bytes != 0;
+    }
+
+    bool enabled() const {
+        return connection_limited() || global_limited();
+    }
+};
+
+//Goes into debt when one read brought more than was left, nothing read is ever dropped, the next read waits until the debt is paid back
+struct token_bucket {
+    double tokens = 0;
+    //0 until the first take, the bucket starts out full
+    uint64_t refilled_at = 0;
+
+    //Refills at rate per second up to a second's worth and takes amount, returns the metrics_clock() time it is out of debt or 0 when it is not in debt
+    uint64_t take(uint64_t rate, uint64_t amount, uint64_t now);
+};
+
+//Touched only by whoever reads the connection
+struct connection_rate {
+    token_bucket messages;
+    token_bucket bytes;
+    //metrics_clock() time reading resumes, 0 while the connection is read freely
+    uint64_t throttled_until = 0;
+};
+
+//One per server, charged from every thread that reads
+struct rate_limiter {
+    rate_config config;
+
+    //Charges one read to the connection and the server, returns the time reading may resume or 0 when it may go on at once
+    uint64_t charge(connection_rate& connection, uint64_t messages, uint64_t bytes, uint64_t now);
+
+    //Nanoseconds one broadcast took to fan out, smoothed over the last few, ignored unless admission control is on
+    void record_fanout(uint64_t latest_ns, uint64_t now);
+
+    //false while the smoothed fan-out is over config.admission_ns, a server that has gone quiet admits again after ADMISSION_WINDOW_NS
+    bool admit(uint64_t now) const;
+
+private:
+    static constexpr const uint64_t ADMISSION_WINDOW_NS = 1000000000;
+
+    //Another thread may have recorded a moment after now was read
+    bool stale(uint64_t now) const {
+        const uint64_t at = fanout_at.load(std::memory_order_relaxed);
+        return now > at && now - at > ADMISSION_WINDOW_NS;
+    }
+
+    std::mutex global_lock;
+    token_bucket global_messages;
+    token_bucket global_bytes;
+    //Racing recorders may lose a sample, which only makes the average a little less smooth
+    std::atomic<uint64_t> fanout_ns = 0;
+    std::atomic<uint64_t> fanout_at = 0;
+};
@@ -0,0 +1,87 @@
+#include "rooms.hpp"
+#include <mutex>
+
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::mutex;
+using std::lock_guard;
+
+//Only joins and leaves come here, never a relayed message
+static mutex names_lock;
+static unordered_map<string, room_id> names = { { LOBBY_NAME, LOBBY } };
+//Every room but the lobby, which is never forgotten
+struct room_entry {
+    string name;
+    size_t subscriptions = 0;
+};
+static unordered_map<room_id, room_entry> entries;
+//Ids are handed out in turn rather than reused at once, a message still on its way to a forgotten room then reaches nobody
+static room_id next_room = LOBBY + 1;
+
+bool acquire_room(string_view name, room_id& room) {
+    lock_guard<mutex> guard(names_lock);
+    auto found = names.find(string(name));
+    if (found != names.end()) {
+        room = found->second;
+        if (room != LOBBY) {
+            entries[room].subscriptions++;
+        }
+        return true;
+    }
+    if (entries.size() >= MAX_ROOMS) {
+        return false;
+    }
+
+    while (next_room == LOBBY || entries.count(next_room) != 0) {
+        next_room++;
+    }
+    room = next_room++;
+    names.emplace(string(name), room);
+    entries.emplace(room, room_entry { string(name), 1 });
+    return true;
+}
+
+bool find_room(string_view name, room_id& room) {
+    lock_guard<mutex> guard(names_lock);
+    auto found = names.find(string(name));
+    if (found == names.end()) {
+        return false;
+    }
+    room = found->second;
+    return true;
+}
+
+void release_room(room_id room) {
+    if (room == LOBBY) {
+        return;
+    }
+    lock_guard<mutex> guard(names_lock);
+    auto found = entries.find(room);
+    if (found == entries.end()) {
+        return;
+    }
+    if (--found->second.subscriptions == 0) {
+        names.erase(found->second.name);
+        entries.erase(found);
+    }
+}
+
+room_command parse_room_command(string_view message, string_view& name) {
+    room_command command;
+    if (message.starts_with(JOIN_COMMAND)) {
+        command = room_command::join;
+        name = message.substr(sizeof(JOIN_COMMAND) - 1);
+    } else if (message.starts_with(LEAVE_COMMAND)) {
+        command = room_command::leave;
+        name = message.substr(sizeof(LEAVE_COMMAND) - 1);
+    } else {
+        return room_command::none;
+    }
+
+    //A name is one word, anything else is an ordinary message that happens to start like a command
+    if (name.empty() || name.find_first_of(" \t\n") != string_view::npos) {
+        return room_command::none;
+    }
+    return command;
+}
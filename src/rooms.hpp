@@ -0,0 +1,175 @@
+#pragma once
+#include "outbound.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//".join <name>" subscribes a connection to a room and makes it the room it talks in, ".leave <name>" unsubscribes
+//Every connection starts in the lobby, so clients that never join anything see the whole server as before
+using room_id = uint32_t;
+
+constexpr const room_id LOBBY = 0;
+constexpr const char LOBBY_NAME[] = "lobby";
+constexpr const char JOIN_COMMAND[] = ".join ";
+constexpr const char LEAVE_COMMAND[] = ".leave ";
+
+//Rooms that may have subscribers at once besides the lobby, a join that would create one more is ignored
+constexpr const size_t MAX_ROOMS = 65536;
+
+//Same id for the same name from every thread for as long as the room has a subscriber, counts one more subscription
+//false when the room does not exist and MAX_ROOMS already do
+bool acquire_room(std::string_view name, room_id& room);
+
+//Same id without subscribing, false when nobody is in the room
+bool find_room(std::string_view name, room_id& room);
+
+//Counts one subscription less, a room left by its last subscriber is forgotten and its name may come back with a new id
+void release_room(room_id room);
+
+//What workers hand each other, a message and the room it was said in
+struct routed_message {
+    shared_message message;
+    room_id room = LOBBY;
+};
+
+//Rooms one connection is subscribed to and the one it talks in
+struct room_membership {
+    std::vector<room_id> joined;
+    room_id current = LOBBY;
+    //Put in front of everything said outside the lobby
+    std::string current_prefix;
+};
+
+enum class room_command {
+    none,
+    join,
+    leave,
+};
+
+//Cheap test before taking whatever lock guards a room_index
+inline bool is_room_command(std::string_view message) {
+    return message.starts_with(JOIN_COMMAND) || message.starts_with(LEAVE_COMMAND);
+}
+
+//Recognizes the room commands, name is only set for join and leave
+room_command parse_room_command(std::string_view message, std::string_view& name);
+
+//Room to subscribers index of one worker, a message only visits the subscribers of its room
+//Member is whatever names a connection to its owner, a handle, a pointer or a descriptor
+template <typename Member>
+struct room_index {
+    //Subscribes a new connection to the lobby
+    void add(const Member& member, room_membership& membership) {
+        membership = room_membership();
+        subscribe(LOBBY, member, membership);
+    }
+
+    //Unsubscribes a closing connection from everything it joined
+    void remove(const Member& member, room_membership& membership) {
+        for (room_id room : membership.joined) {
+            unsubscribe(room, member);
+            release_room(room);
+        }
+        membership.joined.clear();
+    }
+
+    //Unsubscribes a connection leaving for another index, which adopts it with membership as it is
+    void detach(const Member& member, const room_membership& membership) {
+        for (room_id room : membership.joined) {
+            unsubscribe(room, member);
+        }
+    }
+
+    //Subscribes a connection arriving from another index to the rooms it had joined there
+    void adopt(const Member& member, const room_membership& membership) {
+        for (room_id room : membership.joined) {
+            rooms[room].push_back(member);
+        }
+    }
+
+    //Applies a room command, false when message is not one and should be relayed
+    bool handle(std::string_view message, const Member& member, room_membership& membership) {
+        room_id room;
+        std::string_view name;
+        switch (parse_room_command(message, name)) {
+            case room_command::none:
+                return false;
+            case room_command::join:
+                if (!acquire_room(name, room)) {
+                    return true;
+                }
+                //Already subscribed, the subscription was counted when it was made
+                if (!subscribe(room, member, membership)) {
+                    release_room(room);
+                }
+                membership.current = room;
+                membership.current_prefix = room == LOBBY ? std::string() : '#' + std::string(name) + ' ';
+                return true;
+            case room_command::leave:
+                if (find_room(name, room)) {
+                    leave(room, member, membership);
+                }
+                return true;
+        }
+        return false;
+    }
+
+    //Empty for a room no connection here is in
+    const std::vector<Member>& members(room_id room) const {
+        static const std::vector<Member> none;
+        auto found = rooms.find(room);
+        return found == rooms.end() ? none : found->second;
+    }
+
+private:
+    //false when the connection already was subscribed
+    bool subscribe(room_id room, const Member& member, room_membership& membership) {
+        if (std::find(membership.joined.begin(), membership.joined.end(), room) != membership.joined.end()) {
+            return false;
+        }
+        membership.joined.push_back(room);
+        rooms[room].push_back(member);
+        return true;
+    }
+
+    void leave(room_id room, const Member& member, room_membership& membership) {
+        auto joined = std::find(membership.joined.begin(), membership.joined.end(), room);
+        if (joined == membership.joined.end()) {
+            return;
+        }
+        *joined = membership.joined.back();
+        membership.joined.pop_back();
+        unsubscribe(room, member);
+        release_room(room);
+
+        //Talking into a room it no longer hears goes back to the lobby
+        if (membership.current == room) {
+            membership.current = LOBBY;
+            membership.current_prefix.clear();
+        }
+    }
+
+    void unsubscribe(room_id room, const Member& member) {
+        auto found = rooms.find(room);
+        if (found == rooms.end()) {
+            return;
+        }
+
+        //Order among subscribers does not matter, so the last one fills the hole
+        std::vector<Member>& members = found->second;
+        auto position = std::find(members.begin(), members.end(), member);
+        if (position != members.end()) {
+            *position = members.back();
+            members.pop_back();
+        }
+        if (members.empty()) {
+            rooms.erase(found);
+        }
+    }
+
+    std::unordered_map<room_id, std::vector<Member>> rooms;
+};
@@ -1,8 +1,23 @@
 #include "main.hpp"
+#include "server.hpp"
+#include "bus.hpp"
+#include "pool.hpp"
+#include "metrics.hpp"
+#include "connection_table.hpp"
+#include "framer.hpp"
+#include "protocol.hpp"
+#include "rooms.hpp"
+#include "history.hpp"
+#include "shm_ring.hpp"
+#include "rate_limit.hpp"
+#include <algorithm>
 #include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <list>
+#include <set>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <thread>
@@ -10,334 +25,1173 @@
 #include <poll.h>
 #include <mutex>
 #include <fcntl.h>
+#include <string_view>
+#include <shared_mutex>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/tcp.h>
 
 using std::cout;
 using std::cerr;
 using std::string;
+using std::string_view;
 using std::list;
+using std::set;
+using std::pair;
 using std::vector;
 using std::ref;
 using std::thread;
 using std::this_thread::sleep_for;
 using std::to_string;
 using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::shared_lock;
+using std::shared_mutex;
+using std::atomic;
+using std::make_shared;
 using std::strncmp;
+using std::strcmp;
 using std::size_t;
+using std::min;
 
-struct client_info {
+//Events per epoll_wait, not a connection limit
+constexpr const int MAX_HARDWARE_EVENTS = 64;
+
+//A peer that vanished fails every send queued for it, one call site must not flood the log
+static log_limiter send_failures;
+//Neither may refusing connections during an overload
+static log_limiter rejections;
+
+//Turned away before anything is read from it, the client sees the connection close at once
+static void reject_connection(int sock, const peer_address& addr) {
+    metrics_add(counter::admission_rejects);
+    if (rejections.allow()) {
+        log_write(log_level::warning, to_string(addr) + " Fan-out running late, refusing connection");
+    }
+    if (close(sock) == -1) {
+        string call = "close(" + to_string(addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+}
+
+//Every connection is serviced by at most one pool task at a time, broadcasts from other tasks only touch the outbound queue under its lock
+struct hardware_connection {
     int sock = -1;
-    sockaddr_in addr {};
-    socklen_t addr_len = sizeof(addr);
-    bool quit_reader = false;
-    bool reader_failure = false;
-    thread worker_thread;
+    peer_address addr;
+    framer frames;
+    mutex outbound_lock;
+    outbound_queue outbound;
+    //Readiness arriving while a task runs sets again, so the running task goes round once more instead of a second task starting
+    atomic<bool> scheduled = false;
+    atomic<bool> again = false;
+    list<hardware_connection>::iterator self;
+    //Changed only by the connection's own task under the exclusive lock, so that task reads it freely
+    room_membership rooms;
+    //Guarded by outbound_lock, broadcasts leave the queue alone while it is active
+    history_cursor replay;
+    //Only touched by the connection's own task, throttled_until also under the context's throttled_lock
+    connection_rate rate;
+    //Set under outbound_lock before the socket is closed, for broadcasts that let go of all_lock to wait on a full queue
+    bool closed = false;
+    //Those broadcasts still holding on to the connection, the poller keeps it allocated until none are left
+    atomic<size_t> waiters = 0;
 };
 
-void hardware_concurrency_worker(client_info& client, list<client_info>& all, mutex& all_lock) {
-    static mutex out_lock = mutex();
+struct hardware_context {
+    work_stealing_pool pool;
+    int epoll = -1;
+    outbound_config outbound;
+    //Broadcasts share the lock, adding and removing connections takes it exclusively
+    shared_mutex all_lock;
+    list<hardware_connection> all;
+    //Guarded like all
+    room_index<hardware_connection*> rooms;
+    //Removed but still reachable from an epoll batch being handled or a waiting broadcast, freed by the poller before a later wait
+    list<hardware_connection> closed;
+    //Only the poller accepts
+    accept_meter accepts;
+    message_history history;
+    rate_limiter rates;
+    //Connections whose task stopped reading until their rate allows it, the poller schedules each again once the timer reaches it
+    mutex throttled_lock;
+    set<pair<uint64_t, hardware_connection*>> throttled;
+    int throttle_timer = -1;
 
-    string str;
-    constexpr const size_t chunk_size = 16;
-    bool resize_required = true;
-    client.reader_failure = false;
-    while (!client.quit_reader) {
-        if (resize_required) {
-            str.resize(str.size() + chunk_size);
-            resize_required = false;
-        }
+    hardware_context(size_t thread_count)
+        : pool(thread_count) {}
+};
 
-        int received = recv(client.sock, &*str.end() - chunk_size, chunk_size, 0);
+//Called with outbound_lock held
+static void hardware_deliver(hardware_context& context, hardware_connection& to_send, const shared_message& message) {
+    const bool was_empty = to_send.outbound.empty();
+    enqueue_result result = enqueue(to_send.outbound, to_send.sock, message, context.outbound);
+    if (result == enqueue_result::disconnect) {
+        log_write(log_level::warning, to_string(to_send.addr) + " Slow consumer, disconnecting");
+        //Its own task sees the shutdown as end of stream and cleans up
+        shutdown(to_send.sock, SHUT_RDWR);
+        return;
+    }
 
-        if (received == -1) {
-            if (errno != EWOULDBLOCK) {
-                errno_to_cerr("recv(...)");
-                client.reader_failure = true;
-                return;
+    //Written straight away when nothing is ahead of it, a full socket raises EPOLLOUT later and its task finishes the job
+    if (result == enqueue_result::queued && was_empty && !to_send.replay.active() && to_send.outbound.flush(to_send.sock) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        shutdown(to_send.sock, SHUT_RDWR);
+    }
+}
+
+//false when the queue is full and the policy is to block, the caller waits for it once all_lock is let go
+static bool hardware_enqueue(hardware_context& context, hardware_connection& to_send, const shared_message& message) {
+    lock_guard<mutex> guard(to_send.outbound_lock);
+    if (context.outbound.policy == slow_consumer_policy::block && to_send.outbound.full(context.outbound.limit)) {
+        return false;
+    }
+    hardware_deliver(context, to_send, message);
+    return true;
+}
+
+static void hardware_broadcast(hardware_context& context, const shared_message& message, room_id room) {
+    vector<hardware_connection*> blocked;
+    {
+        shared_lock<shared_mutex> all_guard(context.all_lock);
+        auto send = [&](hardware_connection& to_send) {
+            if (!hardware_enqueue(context, to_send, message)) {
+                to_send.waiters++;
+                blocked.push_back(&to_send);
+            }
+        };
+        const vector<hardware_connection*>& members = context.rooms.members(room);
+        if (members.size() != context.all.size()) {
+            for (hardware_connection* to_send : members) {
+                send(*to_send);
+            }
+        } else {
+            for (hardware_connection& to_send : context.all) {
+                send(to_send);
             }
-            continue;
-        } else if (received == 0) {
-            break;
         }
-        resize_required = true;
+    }
 
-        if (received != chunk_size) {
-            str.resize(str.size() - chunk_size + received);
+    //Waiting under all_lock would hold up every connection coming or going behind one stuck reader
+    for (hardware_connection* to_send : blocked) {
+        {
+            lock_guard<mutex> guard(to_send->outbound_lock);
+            if (!to_send->closed) {
+                hardware_deliver(context, *to_send, message);
+            }
         }
+        to_send->waiters--;
+    }
+}
 
-        if (str.back() != '\0') {
+//Writes a replay in progress or else the queue until the socket is full, false once the connection is finished with
+static bool hardware_write(hardware_context& context, hardware_connection& connection) {
+    lock_guard<mutex> guard(connection.outbound_lock);
+    //Readiness does not say whether completions arrived, checking costs one recvmsg
+    if (connection.outbound.zerocopy_threshold != 0 && !connection.outbound.reap_zerocopy(connection.sock)) {
+        return false;
+    }
+    bool written = !connection.replay.active() || advance_replay(context.history, connection.replay, connection.outbound.empty(), connection.sock, connection.frames.mode());
+    while (written && !connection.replay.streaming() && !connection.outbound.empty()) {
+        if (connection.outbound.flush(connection.sock) != -1) {
             continue;
         }
-
-        if (str == ".exit") {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
             break;
         }
+        written = errno == EINTR;
+    }
+    //A replay waiting for the queue to empty starts as soon as it has
+    if (written && connection.replay.pending() && connection.outbound.empty()) {
+        written = advance_replay(context.history, connection.replay, true, connection.sock, connection.frames.mode());
+    }
+
+    if (!written && send_failures.allow()) {
+        string call = to_string(connection.addr) + " send(...)";
+        errno_to_cerr(call.c_str());
+    }
+    return written;
+}
+
+//Arms the timer for the earliest throttled connection, a deadline already gone fires it at once
+static void hardware_arm_throttle(hardware_context& context) {
+    if (context.throttled.empty()) {
+        return;
+    }
+    const uint64_t deadline = context.throttled.begin()->first;
+    itimerspec at = {};
+    at.it_value = { static_cast<time_t>(deadline / 1000000000), static_cast<long>(deadline % 1000000000) };
+    if (timerfd_settime(context.throttle_timer, TFD_TIMER_ABSTIME, &at, nullptr) == -1) {
+        errno_to_cerr("timerfd_settime(...)");
+    }
+}
+
+//The socket is left unread, edge-triggered epoll raises nothing more for what is already in it, so the poller hands it back
+static void hardware_throttle(hardware_context& context, hardware_connection& connection) {
+    lock_guard<mutex> guard(context.throttled_lock);
+    context.throttled.insert({ connection.rate.throttled_until, &connection });
+    if (context.throttled.begin()->second == &connection) {
+        hardware_arm_throttle(context);
+    }
+}
+
+static void hardware_unthrottle(hardware_context& context, hardware_connection& connection) {
+    lock_guard<mutex> guard(context.throttled_lock);
+    context.throttled.erase({ connection.rate.throttled_until, &connection });
+    connection.rate.throttled_until = 0;
+}
+
+//false once the connection is finished with
+static bool hardware_service(hardware_context& context, hardware_connection& connection) {
+    if (!hardware_write(context, connection)) {
+        return false;
+    }
+
+    //Woken early for writing, the poller wakes it again for reading
+    if (connection.rate.throttled_until != 0) {
+        if (metrics_clock() < connection.rate.throttled_until) {
+            return true;
+        }
+        hardware_unthrottle(context, connection);
+    }
+
+    //Edge-triggered, so read until the socket is empty, or until it runs over its rate
+    while (true) {
+        ssize_t received = connection.frames.fill(connection.sock, MSG_DONTWAIT);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            errno_to_cerr("recv(...)");
+            return false;
+        } else if (received == 0) {
+            return false;
+        }
+
+        const uint64_t received_at = metrics_clock();
+        uint64_t messages = 0;
+        string_view message;
+        while (connection.frames.next(message)) {
+            messages++;
+            if (message == ".exit") {
+                //Best effort for whatever is still queued, the socket is closed right after
+                lock_guard<mutex> guard(connection.outbound_lock);
+                connection.outbound.flush(connection.sock);
+                return false;
+            }
+
+            {
+                lock_guard<mutex> guard(connection.outbound_lock);
+                if (negotiate_binary(message, connection.frames, connection.outbound)) {
+                    //Broadcasts queued from here on are binary, the answer ahead of them is not
+                    connection.outbound.flush(connection.sock);
+                    continue;
+                }
+            }
+
+            if (is_room_command(message)) {
+                unique_lock<shared_mutex> guard(context.all_lock);
+                if (context.rooms.handle(message, &connection, connection.rooms)) {
+                    continue;
+                }
+            }
 
-        string out = to_string(client.addr) + ' ' + str;
-        out_lock.lock();
-        cout << out << '\n';
-        all_lock.lock();
-        for (client_info& to_send : all) {
-            if (to_send.sock == -1) {
+            history_request request;
+            if (context.history.enabled() && parse_history_command(message, request)) {
+                {
+                    lock_guard<mutex> guard(connection.outbound_lock);
+                    connection.replay.request(request);
+                }
+                if (!hardware_write(context, connection)) {
+                    return false;
+                }
                 continue;
             }
 
-            if (send(to_send.sock, out.c_str(), out.size() + 1, 0) == -1) {
-                string call = to_string(to_send.addr) + " send(...)";
-                errno_to_cerr(call.c_str());
+            string out = to_string(connection.addr) + ' ' + connection.rooms.current_prefix;
+            out.append(message);
+            log_chat(out);
+            if (context.history.enabled()) {
+                context.history.append(out);
+            }
+
+            hardware_broadcast(context, make_shared<const string>(std::move(out)), connection.rooms.current);
+            const uint64_t broadcast_at = metrics_clock();
+            metrics_record(distribution::broadcast_ns, broadcast_at - received_at);
+            context.rates.record_fanout(broadcast_at - received_at, broadcast_at);
+        }
+
+        if (context.rates.config.enabled()) {
+            connection.rate.throttled_until = context.rates.charge(connection.rate, messages, received, received_at);
+            if (connection.rate.throttled_until != 0) {
+                metrics_add(counter::throttled);
+                hardware_throttle(context, connection);
+                return true;
             }
         }
-        all_lock.unlock();
-        out_lock.unlock();
-        str.clear();
     }
-    client.quit_reader = true;
 }
 
-int hardware_concurrency_limit(int listener) {
-    list<client_info> clients;
-    mutex clients_lock = mutex();
+static void hardware_close(hardware_context& context, hardware_connection& connection) {
+    if (connection.rate.throttled_until != 0) {
+        hardware_unthrottle(context, connection);
+    }
+    if (epoll_ctl(context.epoll, EPOLL_CTL_DEL, connection.sock, nullptr) == -1) {
+        string call = string("epoll_ctl(EPOLL_CTL_DEL, ") + to_string(connection.addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+
+    //The poller may free the connection as soon as it is spliced out
+    const int sock = connection.sock;
+    const peer_address addr = connection.addr;
+    //Broadcasts waiting on its full queue skip it from here on
+    {
+        lock_guard<mutex> guard(connection.outbound_lock);
+        connection.closed = true;
+    }
+    {
+        unique_lock<shared_mutex> guard(context.all_lock);
+        context.rooms.remove(&connection, connection.rooms);
+        context.closed.splice(context.closed.end(), context.all, connection.self);
+    }
 
+    //No broadcast can reach the socket any more, so the descriptor is free to be reused
+    if (close(sock) == -1) {
+        string call = string("close( ") + to_string(addr)  + ")";
+        errno_to_cerr(call.c_str());
+    }
+    metrics_add(counter::disconnects);
+}
+
+//scheduled is left set on a closed connection so nothing schedules it again
+static void hardware_task(hardware_context& context, hardware_connection& connection) {
+    do {
+        connection.again = false;
+        if (!hardware_service(context, connection)) {
+            hardware_close(context, connection);
+            return;
+        }
+        connection.scheduled = false;
+    } while (connection.again && !connection.scheduled.exchange(true));
+}
+
+static void hardware_schedule(hardware_context& context, hardware_connection& connection) {
+    connection.again = true;
+    if (!connection.scheduled.exchange(true)) {
+        context.pool.submit([&context, &connection]() {
+            hardware_task(context, connection);
+        });
+    }
+}
+
+//Run by the poller when the timer fires
+static void hardware_release_throttled(hardware_context& context) {
+    uint64_t expirations;
+    if (read(context.throttle_timer, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        errno_to_cerr("read(timerfd)");
+    }
+
+    vector<hardware_connection*> due;
+    {
+        lock_guard<mutex> guard(context.throttled_lock);
+        const uint64_t now = metrics_clock();
+        while (!context.throttled.empty() && context.throttled.begin()->first <= now) {
+            due.push_back(context.throttled.begin()->second);
+            context.throttled.erase(context.throttled.begin());
+        }
+        hardware_arm_throttle(context);
+    }
+    //One closed since is still allocated until the poller's next wait, and stays scheduled so nothing runs it
+    for (hardware_connection* connection : due) {
+        hardware_schedule(context, *connection);
+    }
+}
+
+static bool hardware_accept_all(hardware_context& context, int listener) {
+    uint64_t accepted = 0;
     while (true) {
-        using namespace std::chrono_literals;
-
-        for (auto it = clients.begin(); it != clients.end();) {
-            client_info& client = *it;
-            if (client.quit_reader || client.reader_failure) {
-                client.worker_thread.join();
-                if (close(client.sock) == -1) {
-                    string call = string("close( ") + to_string(client.addr)  + ")";
-                    errno_to_cerr(call.c_str());
-                }
-                it = clients.erase(it);
-            } else {
-                ++it;
+        peer_address addr;
+        int sock = accept4(listener, addr.get(), &addr.length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                context.accepts.drained(accepted);
+                return true;
             }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            //Running out of descriptors or memory is transient, anything else means the listener is unusable
+            const int error = errno;
+            errno_to_cerr("accept4(...)");
+            context.accepts.drained(accepted);
+            return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
         }
-
-        if (clients.size() == MAX_HARDWARE_CONCURRENCY) {
-            std::this_thread::sleep_for(50ms);
+        accepted++;
+        metrics_add(counter::accepts);
+        if (!identify_peer(sock, addr)) {
+            errno_to_cerr("getsockopt(..., SO_PEERCRED, ...)");
+            close(sock);
             continue;
         }
+        if (!context.rates.admit(metrics_clock())) {
+            reject_connection(sock, addr);
+            continue;
+        }
+        if (!tune_socket(sock, context.outbound)) {
+            errno_to_cerr("setsockopt(...)");
+        }
+
+        hardware_connection* connection;
+        {
+            unique_lock<shared_mutex> guard(context.all_lock);
+            context.all.emplace_back();
+            connection = &context.all.back();
+            connection->self = std::prev(context.all.end());
+            connection->sock = sock;
+            connection->addr = addr;
+            if (addr.packet) {
+                connection->frames.set_mode(frame_mode::packet);
+                connection->outbound.set_mode(frame_mode::packet);
+            }
+            context.rooms.add(connection, connection->rooms);
+            //Before any broadcast can reach its queue
+            if (context.outbound.zerocopy_threshold != 0 && !connection->outbound.enable_zerocopy(sock, context.outbound.zerocopy_threshold)) {
+                errno_to_cerr("setsockopt(..., SO_ZEROCOPY, ...)");
+            }
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(context.epoll, EPOLL_CTL_ADD, sock, &event) == -1) {
+            string call = string("epoll_ctl(EPOLL_CTL_ADD, ") + to_string(addr) + ")";
+            errno_to_cerr(call.c_str());
+            connection->scheduled = true;
+            hardware_close(context, *connection);
+        }
+    }
+}
+
+int hardware_concurrency_limit(const vector<int>& listeners, const server_options& options) {
+    hardware_context context = hardware_context(MAX_HARDWARE_CONCURRENCY);
+    context.outbound = options.outbound;
+    context.rates.config = options.rates;
+    if (options.history_path != nullptr && !context.history.open(options.history_path, options.history_segment_size, options.history_segments)) {
+        return EXIT_FAILURE;
+    }
+
+    context.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (context.epoll == -1) {
+        errno_to_cerr("epoll_create1(...)");
+        return EXIT_FAILURE;
+    }
+    defer([&]() {
+        if (close(context.epoll) == -1) {
+            errno_to_cerr("close(epoll)");
+        }
+    });
+
+    //Only needed once reads can be put off
+    if (options.rates.enabled()) {
+        context.throttle_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (context.throttle_timer == -1) {
+            errno_to_cerr("timerfd_create(...)");
+            return EXIT_FAILURE;
+        }
+    }
+    defer([&]() {
+        if (context.throttle_timer != -1 && close(context.throttle_timer) == -1) {
+            errno_to_cerr("close(timerfd)");
+        }
+    });
 
-        clients_lock.lock();
-        clients.push_back({});
-        clients_lock.unlock();
+    //nullptr marks a listener and the throttle list the timer, anything else is a connection
+    if (context.throttle_timer != -1) {
+        epoll_event timer_event = {};
+        timer_event.events = EPOLLIN;
+        timer_event.data.ptr = &context.throttled;
+        if (epoll_ctl(context.epoll, EPOLL_CTL_ADD, context.throttle_timer, &timer_event) == -1) {
+            errno_to_cerr("epoll_ctl(EPOLL_CTL_ADD, timerfd)");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int listener : listeners) {
+        epoll_event listener_event = {};
+        listener_event.events = EPOLLIN | EPOLLET;
+        listener_event.data.ptr = nullptr;
+        if (epoll_ctl(context.epoll, EPOLL_CTL_ADD, listener, &listener_event) == -1) {
+            errno_to_cerr("epoll_ctl(EPOLL_CTL_ADD, listener)");
+            return EXIT_FAILURE;
+        }
+    }
 
-        client_info& client = clients.back();
-        client.sock = accept(listener, reinterpret_cast<sockaddr*>(&client.addr), &client.addr_len);
+    epoll_event events[MAX_HARDWARE_EVENTS];
+    while (true) {
+        {
+            unique_lock<shared_mutex> guard(context.all_lock);
+            context.closed.remove_if([](const hardware_connection& connection) {
+                return connection.waiters == 0;
+            });
+        }
 
-        if (client.sock == -1) {
-            if (errno != EWOULDBLOCK) {
-                errno_to_cerr("accept(...)");
-                return EXIT_FAILURE;
+        int ready = epoll_wait(context.epoll, events, MAX_HARDWARE_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            std::this_thread::sleep_for(50ms);
-            clients_lock.lock();
-            clients.pop_back();
-            clients_lock.unlock();
-            continue;
+            errno_to_cerr("epoll_wait(...)");
+            return EXIT_FAILURE;
         }
 
-        client.worker_thread = thread(hardware_concurrency_worker, ref(client), ref(clients), ref(clients_lock));
+        for (int i = 0; i < ready; i++) {
+            //Whichever listener it was, draining one with nothing waiting costs a single accept4
+            if (events[i].data.ptr == nullptr) {
+                for (int listener : listeners) {
+                    if (!hardware_accept_all(context, listener)) {
+                        return EXIT_FAILURE;
+                    }
+                }
+                continue;
+            }
+            if (events[i].data.ptr == &context.throttled) {
+                hardware_release_throttled(context);
+                continue;
+            }
+            hardware_schedule(context, *static_cast<hardware_connection*>(events[i].data.ptr));
+        }
     }
 
     return EXIT_SUCCESS;
 }
 
-//Limit variable-length arrays
-constexpr const size_t MAX_CONNECTIONS_PER_WORKER = 32;
+//Load is counted in connections, a worker reading this many frames a second or holding this many queued bytes counts one more
+constexpr const double FRAMES_PER_CONNECTION = 100.0;
+constexpr const double QUEUED_BYTES_PER_CONNECTION = 64.0 * 1024;
+//How often the acceptor samples worker load, and how long it leaves workers alone after moving connections
+constexpr const int LOAD_SAMPLE_INTERVAL_MS = 100;
+constexpr const uint64_t REBALANCE_COOLDOWN_NS = 1000000000;
+//Below this many connections of difference moving one back and forth would only churn
+constexpr const double REBALANCE_SLACK = 2.0;
+constexpr const size_t MAX_MIGRATIONS_PER_REBALANCE = 64;
 
-//References are safe, mutexes not required for 'all' since size shall not change, vector is used because std::thread::hardware_concurrency is a runtime value
+//Spins instead of blocking so a waiting worker keeps draining its ring for any publisher still stuck sending to it
+struct worker_barrier {
+    size_t count = 0;
+    atomic<size_t> arrived = 0;
+    atomic<size_t> generation = 0;
+
+    template <typename Waiting>
+    void arrive_and_wait(Waiting waiting) {
+        const size_t current = generation.load(std::memory_order_acquire);
+        if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+            arrived.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        while (generation.load(std::memory_order_acquire) == current) {
+            waiting();
+            std::this_thread::yield();
+        }
+    }
+};
+
+//Each worker alone touches its connections, broadcasts cross between workers on the bus and new connections through a handoff checked once per iteration
 struct async_context {
+    //Touched by every broadcast
     struct connection {
         int sock = -1;
-        sockaddr_in addr = {};
-        socklen_t addr_len = sizeof(addr);
+        outbound_queue outbound;
     };
 
-    vector<mutex> locks;
-    vector<vector<connection>> all;
-    mutex echo_lock;
+    //Only touched when the connection itself is read from or reported on
+    struct connection_details {
+        peer_address addr;
+        framer frames;
+        room_membership rooms;
+        connection_timeouts timeouts;
+        //Written ahead of the queue, which is not flushed while it streams
+        history_cursor replay;
+        //Not polled for reading until throttled_until
+        connection_rate rate;
+    };
+
+    struct accepted {
+        int sock = -1;
+        peer_address addr;
+    };
+
+    struct worker {
+        connection_table<connection, connection_details> connections;
+        room_index<connection_handle> rooms;
+        mutex handoff_lock;
+        vector<accepted> handoff;
+        atomic<bool> handed_off = false;
+        //Owned plus handed over
+        atomic<size_t> load = 0;
+        //Published by the worker every iteration for the acceptor to weigh it by
+        atomic<uint64_t> frames = 0;
+        atomic<size_t> queued = 0;
+        //Only touched by the worker, one timer pending per connection while timeouts are enabled
+        timer_wheel timers;
+        vector<uint64_t> expired;
+        //Only touched by the worker, one per connection and the bus wakeup last, only ever grown
+        vector<pollfd> pollfds;
+    };
+
+    //Connections moving from one worker to another, taken over whole with their partial frames, queues and rooms
+    struct migration {
+        size_t from = 0;
+        size_t to = 0;
+        size_t count = 0;
+        vector<std::pair<connection, connection_details>> moving;
+    };
+
+    //Never resized, worker addresses stay valid
+    vector<worker> workers;
+    message_bus bus;
+    outbound_config outbound;
+    timeout_config timeouts;
+    message_history history;
+    rate_limiter rates;
+    //Written by the acceptor before it bumps rebalance_requested, read by workers once they see the bump
+    migration plan;
+    atomic<uint64_t> rebalance_requested = 0;
+    atomic<uint64_t> rebalance_completed = 0;
+    //Nobody publishes once every worker is past stopped, nobody delivers until the moved connections left their old worker
+    worker_barrier stopped;
+    worker_barrier moved;
 
     async_context(const int& worker_count)
-        : locks(vector<mutex>(worker_count)), all(worker_count), echo_lock(mutex()) {}
+        : workers(worker_count), bus(worker_count) {
+        stopped.count = worker_count;
+        moved.count = worker_count;
+    }
 };
 
-bool append_read_until_zero(int sock, string& str) {
-    constexpr const size_t chunk_size = 16;
-    bool resize_required = true;
-    while (true) {
-        if (resize_required) {
-            str.resize(str.size() + chunk_size);
-            resize_required = false;
+//Writes a replay in progress or else the queue, false with errno set on a socket error
+static bool asynchronous_write(async_context& context, async_context::connection& connection, async_context::connection_details& details) {
+    if (details.replay.active() && !advance_replay(context.history, details.replay, connection.outbound.empty(), connection.sock, details.frames.mode())) {
+        return false;
+    }
+    if (details.replay.streaming() || connection.outbound.empty()) {
+        return true;
+    }
+    if (connection.outbound.flush(connection.sock) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+    }
+    //A replay waiting for the queue to empty starts as soon as it has
+    return !details.replay.pending() || !connection.outbound.empty() || advance_replay(context.history, details.replay, true, connection.sock, details.frames.mode());
+}
+
+static void asynchronous_enqueue(async_context& context, const int index, async_context::connection& connection, const peer_address& addr, const shared_message& message) {
+    if (enqueue(connection.outbound, connection.sock, message, context.outbound) == enqueue_result::disconnect) {
+        log_write(log_level::warning, "worker[" + to_string(index) + "]: " + to_string(addr) + " Slow consumer, disconnecting");
+        //The next poll reads end of stream and drops it
+        shutdown(connection.sock, SHUT_RDWR);
+    }
+}
+
+static void asynchronous_deliver(async_context& context, const int index, const routed_message& message) {
+    async_context::worker& self = context.workers[index];
+    const vector<connection_handle>& members = self.rooms.members(message.room);
+    //Everyone here is in the room, walking the dense array beats resolving each handle
+    if (members.size() == self.connections.size()) {
+        for (size_t i = 0; i < self.connections.size(); i++) {
+            asynchronous_enqueue(context, index, self.connections.hot_at(i), self.connections.cold_at(i).addr, message.message);
         }
+        return;
+    }
+
+    for (const connection_handle& handle : members) {
+        asynchronous_enqueue(context, index, *self.connections.hot(handle), self.connections.cold(handle)->addr, message.message);
+    }
+}
 
-        int received = recv(sock, &*str.end() - chunk_size, chunk_size, 0);
+static void asynchronous_receive_all(async_context& context, const int index) {
+    routed_message message;
+    while (context.bus.receive(index, message)) {
+        asynchronous_deliver(context, index, message);
+    }
+}
 
-        if (received == -1) {
-            if (errno == EWOULDBLOCK) {
-                continue;
+static void asynchronous_publish(async_context& context, const int index, const routed_message& message) {
+    for (size_t other = 0; other < context.workers.size(); other++) {
+        if (other == static_cast<size_t>(index)) {
+            continue;
+        }
+
+        //The other worker may be just as full sending to this one, so keep receiving while waiting
+        while (!context.bus.send(other, message)) {
+            asynchronous_receive_all(context, index);
+            std::this_thread::yield();
+        }
+    }
+
+    asynchronous_deliver(context, index, message);
+}
+
+//Every broadcast published before all workers stopped reaches the moving connections on their old worker, every later one on their new worker
+static void asynchronous_rebalance(async_context& context, const int index) {
+    async_context::worker& self = context.workers[index];
+    async_context::migration& plan = context.plan;
+    context.stopped.arrive_and_wait([&]() { asynchronous_receive_all(context, index); });
+    asynchronous_receive_all(context, index);
+
+    if (static_cast<size_t>(index) == plan.from) {
+        for (size_t i = 0; i < plan.count && self.connections.size() > 1; i++) {
+            const size_t last = self.connections.size() - 1;
+            const connection_handle handle = self.connections.handle_at(last);
+            //Still subscribed as far as the room count goes, the other worker adopts it with the rooms it lists
+            self.rooms.detach(handle, self.connections.cold_at(last).rooms);
+            plan.moving.emplace_back(std::move(self.connections.hot_at(last)), std::move(self.connections.cold_at(last)));
+            self.connections.erase(handle);
+        }
+        self.load -= plan.moving.size();
+        context.workers[plan.to].load += plan.moving.size();
+    }
+
+    context.moved.arrive_and_wait([]() {});
+
+    if (static_cast<size_t>(index) == plan.to) {
+        for (std::pair<async_context::connection, async_context::connection_details>& moving : plan.moving) {
+            const connection_handle handle = self.connections.insert(std::move(moving.first), std::move(moving.second));
+            self.rooms.adopt(handle, self.connections.cold(handle)->rooms);
+            //Its timer stayed behind with a handle that no longer resolves there, the next check here reschedules it
+            if (context.timeouts.enabled()) {
+                self.timers.schedule(handle.pack(), 0);
             }
-            return false;
-        } else if (received == 0) {
-            return false;
         }
-        resize_required = true;
+        metrics_add(counter::migrations, plan.moving.size());
+        log_write(log_level::info, "worker[" + to_string(plan.from) + "]: moved " + to_string(plan.moving.size()) + " connections to worker[" + to_string(plan.to) + "]");
+        plan.moving.clear();
+        context.rebalance_completed.fetch_add(1, std::memory_order_release);
+    }
+}
 
-        if (received != chunk_size) {
-            str.resize(str.size() - chunk_size + received);
+//Runs the timer of every connection due by now, evictions join disconnected and heartbeats go out with the flush after the pass
+static void asynchronous_expire(async_context& context, const int index, uint64_t now, vector<connection_handle>& disconnected) {
+    async_context::worker& self = context.workers[index];
+    self.timers.advance(now, self.expired);
+    for (uint64_t key : self.expired) {
+        const connection_handle handle = connection_handle::unpack(key);
+        async_context::connection* connection = self.connections.hot(handle);
+        //Closed or moved to another worker since
+        if (connection == nullptr) {
+            continue;
         }
+        async_context::connection_details& details = *self.connections.cold(handle);
 
-        if (str.back() == '\0') {
-            break;
+        uint64_t next = 0;
+        switch (check_timeouts(details.timeouts, connection->outbound, context.timeouts, now, next)) {
+            case timeout_action::idle:
+                log_write(log_level::warning, "worker[" + to_string(index) + "]: " + to_string(details.addr) + " Idle, disconnecting");
+                metrics_add(counter::idle_timeouts);
+                disconnected.push_back(handle);
+                continue;
+            case timeout_action::stalled:
+                log_write(log_level::warning, "worker[" + to_string(index) + "]: " + to_string(details.addr) + " Write stalled, disconnecting");
+                metrics_add(counter::write_timeouts);
+                connection->outbound.clear();
+                disconnected.push_back(handle);
+                continue;
+            case timeout_action::heartbeat:
+                metrics_add(counter::heartbeats);
+                asynchronous_enqueue(context, index, *connection, details.addr, heartbeat_message());
+                break;
+            case timeout_action::none:
+                break;
         }
+        self.timers.schedule(key, next);
     }
-    return true;
+    self.expired.clear();
 }
 
 void asynchronous_worker(async_context& context, const int index) {
-    vector<async_context::connection>& connections = context.all[index];
-    mutex& connections_lock = context.locks[index];
+    async_context::worker& self = context.workers[index];
+    connection_table<async_context::connection, async_context::connection_details>& connections = self.connections;
+    uint64_t rebalanced = 0;
+    uint64_t frames = 0;
+    self.timers = timer_wheel(metrics_clock());
 
     while (true) {
-        context.echo_lock.lock();
-        defer([&]() {
-            context.echo_lock.unlock();
-        });
+        if (context.rebalance_requested.load(std::memory_order_acquire) != rebalanced) {
+            rebalanced++;
+            asynchronous_rebalance(context, index);
+        }
 
-        connections_lock.lock();
-        defer([&]() {
-            using namespace std::chrono_literals;
-            connections_lock.unlock();
-            sleep_for(50ms);
-        });
+        if (self.handed_off.load(std::memory_order_acquire)) {
+            lock_guard<mutex> guard(self.handoff_lock);
+            for (async_context::accepted& client : self.handoff) {
+                async_context::connection connection = {};
+                connection.sock = client.sock;
+                async_context::connection_details details = {};
+                details.addr = client.addr;
+                connection_handle handle = connections.insert(std::move(connection), std::move(details));
+                if (client.addr.packet) {
+                    connections.cold(handle)->frames.set_mode(frame_mode::packet);
+                    connections.hot(handle)->outbound.set_mode(frame_mode::packet);
+                }
+                self.rooms.add(handle, connections.cold(handle)->rooms);
+                if (context.outbound.zerocopy_threshold != 0 && !connections.hot(handle)->outbound.enable_zerocopy(client.sock, context.outbound.zerocopy_threshold)) {
+                    string call = "worker[" + to_string(index) + "]: setsockopt(..., SO_ZEROCOPY, ...)";
+                    errno_to_cerr(call.c_str());
+                }
+                if (context.timeouts.enabled()) {
+                    self.timers.schedule(handle.pack(), start_timeouts(connections.cold(handle)->timeouts, connections.hot(handle)->outbound, context.timeouts, metrics_clock()));
+                }
+            }
+            self.handoff.clear();
+            self.handed_off.store(false, std::memory_order_relaxed);
+        }
 
-        const size_t& count = connections.size();
-        pollfd pollfds[count];
-        for (int i = 0; i < count; i++) {
-            pollfds[i].fd = connections[i].sock;
-            pollfds[i].events = POLLIN;
+        //The bus wakeup goes last so connection positions match pollfds indices
+        const size_t count = connections.size();
+        if (self.pollfds.size() < count + 1) {
+            self.pollfds.resize(count + 1);
+        }
+        pollfd* pollfds = self.pollfds.data();
+        //Queues still inside their flush window are not polled for POLLOUT, the earliest window end bounds the wait instead, as does the next timer
+        //Throttled connections are not polled for POLLIN, what they sent waits in the socket and the end of their throttle bounds the wait too
+        const uint64_t polled_at = context.outbound.flush_window_us == 0 && self.timers.size() == 0 && !context.rates.config.enabled() ? 0 : metrics_clock();
+        uint64_t flush_deadline = self.timers.next_deadline();
+        for (size_t i = 0; i < count; i++) {
+            const outbound_queue& outbound = connections.hot_at(i).outbound;
+            connection_rate& rate = connections.cold_at(i).rate;
+            const bool writable = connections.cold_at(i).replay.streaming() || (!outbound.empty() && outbound.due(polled_at, context.outbound));
+            if (!outbound.empty() && !writable) {
+                flush_deadline = min(flush_deadline, outbound.deadline(context.outbound));
+            }
+            if (rate.throttled_until != 0 && rate.throttled_until <= polled_at) {
+                rate.throttled_until = 0;
+            }
+            if (rate.throttled_until != 0) {
+                flush_deadline = min(flush_deadline, rate.throttled_until);
+            }
+            pollfds[i].fd = connections.hot_at(i).sock;
+            pollfds[i].events = (rate.throttled_until == 0 ? POLLIN : 0) | (writable ? POLLOUT : 0);
         }
+        pollfds[count].fd = context.bus.wake(index);
+        pollfds[count].events = POLLIN;
 
-        if (poll(pollfds, count, 0) == -1) {
-            string call = "worker[" + to_string(index) + "]: poll(...)";
-            errno_to_cerr(call.c_str());
+        timespec timeout;
+        if (flush_deadline != UINT64_MAX) {
+            const uint64_t wait_ns = flush_deadline > polled_at ? flush_deadline - polled_at : 0;
+            timeout = { static_cast<time_t>(wait_ns / 1000000000), static_cast<long>(wait_ns % 1000000000) };
+        }
+        if (ppoll(pollfds, count + 1, flush_deadline == UINT64_MAX ? nullptr : &timeout, nullptr) == -1) {
+            if (errno != EINTR) {
+                string call = "worker[" + to_string(index) + "]: ppoll(...)";
+                errno_to_cerr(call.c_str());
+            }
             continue;
         }
 
-        vector<int> disconnected;
-        for (int i = 0; i < count; i++) {
-            if (!(pollfds[i].revents & POLLIN)) {
-                continue;
-            }
+        if (pollfds[count].revents & POLLIN) {
+            context.bus.acknowledge(index);
+            asynchronous_receive_all(context, index);
+        }
 
-            string message;
-            if (!append_read_until_zero(connections[i].sock, message)) {
-                string call = "worker[" + to_string(index) + "]: append_read_until_zero(" + to_string(connections[i].addr) + ")";
+        //Handles rather than positions, erasing one moves another into its place
+        vector<connection_handle> disconnected;
+        for (size_t i = 0; i < count; i++) {
+            async_context::connection& connection = connections.hot_at(i);
+            async_context::connection_details& details = connections.cold_at(i);
+            //Zerocopy completions raise POLLERR, and poll keeps raising it until they are read
+            if ((pollfds[i].revents & POLLERR) && connection.outbound.zerocopy_threshold != 0 && !connection.outbound.reap_zerocopy(connection.sock)) {
+                string call = "worker[" + to_string(index) + "]: recvmsg(" + to_string(details.addr) + ", MSG_ERRQUEUE)";
                 errno_to_cerr(call.c_str());
-                disconnected.push_back(i);
+                disconnected.push_back(connections.handle_at(i));
                 continue;
             }
-
-            string out = "(" + to_string(connections[i].addr) + ") " + message;
-            for (vector<async_context::connection>& assigned : context.all) {
-                int i = 0;
-                for (async_context::connection& connection : assigned) {
-                    if (send(connection.sock, out.c_str(), out.size() + 1, 0) == -1) {
-                        string call = "worker[" + to_string(index) + "]: send(worker[" + to_string(i) + "]: " + to_string(connections[i].addr) + ")";
+            if (pollfds[i].revents & POLLOUT) {
+                if (!asynchronous_write(context, connection, details)) {
+                    if (send_failures.allow()) {
+                        string call = "worker[" + to_string(index) + "]: send(" + to_string(details.addr) + ")";
                         errno_to_cerr(call.c_str());
                     }
-                    i++;
+                    connection.outbound.clear();
+                    disconnected.push_back(connections.handle_at(i));
+                    continue;
+                }
+            }
+
+            //A throttled connection that hung up is still read, and so dropped, poll would otherwise report it on every pass
+            if (!(pollfds[i].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+
+            //poll reported POLLIN, one recv can not block and hands over every frame already buffered
+            ssize_t received = details.frames.fill(connection.sock);
+            if (received <= 0) {
+                if (received == -1) {
+                    string call = "worker[" + to_string(index) + "]: recv(" + to_string(details.addr) + ")";
+                    errno_to_cerr(call.c_str());
+                }
+                disconnected.push_back(connections.handle_at(i));
+                continue;
+            }
+
+            const uint64_t received_at = metrics_clock();
+            details.timeouts.read_at = received_at;
+            const uint64_t frames_before = frames;
+            string_view message;
+            while (details.frames.next(message)) {
+                frames++;
+                //The answer goes out with the flush below
+                if (negotiate_binary(message, details.frames, connection.outbound)) {
+                    continue;
+                }
+                if (message == HEARTBEAT_PONG) {
+                    continue;
+                }
+                if (self.rooms.handle(message, connections.handle_at(i), details.rooms)) {
+                    continue;
+                }
+                //Started by the write below once the queue is empty
+                history_request request;
+                if (context.history.enabled() && parse_history_command(message, request)) {
+                    details.replay.request(request);
+                    continue;
+                }
+
+                string out = "(" + to_string(details.addr) + ") " + details.rooms.current_prefix;
+                out.append(message);
+                log_chat(out);
+                if (context.history.enabled()) {
+                    context.history.append(out);
+                }
+
+                //Only queues here, each owner flushes when its socket is writable
+                asynchronous_publish(context, index, { make_shared<const string>(std::move(out)), details.rooms.current });
+                const uint64_t published_at = metrics_clock();
+                metrics_record(distribution::broadcast_ns, published_at - received_at);
+                context.rates.record_fanout(published_at - received_at, published_at);
+
+                if (message.rfind(".exit", 0) == 0) {
+                    disconnected.push_back(connections.handle_at(i));
+                    break;
                 }
             }
-            cout << out << '\n';
 
-            if (message.rfind(".exit", 0) == 0) {
-                disconnected.push_back(i);
+            if (context.rates.config.enabled()) {
+                details.rate.throttled_until = context.rates.charge(details.rate, frames - frames_before, received, received_at);
+                if (details.rate.throttled_until != 0) {
+                    metrics_add(counter::throttled);
+                }
             }
         }
 
-        for (const int& to_erase : disconnected) {
-            if (shutdown(connections[to_erase].sock, SHUT_RDWR) == -1) {
-                string call = "worker[" + to_string(index) + "]: shutdown(" + to_string(connections[to_erase].addr) + ")";
+        if (self.timers.size() != 0) {
+            asynchronous_expire(context, index, metrics_clock(), disconnected);
+        }
+
+        const uint64_t flushed_at = context.outbound.flush_window_us == 0 ? 0 : metrics_clock();
+        size_t queued = 0;
+        for (size_t i = 0; i < connections.size(); i++) {
+            async_context::connection& connection = connections.hot_at(i);
+            async_context::connection_details& details = connections.cold_at(i);
+            const bool replay_ready = details.replay.streaming() || (details.replay.pending() && connection.outbound.empty());
+            if (!replay_ready && (connection.outbound.empty() || !connection.outbound.due(flushed_at, context.outbound))) {
+                queued += connection.outbound.bytes;
+                continue;
+            }
+            if (!asynchronous_write(context, connection, details)) {
+                if (send_failures.allow()) {
+                    string call = "worker[" + to_string(index) + "]: send(" + to_string(details.addr) + ")";
+                    errno_to_cerr(call.c_str());
+                }
+            }
+            queued += connection.outbound.bytes;
+        }
+        self.frames.store(frames, std::memory_order_relaxed);
+        self.queued.store(queued, std::memory_order_relaxed);
+
+        for (const connection_handle& handle : disconnected) {
+            async_context::connection* connection = connections.hot(handle);
+            if (connection == nullptr) {
+                continue;
+            }
+            const peer_address addr = connections.cold(handle)->addr;
+            if (shutdown(connection->sock, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+                string call = "worker[" + to_string(index) + "]: shutdown(" + to_string(addr) + ")";
                 errno_to_cerr(call.c_str());
             }
-            if (close(connections[to_erase].sock) == -1) {
-                string call = "worker[" + to_string(index) + "]: close(" + to_string(connections[to_erase].addr) + ")";
+            if (close(connection->sock) == -1) {
+                string call = "worker[" + to_string(index) + "]: close(" + to_string(addr) + ")";
                 errno_to_cerr(call.c_str());
             }
-            connections.erase(connections.begin() + to_erase);
-            cout << to_string(connections[to_erase].addr) << " Disconected\n";
+            self.rooms.remove(handle, connections.cold(handle)->rooms);
+            connections.erase(handle);
+            self.load--;
+            metrics_add(counter::disconnects);
+            log_write(log_level::info, to_string(addr) + " Disconnected");
         }
     }
 }
 
-int asynchronous_workers(int listener) {
-    const size_t MAX_HARDWARE_CONCURRENCY = 1;
-    async_context context = async_context(MAX_HARDWARE_CONCURRENCY);
-    context.locks[0].lock();
-    context.locks[0].unlock();
+//Connection equivalents a worker is carrying
+static double asynchronous_score(const async_context::worker& worker, double frame_rate) {
+    return worker.load.load(std::memory_order_relaxed) + frame_rate / FRAMES_PER_CONNECTION + worker.queued.load(std::memory_order_relaxed) / QUEUED_BYTES_PER_CONNECTION;
+}
+
+//Tracks every worker's recent frame rate, places new connections and decides when connections move
+struct async_balancer {
+    vector<double> frame_rates;
+    vector<uint64_t> last_frames;
+    uint64_t sampled_at = 0;
+    uint64_t rebalanced_at = 0;
+
+    explicit async_balancer(size_t worker_count)
+        : frame_rates(worker_count), last_frames(worker_count) {}
+
+    size_t least_loaded(const async_context& context) const {
+        size_t least = 0;
+        for (size_t i = 1; i < context.workers.size(); i++) {
+            if (asynchronous_score(context.workers[i], frame_rates[i]) < asynchronous_score(context.workers[least], frame_rates[least])) {
+                least = i;
+            }
+        }
+        return least;
+    }
+
+    void sample(async_context& context, unsigned rebalance_percent) {
+        const uint64_t now = metrics_clock();
+        if (now - sampled_at < static_cast<uint64_t>(LOAD_SAMPLE_INTERVAL_MS) * 1000000) {
+            return;
+        }
+        const double elapsed_s = (now - sampled_at) / 1e9;
+        sampled_at = now;
+        //Smoothed so one burst does not move anything
+        for (size_t i = 0; i < context.workers.size(); i++) {
+            const uint64_t frames = context.workers[i].frames.load(std::memory_order_relaxed);
+            frame_rates[i] = frame_rates[i] * 0.75 + (frames - last_frames[i]) / elapsed_s * 0.25;
+            last_frames[i] = frames;
+        }
+
+        //One rebalance at a time, and not before the last one settled
+        if (rebalance_percent == 0 || context.workers.size() < 2 || now - rebalanced_at < REBALANCE_COOLDOWN_NS ||
+            context.rebalance_completed.load(std::memory_order_acquire) != context.rebalance_requested.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        size_t busiest = 0;
+        for (size_t i = 1; i < context.workers.size(); i++) {
+            if (asynchronous_score(context.workers[i], frame_rates[i]) > asynchronous_score(context.workers[busiest], frame_rates[busiest])) {
+                busiest = i;
+            }
+        }
+        const size_t idlest = least_loaded(context);
+        const double high = asynchronous_score(context.workers[busiest], frame_rates[busiest]);
+        const double low = asynchronous_score(context.workers[idlest], frame_rates[idlest]);
+        const size_t owned = context.workers[busiest].load.load(std::memory_order_relaxed);
+        if (owned < 2 || high <= low * (100 + rebalance_percent) / 100 + REBALANCE_SLACK) {
+            return;
+        }
+
+        //Connections on the busiest worker are taken as equally loaded, enough of them move to meet in the middle
+        size_t count = static_cast<size_t>(owned * (high - low) / (2 * high));
+        count = std::clamp<size_t>(count, 1, MAX_MIGRATIONS_PER_REBALANCE);
+        context.plan.from = busiest;
+        context.plan.to = idlest;
+        context.plan.count = count;
+        rebalanced_at = now;
+        context.rebalance_requested.fetch_add(1, std::memory_order_release);
+        for (size_t i = 0; i < context.workers.size(); i++) {
+            context.bus.notify(i);
+        }
+    }
+};
 
-    thread workers[MAX_HARDWARE_CONCURRENCY];
+int asynchronous_workers(const vector<int>& listeners, const server_options& options) {
+    async_context context = async_context(MAX_HARDWARE_CONCURRENCY);
+    context.outbound = options.outbound;
+    context.timeouts = options.timeouts;
+    context.rates.config = options.rates;
+    if (options.history_path != nullptr && !context.history.open(options.history_path, options.history_segment_size, options.history_segments)) {
+        return EXIT_FAILURE;
+    }
+    if (!context.bus.open()) {
+        errno_to_cerr("eventfd(...)");
+        return EXIT_FAILURE;
+    }
 
-    for (int i = 0; i < MAX_HARDWARE_CONCURRENCY; i++) {
-        workers[i] = thread(asynchronous_worker, ref(context), i);
+    vector<thread> workers;
+    for (size_t i = 0; i < MAX_HARDWARE_CONCURRENCY; i++) {
+        workers.emplace_back(asynchronous_worker, ref(context), i);
     }
 
-    int next_assignment_index = 0;
-    pollfd listener_poll;
-    listener_poll.fd = listener;
-    listener_poll.events = POLLIN;
+    async_balancer balancer = async_balancer(MAX_HARDWARE_CONCURRENCY);
+    accept_meter accepts;
+    vector<pollfd> listener_polls(listeners.size());
+    for (size_t i = 0; i < listeners.size(); i++) {
+        listener_polls[i].fd = listeners[i];
+        listener_polls[i].events = POLLIN;
+    }
     while (true) {
-        if (poll(&listener_poll, 1, 100) == -1) {
+        const int ready = poll(listener_polls.data(), listener_polls.size(), LOAD_SAMPLE_INTERVAL_MS);
+        if (ready == -1 && errno != EINTR) {
             errno_to_cerr("poll(...)");
         }
+        balancer.sample(context, options.rebalance_percent);
 
-        if (!(listener_poll.revents & POLLIN)) {
-            using namespace std::chrono_literals;
-            sleep_for(50ms);
+        if (ready <= 0) {
+            accepts.drained(0);
             continue;
         }
 
-        {
-            mutex& clients_lock = context.locks[next_assignment_index];
-            vector<async_context::connection>& clients = context.all[next_assignment_index];
-
-            clients_lock.lock();
-            defer([&]() {
-                clients_lock.unlock();
-                using namespace std::chrono_literals;
-                sleep_for(50ms);
-            });
-            clients.push_back({});
-
-            async_context::connection& client = clients.back();
-            client.sock = accept(listener, reinterpret_cast<sockaddr*>(&client.addr), &client.addr_len);
-            if (client.sock == -1) {
-                clients.pop_back();
-                errno_to_cerr("accept(...)");
+        //Drained in one go, a reconnect storm is taken at the rate accept4 runs instead of one connection per poll
+        uint64_t accepted = 0;
+        for (const pollfd& listener : listener_polls) {
+            if (!(listener.revents & POLLIN)) {
                 continue;
             }
-            cout << to_string(client.addr) << " Connected\n";
-        }
-
-        int i = MAX_HARDWARE_CONCURRENCY;
-        while (true) {
-            for (i = 0; i < MAX_HARDWARE_CONCURRENCY; i++) {
-                next_assignment_index = (next_assignment_index + i) % MAX_HARDWARE_CONCURRENCY;
-                if (context.all[next_assignment_index].size() != MAX_CONNECTIONS_PER_WORKER) {
+            while (true) {
+                async_context::accepted client;
+                client.sock = accept4(listener.fd, client.addr.get(), &client.addr.length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client.sock == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        errno_to_cerr("accept4(...)");
+                    }
                     break;
                 }
-            }
+                accepted++;
+                metrics_add(counter::accepts);
+                if (!identify_peer(client.sock, client.addr)) {
+                    errno_to_cerr("getsockopt(..., SO_PEERCRED, ...)");
+                    close(client.sock);
+                    continue;
+                }
+                if (!context.rates.admit(metrics_clock())) {
+                    reject_connection(client.sock, client.addr);
+                    continue;
+                }
+                if (!tune_socket(client.sock, context.outbound)) {
+                    errno_to_cerr("setsockopt(...)");
+                }
+                log_write(log_level::info, to_string(client.addr) + " Connected");
 
-            if (i == MAX_HARDWARE_CONCURRENCY) {
-                cerr << "Server at 100% load\n";
-                using namespace std::chrono_literals;
-                sleep_for(3s);
+                const size_t assigned_index = balancer.least_loaded(context);
+                async_context::worker& assigned = context.workers[assigned_index];
+                assigned.load++;
+                bool first = false;
+                {
+                    lock_guard<mutex> guard(assigned.handoff_lock);
+                    first = assigned.handoff.empty();
+                    assigned.handoff.push_back(std::move(client));
+                    assigned.handed_off.store(true, std::memory_order_release);
+                }
+                //A worker already holding a handoff has been woken for it
+                if (first) {
+                    context.bus.notify(assigned_index);
+                }
             }
-
-            break;
         }
+        accepts.drained(accepted);
     }
 
     return EXIT_SUCCESS;
@@ -349,58 +1203,438 @@ constexpr const size_t HARDWARE_METHOD_LENGTH = sizeof(HARDWARE_METHOD) / sizeof
 constexpr const char ASYNC_METHOD[] = "async";
 constexpr const size_t ASYNC_METHOD_LENGTH = sizeof(ASYNC_METHOD) / sizeof(ASYNC_METHOD[0]);
 
-int server(const char concurrency_method[]) {
-    if (concurrency_method == nullptr) {
-        cerr << "Must specify either '" << HARDWARE_METHOD << "' or '" << ASYNC_METHOD << "'\n";
-        return EXIT_FAILURE;
-    }
+constexpr const char EPOLL_METHOD[] = "epoll";
+constexpr const size_t EPOLL_METHOD_LENGTH = sizeof(EPOLL_METHOD) / sizeof(EPOLL_METHOD[0]);
+
+constexpr const char URING_METHOD[] = "uring";
+constexpr const size_t URING_METHOD_LENGTH = sizeof(URING_METHOD) / sizeof(URING_METHOD[0]);
+
+constexpr const char SHARDED_METHOD[] = "sharded";
+constexpr const size_t SHARDED_METHOD_LENGTH = sizeof(SHARDED_METHOD) / sizeof(SHARDED_METHOD[0]);
+
+constexpr const char COROUTINE_METHOD[] = "coroutine";
+constexpr const size_t COROUTINE_METHOD_LENGTH = sizeof(COROUTINE_METHOD) / sizeof(COROUTINE_METHOD[0]);
+
+constexpr const char PIN_OPTION[] = "--pin";
+constexpr const char OUTBOUND_LIMIT_OPTION[] = "--outbound-limit";
+constexpr const char SLOW_CONSUMER_OPTION[] = "--slow-consumer";
+constexpr const char STATS_OPTION[] = "--stats";
+constexpr const char LOG_LEVEL_OPTION[] = "--log-level";
+constexpr const char NO_ECHO_OPTION[] = "--no-echo";
+constexpr const char FLUSH_WINDOW_OPTION[] = "--flush-window";
+constexpr const char FLUSH_BYTES_OPTION[] = "--flush-bytes";
+constexpr const char NODELAY_OPTION[] = "--nodelay";
+constexpr const char SEND_BUFFER_OPTION[] = "--send-buffer";
+constexpr const char ZEROCOPY_OPTION[] = "--zerocopy";
+constexpr const char REBALANCE_OPTION[] = "--rebalance";
+constexpr const char BACKLOG_OPTION[] = "--backlog";
+constexpr const char DEFER_ACCEPT_OPTION[] = "--defer-accept";
+constexpr const char IDLE_TIMEOUT_OPTION[] = "--idle-timeout";
+constexpr const char HEARTBEAT_OPTION[] = "--heartbeat";
+constexpr const char WRITE_TIMEOUT_OPTION[] = "--write-timeout";
+constexpr const char UNIX_OPTION[] = "--unix";
+constexpr const char SEQPACKET_OPTION[] = "--seqpacket";
+constexpr const char SHM_RING_OPTION[] = "--shm-ring";
+constexpr const char HISTORY_OPTION[] = "--history";
+constexpr const char HISTORY_SEGMENT_OPTION[] = "--history-segment";
+constexpr const char HISTORY_SEGMENTS_OPTION[] = "--history-segments";
+constexpr const char RATE_MESSAGES_OPTION[] = "--rate-messages";
+constexpr const char RATE_BYTES_OPTION[] = "--rate-bytes";
+constexpr const char GLOBAL_RATE_MESSAGES_OPTION[] = "--global-rate-messages";
+constexpr const char GLOBAL_RATE_BYTES_OPTION[] = "--global-rate-bytes";
+constexpr const char ADMISSION_LATENCY_OPTION[] = "--admission-latency";
+
+static void methods_to_cerr() {
+    cerr << "Must specify one of '" << HARDWARE_METHOD << "', '" << ASYNC_METHOD << "', '" << EPOLL_METHOD << "', '" << URING_METHOD << "', '" << SHARDED_METHOD << "' or '" << COROUTINE_METHOD << "'\n";
+}
+
+static bool parse_server_options(int option_count, char* options[], server_options& parsed) {
+    for (int i = 0; i < option_count; i++) {
+        if (strcmp(options[i], PIN_OPTION) == 0) {
+            parsed.pin_workers = true;
+            continue;
+        }
+
+        if (strcmp(options[i], OUTBOUND_LIMIT_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long limit = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || limit == 0) {
+                cerr << OUTBOUND_LIMIT_OPTION << " expects a positive byte count\n";
+                return false;
+            }
+            parsed.outbound.limit = limit;
+            continue;
+        }
+
+        if (strcmp(options[i], SLOW_CONSUMER_OPTION) == 0 && i + 1 < option_count) {
+            if (!parse_slow_consumer_policy(options[++i], parsed.outbound.policy)) {
+                cerr << SLOW_CONSUMER_OPTION << " expects 'drop', 'disconnect' or 'block'\n";
+                return false;
+            }
+            continue;
+        }
+
+        if (strcmp(options[i], STATS_OPTION) == 0 && i + 1 < option_count) {
+            parsed.stats_path = options[++i];
+            continue;
+        }
+
+        if (strcmp(options[i], LOG_LEVEL_OPTION) == 0 && i + 1 < option_count) {
+            if (!parse_log_level(options[++i], parsed.log_threshold)) {
+                cerr << LOG_LEVEL_OPTION << " expects 'debug', 'info', 'warning' or 'error'\n";
+                return false;
+            }
+            continue;
+        }
+
+        if (strcmp(options[i], NO_ECHO_OPTION) == 0) {
+            parsed.echo_chat = false;
+            continue;
+        }
+
+        if (strcmp(options[i], FLUSH_WINDOW_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long window = strtoull(options[++i], &end, 10);
+            if (*end != '\0') {
+                cerr << FLUSH_WINDOW_OPTION << " expects a microsecond count\n";
+                return false;
+            }
+            parsed.outbound.flush_window_us = window;
+            continue;
+        }
 
-    cout << "Serving...\n";
+        if (strcmp(options[i], FLUSH_BYTES_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long threshold = strtoull(options[++i], &end, 10);
+            if (*end != '\0') {
+                cerr << FLUSH_BYTES_OPTION << " expects a byte count\n";
+                return false;
+            }
+            parsed.outbound.flush_bytes = threshold;
+            continue;
+        }
+
+        if (strcmp(options[i], NODELAY_OPTION) == 0) {
+            parsed.outbound.tcp_nodelay = true;
+            continue;
+        }
+
+        if (strcmp(options[i], SEND_BUFFER_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long size = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || size == 0 || size > INT_MAX) {
+                cerr << SEND_BUFFER_OPTION << " expects a positive byte count\n";
+                return false;
+            }
+            parsed.outbound.send_buffer = static_cast<int>(size);
+            continue;
+        }
+
+        if (strcmp(options[i], ZEROCOPY_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long threshold = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || threshold == 0) {
+                cerr << ZEROCOPY_OPTION << " expects a positive byte count\n";
+                return false;
+            }
+            parsed.outbound.zerocopy_threshold = threshold;
+            continue;
+        }
+
+        if (strcmp(options[i], REBALANCE_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long percent = strtoul(options[++i], &end, 10);
+            if (*end != '\0' || percent > 1000) {
+                cerr << REBALANCE_OPTION << " expects a percentage up to 1000, 0 to never move connections\n";
+                return false;
+            }
+            parsed.rebalance_percent = percent;
+            continue;
+        }
+
+        if (strcmp(options[i], BACKLOG_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            long backlog = strtol(options[++i], &end, 10);
+            if (*end != '\0' || backlog <= 0 || backlog > INT_MAX) {
+                cerr << BACKLOG_OPTION << " expects a positive connection count\n";
+                return false;
+            }
+            parsed.backlog = backlog;
+            continue;
+        }
+
+        if (strcmp(options[i], DEFER_ACCEPT_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            long seconds = strtol(options[++i], &end, 10);
+            if (*end != '\0' || seconds <= 0 || seconds > INT_MAX) {
+                cerr << DEFER_ACCEPT_OPTION << " expects a positive number of seconds\n";
+                return false;
+            }
+            parsed.defer_accept_s = seconds;
+            continue;
+        }
+
+        if ((strcmp(options[i], IDLE_TIMEOUT_OPTION) == 0 || strcmp(options[i], HEARTBEAT_OPTION) == 0 || strcmp(options[i], WRITE_TIMEOUT_OPTION) == 0) && i + 1 < option_count) {
+            const char* option = options[i];
+            char* end = nullptr;
+            unsigned long long milliseconds = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || milliseconds == 0) {
+                cerr << option << " expects a positive number of milliseconds\n";
+                return false;
+            }
+            uint64_t& timeout = strcmp(option, IDLE_TIMEOUT_OPTION) == 0 ? parsed.timeouts.idle_ns : strcmp(option, HEARTBEAT_OPTION) == 0 ? parsed.timeouts.heartbeat_ns : parsed.timeouts.write_ns;
+            timeout = milliseconds * 1000000;
+            continue;
+        }
+
+        if ((strcmp(options[i], UNIX_OPTION) == 0 || strcmp(options[i], SEQPACKET_OPTION) == 0) && i + 1 < option_count) {
+            const bool packet = strcmp(options[i], SEQPACKET_OPTION) == 0;
+            parsed.local_endpoints.push_back({ options[++i], packet });
+            continue;
+        }
+
+        if (strcmp(options[i], SHM_RING_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long size = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || size < MIN_SHM_RING_SIZE || size > MAX_SHM_RING_SIZE) {
+                cerr << SHM_RING_OPTION << " expects a byte count from " << MIN_SHM_RING_SIZE << " to " << MAX_SHM_RING_SIZE << '\n';
+                return false;
+            }
+            parsed.shm_ring_bytes = size;
+            continue;
+        }
+
+        if (strcmp(options[i], HISTORY_OPTION) == 0 && i + 1 < option_count) {
+            parsed.history_path = options[++i];
+            continue;
+        }
+
+        if (strcmp(options[i], HISTORY_SEGMENT_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long size = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || size < MIN_HISTORY_SEGMENT_SIZE || size > MAX_HISTORY_SEGMENT_SIZE) {
+                cerr << HISTORY_SEGMENT_OPTION << " expects a byte count from " << MIN_HISTORY_SEGMENT_SIZE << " to " << MAX_HISTORY_SEGMENT_SIZE << '\n';
+                return false;
+            }
+            parsed.history_segment_size = size;
+            continue;
+        }
+
+        if (strcmp(options[i], HISTORY_SEGMENTS_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long count = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || count == 0) {
+                cerr << HISTORY_SEGMENTS_OPTION << " expects a positive segment count\n";
+                return false;
+            }
+            parsed.history_segments = count;
+            continue;
+        }
+
+        if ((strcmp(options[i], RATE_MESSAGES_OPTION) == 0 || strcmp(options[i], RATE_BYTES_OPTION) == 0 || strcmp(options[i], GLOBAL_RATE_MESSAGES_OPTION) == 0 || strcmp(options[i], GLOBAL_RATE_BYTES_OPTION) == 0) && i + 1 < option_count) {
+            const char* option = options[i];
+            char* end = nullptr;
+            unsigned long long rate = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || rate == 0) {
+                cerr << option << " expects a positive count per second\n";
+                return false;
+            }
+            uint64_t& limit = strcmp(option, RATE_MESSAGES_OPTION) == 0 ? parsed.rates.connection_messages : strcmp(option, RATE_BYTES_OPTION) == 0 ? parsed.rates.connection_bytes :
+                strcmp(option, GLOBAL_RATE_MESSAGES_OPTION) == 0 ? parsed.rates.global_messages : parsed.rates.global_bytes;
+            limit = rate;
+            continue;
+        }
+
+        if (strcmp(options[i], ADMISSION_LATENCY_OPTION) == 0 && i + 1 < option_count) {
+            char* end = nullptr;
+            unsigned long long microseconds = strtoull(options[++i], &end, 10);
+            if (*end != '\0' || microseconds == 0) {
+                cerr << ADMISSION_LATENCY_OPTION << " expects a positive number of microseconds\n";
+                return false;
+            }
+            parsed.rates.admission_ns = microseconds * 1000;
+            continue;
+        }
 
-    int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        cerr << "Unknown server option '" << options[i] << "'\n";
+        return false;
+    }
+    return true;
+}
+
+int open_listener(bool reuse_port, const server_options& options) {
+    //One IPv6 socket takes IPv4 connections too as mapped addresses, a kernel built without IPv6 gets a plain IPv4 one
+    int family = AF_INET6;
+    int listener = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == -1 && errno == EAFNOSUPPORT) {
+        family = AF_INET;
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    }
     if (listener == -1) {
         errno_to_cerr("socket(...)");
-        return EXIT_FAILURE;
+        return -1;
     }
+
+    bool opened = false;
     defer([&]() {
-        if (close(listener) == -1) {
+        if (!opened && close(listener) == -1) {
             errno_to_cerr("close(listener)");
         }
     });
 
-    sockaddr_in all;
+    int enable = 1;
+    if (reuse_port && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+        errno_to_cerr("setsockopt(..., SO_REUSEPORT, ...)");
+        return -1;
+    }
+
+    //net.ipv6.bindv6only may make IPv6 sockets default to IPv6 only
+    const int disable = 0;
+    if (family == AF_INET6 && setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable)) == -1) {
+        errno_to_cerr("setsockopt(..., IPV6_V6ONLY, ...)");
+        return -1;
+    }
+
+    sockaddr_in6 all6 = {};
+    all6.sin6_family = AF_INET6;
+    all6.sin6_addr = in6addr_any;
+    all6.sin6_port = htons(PORT);
+    sockaddr_in all = {};
     all.sin_family = AF_INET;
     all.sin_addr.s_addr = 0;
     all.sin_port = htons(PORT);
-    if (bind(listener, reinterpret_cast<sockaddr*>(&all), sizeof(all)) == -1) {
+    const int bound = family == AF_INET6 ?
+        bind(listener, reinterpret_cast<sockaddr*>(&all6), sizeof(all6)) :
+        bind(listener, reinterpret_cast<sockaddr*>(&all), sizeof(all));
+    if (bound == -1) {
         errno_to_cerr("bind(...)");
-        return EXIT_FAILURE;
+        return -1;
+    }
+
+    //Set before listen so no connection is handed over early
+    if (options.defer_accept_s != 0 && setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.defer_accept_s, sizeof(options.defer_accept_s)) == -1) {
+        errno_to_cerr("setsockopt(..., TCP_DEFER_ACCEPT, ...)");
+        return -1;
     }
 
-    if (listen(listener, MAX_HARDWARE_CONCURRENCY)) {
+    if (listen(listener, options.backlog)) {
         errno_to_cerr("listen(...)");
-        return EXIT_FAILURE;
+        return -1;
     }
 
     int fcntl_flags = fcntl(listener, F_GETFL, 0);
     if (fcntl_flags == -1) {
         errno_to_cerr("fcntl(..., F_GETFL, ...)");
-        return EXIT_FAILURE;
+        return -1;
     }
 
     fcntl_flags |= O_NONBLOCK;
 
     if (fcntl(listener, F_SETFL, fcntl_flags) == -1) {
         errno_to_cerr("fcntl(..., F_SETFL, ...)");
+        return -1;
+    }
+
+    opened = true;
+    return listener;
+}
+
+int server(const char concurrency_method[], int option_count, char* options[]) {
+    if (concurrency_method == nullptr) {
+        methods_to_cerr();
         return EXIT_FAILURE;
     }
 
-    if (strncmp(concurrency_method, HARDWARE_METHOD, HARDWARE_METHOD_LENGTH) == 0) {
-        return hardware_concurrency_limit(listener);
-    } else if (strncmp(concurrency_method, ASYNC_METHOD, ASYNC_METHOD_LENGTH) == 0) {
-        return asynchronous_workers(listener);
+    const bool hardware = strncmp(concurrency_method, HARDWARE_METHOD, HARDWARE_METHOD_LENGTH) == 0;
+    const bool async = strncmp(concurrency_method, ASYNC_METHOD, ASYNC_METHOD_LENGTH) == 0;
+    const bool epoll = strncmp(concurrency_method, EPOLL_METHOD, EPOLL_METHOD_LENGTH) == 0;
+    const bool uring = strncmp(concurrency_method, URING_METHOD, URING_METHOD_LENGTH) == 0;
+    const bool sharded = strncmp(concurrency_method, SHARDED_METHOD, SHARDED_METHOD_LENGTH) == 0;
+    const bool coroutine = strncmp(concurrency_method, COROUTINE_METHOD, COROUTINE_METHOD_LENGTH) == 0;
+    if (!hardware && !async && !epoll && !uring && !sharded && !coroutine) {
+        methods_to_cerr();
+        return EXIT_FAILURE;
     }
 
-    cerr << "Must specify either '" << HARDWARE_METHOD << "' or '" << ASYNC_METHOD << "'\n";
-    return EXIT_FAILURE;
+    server_options parsed;
+    if (!parse_server_options(option_count, options, parsed)) {
+        return EXIT_FAILURE;
+    }
+
+    //Every option below is refused by the methods that would silently ignore it
+    //Only these loops drive a timer wheel
+    if (parsed.timeouts.enabled() && !async && !epoll && !sharded) {
+        cerr << IDLE_TIMEOUT_OPTION << ", " << HEARTBEAT_OPTION << " and " << WRITE_TIMEOUT_OPTION << " are only enforced by '" << ASYNC_METHOD << "', '" << EPOLL_METHOD << "' and '" << SHARDED_METHOD << "'\n";
+        return EXIT_FAILURE;
+    }
+    //The coroutine and io_uring sends never ask for SO_ZEROCOPY
+    if (parsed.outbound.zerocopy_threshold != 0 && !hardware && !async && !epoll && !sharded) {
+        cerr << ZEROCOPY_OPTION << " is only used by '" << HARDWARE_METHOD << "', '" << ASYNC_METHOD << "', '" << EPOLL_METHOD << "' and '" << SHARDED_METHOD << "'\n";
+        return EXIT_FAILURE;
+    }
+    //Only the epoll connections offer unix clients a shared ring
+    if (parsed.shm_ring_bytes != 0 && !epoll && !sharded) {
+        cerr << SHM_RING_OPTION << " is only offered by '" << EPOLL_METHOD << "' and '" << SHARDED_METHOD << "'\n";
+        return EXIT_FAILURE;
+    }
+    //Only the hardware and async broadcasts append to the log and replay it
+    const bool keeps_history = parsed.history_path != nullptr || parsed.history_segment_size != DEFAULT_HISTORY_SEGMENT_SIZE || parsed.history_segments != DEFAULT_HISTORY_SEGMENTS;
+    if (keeps_history && !hardware && !async) {
+        cerr << HISTORY_OPTION << ", " << HISTORY_SEGMENT_OPTION << " and " << HISTORY_SEGMENTS_OPTION << " are only used by '" << HARDWARE_METHOD << "' and '" << ASYNC_METHOD << "'\n";
+        return EXIT_FAILURE;
+    }
+    //Only the hardware and async loops charge reads and check admission
+    if ((parsed.rates.enabled() || parsed.rates.admission_ns != 0) && !hardware && !async) {
+        cerr << RATE_MESSAGES_OPTION << ", " << RATE_BYTES_OPTION << ", " << GLOBAL_RATE_MESSAGES_OPTION << ", " << GLOBAL_RATE_BYTES_OPTION << " and " << ADMISSION_LATENCY_OPTION << " are only enforced by '" << HARDWARE_METHOD << "' and '" << ASYNC_METHOD << "'\n";
+        return EXIT_FAILURE;
+    }
+
+    if (parsed.stats_path != nullptr && !serve_metrics(parsed.stats_path)) {
+        string call = string("serve_metrics(") + parsed.stats_path + ")";
+        errno_to_cerr(call.c_str());
+        return EXIT_FAILURE;
+    }
+
+    log_start(parsed.log_threshold, parsed.echo_chat);
+    defer([&]() {
+        log_stop();
+    });
+    log_write(log_level::info, "Serving...");
+
+    //Every socket bound to the port must set SO_REUSEPORT, including this first one
+    vector<int> listeners;
+    defer([&]() {
+        for (int listener : listeners) {
+            if (close(listener) == -1) {
+                errno_to_cerr("close(listener)");
+            }
+        }
+    });
+    int listener = open_listener(sharded, parsed);
+    if (listener == -1) {
+        return EXIT_FAILURE;
+    }
+    listeners.push_back(listener);
+
+    for (const local_endpoint& endpoint : parsed.local_endpoints) {
+        int local = open_local_listener(endpoint, parsed.backlog);
+        if (local == -1) {
+            return EXIT_FAILURE;
+        }
+        listeners.push_back(local);
+        log_write(log_level::info, string("Also serving ") + (endpoint.packet ? SEQPACKET_PREFIX : UNIX_PREFIX) + endpoint.path);
+    }
+
+    if (hardware) {
+        return hardware_concurrency_limit(listeners, parsed);
+    } else if (async) {
+        return asynchronous_workers(listeners, parsed);
+    } else if (epoll) {
+        return epoll_workers(listeners, parsed);
+    } else if (uring) {
+        return uring_workers(listeners, parsed);
+    } else if (sharded) {
+        return sharded_workers(listeners, parsed);
+    }
+    return coroutine_workers(listeners, parsed);
 }
@@ -0,0 +1,59 @@
+#pragma once
+#include "outbound.hpp"
+#include "timers.hpp"
+#include "log.hpp"
+#include "transport.hpp"
+#include "history.hpp"
+#include "rate_limit.hpp"
+#include <vector>
+#include <sys/socket.h>
+
+struct server_options {
+    //Pin each worker thread to its own core
+    bool pin_workers = false;
+    outbound_config outbound;
+    //Local socket serving metrics snapshots, none when nullptr
+    const char* stats_path = nullptr;
+    log_level log_threshold = log_level::info;
+    //Relayed chat messages are printed to stdout
+    bool echo_chat = true;
+    //Percent the busiest async worker may exceed the idlest by before connections move, 0 never moves any
+    unsigned rebalance_percent = 25;
+    //Connections the kernel queues before accept, it silently caps this at net.core.somaxconn
+    int backlog = SOMAXCONN;
+    //Seconds the kernel holds a connection that has sent nothing before handing it to accept, 0 hands it over at once
+    //A client that only listens misses what is said before it is handed over
+    int defer_accept_s = 0;
+    //Enforced by the epoll, sharded and async servers, the others refuse to start with any set
+    timeout_config timeouts;
+    //Listened on beside TCP, each with backlog
+    std::vector<local_endpoint> local_endpoints;
+    //Bytes of the shared ring a local client of the epoll or sharded server gets on SHM_REQUEST, 0 refuses them
+    size_t shm_ring_bytes = 0;
+    //Directory the hardware and async servers keep message history in, none when nullptr
+    const char* history_path = nullptr;
+    size_t history_segment_size = DEFAULT_HISTORY_SEGMENT_SIZE;
+    size_t history_segments = DEFAULT_HISTORY_SEGMENTS;
+    //Enforced by the hardware and async servers, a connection over its rate or one read over the server's is not read again until the debt is paid
+    rate_config rates;
+};
+
+//Bound to PORT on every IPv6 and IPv4 address, listening with options.backlog and non-blocking, -1 once the failure has been reported
+int open_listener(bool reuse_port, const server_options& options);
+
+//Each server accepts on every one of listeners, the TCP listener first and then one per options.local_endpoints
+int hardware_concurrency_limit(const std::vector<int>& listeners, const server_options& options);
+
+int asynchronous_workers(const std::vector<int>& listeners, const server_options& options);
+
+//Workers share the listeners and wake exclusively on new connections
+int epoll_workers(const std::vector<int>& listeners, const server_options& options);
+
+//Every worker owns a SO_REUSEPORT TCP listener, the first one being listeners[0], and shares the local ones
+int sharded_workers(const std::vector<int>& listeners, const server_options& options);
+
+//One thread, a coroutine per connection on an epoll loop
+int coroutine_workers(const std::vector<int>& listeners, const server_options& options);
+
+//Falls back to asynchronous_workers when the kernel lacks the required io_uring features
+int uring_workers(const std::vector<int>& listeners, const server_options& options);
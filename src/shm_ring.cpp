@@ -0,0 +1,204 @@
+#include "shm_ring.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::string_view;
+using std::memcpy;
+
+//Data starts on a cache line of its own after the header
+constexpr const size_t DATA_OFFSET = (sizeof(shm_ring_header) + 63) & ~size_t(63);
+
+shm_ring::~shm_ring() {
+    if (header != nullptr) {
+        munmap(header, mapped);
+    }
+    for (int descriptor : { memory, data_ready, space_ready }) {
+        if (descriptor != -1) {
+            close(descriptor);
+        }
+    }
+}
+
+bool shm_ring::map(size_t size) {
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    header = static_cast<shm_ring_header*>(address);
+    data = static_cast<char*>(address) + DATA_OFFSET;
+    capacity = size - DATA_OFFSET;
+    mapped = size;
+    return true;
+}
+
+bool shm_ring::create(size_t ring_capacity) {
+    ring_capacity &= ~(RECORD_ALIGNMENT - 1);
+    memory = memfd_create("chat-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memory == -1) {
+        return false;
+    }
+    //Sealed at its size, a client truncating the memfd would otherwise make the server fault on the next read
+    if (ftruncate(memory, DATA_OFFSET + ring_capacity) == -1 || fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        return false;
+    }
+    data_ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    space_ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (data_ready == -1 || space_ready == -1 || !map(DATA_OFFSET + ring_capacity)) {
+        return false;
+    }
+
+    //A fresh memfd reads as zeros, so both indices start at 0, the consumer starts out asleep
+    header->consumer_waiting.store(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool shm_ring::attach(int ring_memory, int ring_data_ready, int ring_space_ready) {
+    memory = ring_memory;
+    data_ready = ring_data_ready;
+    space_ready = ring_space_ready;
+
+    struct stat status;
+    if (fstat(memory, &status) == -1) {
+        return false;
+    }
+    if (static_cast<size_t>(status.st_size) < DATA_OFFSET + MIN_SHM_RING_SIZE) {
+        errno = EINVAL;
+        return false;
+    }
+    return map(status.st_size);
+}
+
+bool shm_ring::try_write(string_view message) {
+    const size_t size = record_size(message.size());
+    if (message.size() >= WRAP || size > capacity) {
+        return false;
+    }
+
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    const uint64_t tail = header->tail.load(std::memory_order_seq_cst);
+    const size_t offset = head % capacity;
+    //A record never straddles the end, the rest of the data is skipped when it does not fit
+    const size_t skipped = capacity - offset < size ? capacity - offset : 0;
+    if (capacity - (head - tail) < skipped + size) {
+        return false;
+    }
+
+    if (skipped != 0) {
+        memcpy(data + offset, &WRAP, sizeof(WRAP));
+        head += skipped;
+    }
+    const uint32_t length = message.size();
+    memcpy(data + head % capacity, &length, sizeof(length));
+    memcpy(data + head % capacity + sizeof(length), message.data(), message.size());
+    header->head.store(head + size, std::memory_order_seq_cst);
+
+    if (header->consumer_waiting.load(std::memory_order_seq_cst) != 0 && header->consumer_waiting.exchange(0) != 0) {
+        const uint64_t one = 1;
+        if (::write(data_ready, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool shm_ring::write(string_view message) {
+    if (record_size(message.size()) > capacity || message.size() >= WRAP) {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    while (!try_write(message)) {
+        //Announced before looking again, the consumer freeing space in between then writes the eventfd
+        header->producer_waiting.store(1, std::memory_order_seq_cst);
+        if (try_write(message)) {
+            return true;
+        }
+
+        pollfd writable = { space_ready, POLLIN, 0 };
+        if (poll(&writable, 1, -1) == -1 && errno != EINTR) {
+            return false;
+        }
+        uint64_t count;
+        if (read(space_ready, &count, sizeof(count)) == -1 && errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void shm_ring::release(uint64_t tail) {
+    consumed = tail;
+    header->tail.store(tail, std::memory_order_seq_cst);
+    if (header->producer_waiting.load(std::memory_order_seq_cst) != 0 && header->producer_waiting.exchange(0) != 0) {
+        //Best effort, a full counter means the producer has plenty of wakeups pending already
+        const uint64_t one = 1;
+        if (::write(space_ready, &one, sizeof(one)) == -1) {
+            errno = 0;
+        }
+    }
+}
+
+bool send_descriptors(int sock, string_view data, const int* descriptors, size_t count) {
+    char control[CMSG_SPACE(sizeof(int) * SHM_DESCRIPTORS)] = {};
+    if (count > SHM_DESCRIPTORS) {
+        errno = EINVAL;
+        return false;
+    }
+
+    iovec vector = { const_cast<char*>(data.data()), data.size() };
+    msghdr header = {};
+    header.msg_iov = &vector;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(rights), descriptors, sizeof(int) * count);
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (sent == -1 && errno == EINTR);
+    return sent == static_cast<ssize_t>(data.size());
+}
+
+ssize_t receive_descriptors(int sock, char* buffer, size_t size, int* descriptors, size_t capacity, size_t& count) {
+    char control[CMSG_SPACE(sizeof(int) * SHM_DESCRIPTORS)];
+    iovec vector = { buffer, size };
+    msghdr header = {};
+    header.msg_iov = &vector;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(sock, &header, MSG_CMSG_CLOEXEC);
+    if (received == -1) {
+        return -1;
+    }
+
+    for (cmsghdr* message = CMSG_FIRSTHDR(&header); message != nullptr; message = CMSG_NXTHDR(&header, message)) {
+        if (message->cmsg_level != SOL_SOCKET || message->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t arrived = (message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < arrived; i++) {
+            int descriptor;
+            memcpy(&descriptor, CMSG_DATA(message) + i * sizeof(int), sizeof(int));
+            if (count < capacity) {
+                descriptors[count++] = descriptor;
+            } else {
+                close(descriptor);
+            }
+        }
+    }
+    return received;
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <sys/types.h>
+
+//A client on a local socket sends SHM_REQUEST and, on a server started with a ring size, gets it back with three descriptors attached:
+//the memfd holding a shm_ring, an eventfd the server sleeps on and one the client sleeps on when the ring is full
+//Everything the client then writes into the ring is relayed like a message read from its socket, replies still arrive on the socket
+constexpr const char SHM_REQUEST[] = ".shm";
+constexpr const size_t SHM_DESCRIPTORS = 3;
+
+//Smallest and largest ring a server hands out
+constexpr const size_t MIN_SHM_RING_SIZE = 64 * 1024;
+constexpr const size_t MAX_SHM_RING_SIZE = 256 * 1024 * 1024;
+
+//Start of the memfd, each index on its own cache line so producer and consumer never share one
+struct shm_ring_header {
+    //Bytes ever written and read, wrap padding included, only their difference is ever used
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    //Set by a side about to sleep, whoever finds it set clears it and writes that side's eventfd
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+};
+
+//Single producer single consumer ring of length-prefixed messages, each at an 8 byte boundary, in memory shared by two processes
+//The consumer trusts nothing it reads from the ring, a producer that corrupts it only gets itself disconnected
+struct shm_ring {
+    shm_ring() = default;
+    ~shm_ring();
+
+    shm_ring(const shm_ring&) = delete;
+    shm_ring& operator=(const shm_ring&) = delete;
+
+    //Consumer side, a new sealed memfd of capacity bytes after the header and both eventfds, false with errno set
+    bool create(size_t capacity);
+
+    //Producer side, maps a ring handed over and takes the descriptors, false with errno set
+    bool attach(int memory, int data_ready, int space_ready);
+
+    int memory_fd() const {
+        return memory;
+    }
+
+    int data_ready_fd() const {
+        return data_ready;
+    }
+
+    int space_ready_fd() const {
+        return space_ready;
+    }
+
+    //Producer, false when there is no room for message right now or it could never fit
+    bool try_write(std::string_view message);
+
+    //Producer, sleeps on the space eventfd until there is room, false with errno set on failure or EMSGSIZE
+    bool write(std::string_view message);
+
+    //Consumer, calls each(message) for every message published so far, stopping early when each returns false
+    //Returns false once the ring is corrupt, the views are only valid inside each
+    //Where to read from is kept on this side, the header's tail is only ever written here, so a producer can only lie about head and the data
+    template <typename Each>
+    bool drain(Each each) {
+        while (true) {
+            const uint64_t head = header->head.load(std::memory_order_acquire);
+            if (head % RECORD_ALIGNMENT != 0 || head - consumed > capacity) {
+                return false;
+            }
+
+            uint64_t position = consumed;
+            bool stopped = false;
+            while (position != head && !stopped) {
+                //Always the case while head checks out, checked anyway since every bound below relies on it
+                if (position % RECORD_ALIGNMENT != 0) {
+                    return false;
+                }
+                //At least RECORD_ALIGNMENT bytes from the end, the length itself is always inside the data
+                const size_t offset = position % capacity;
+                const size_t left = capacity - offset;
+                uint32_t length;
+                std::memcpy(&length, data + offset, sizeof(length));
+                if (length == WRAP) {
+                    if (left > head - position) {
+                        return false;
+                    }
+                    position += left;
+                    continue;
+                }
+                const size_t size = record_size(length);
+                if (sizeof(length) + static_cast<size_t>(length) > left || size > head - position) {
+                    return false;
+                }
+                stopped = !each(std::string_view(data + offset + sizeof(length), length));
+                position += size;
+            }
+            release(position);
+            if (stopped) {
+                return true;
+            }
+
+            //Sleeping only once the producer can see it, a message published in between is picked up by going round again
+            header->consumer_waiting.store(1, std::memory_order_seq_cst);
+            if (header->head.load(std::memory_order_seq_cst) == position) {
+                return true;
+            }
+            header->consumer_waiting.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    //Length that sends the reader back to the start of the data
+    static constexpr const uint32_t WRAP = UINT32_MAX;
+    //Every record starts on one and the capacity is a multiple of it
+    static constexpr const size_t RECORD_ALIGNMENT = 8;
+
+    static size_t record_size(uint32_t length) {
+        return (sizeof(uint32_t) + length + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+    }
+
+    bool map(size_t size);
+
+    //Consumer, publishes tail and wakes a producer waiting for room
+    void release(uint64_t tail);
+
+    //Consumer, bytes read so far, the tail in the header is a copy for the producer
+    uint64_t consumed = 0;
+
+    int memory = -1;
+    int data_ready = -1;
+    int space_ready = -1;
+    shm_ring_header* header = nullptr;
+    char* data = nullptr;
+    size_t capacity = 0;
+    size_t mapped = 0;
+};
+
+//Sends data with descriptors attached over a local socket, false with errno set, a stream socket may only have taken part of data
+bool send_descriptors(int sock, std::string_view data, const int* descriptors, size_t count);
+
+//One recvmsg() into buffer, descriptors arriving with it are appended to descriptors up to capacity and the rest closed
+ssize_t receive_descriptors(int sock, char* buffer, size_t size, int* descriptors, size_t capacity, size_t& count);
@@ -0,0 +1,153 @@
+#include "shm_ring.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::vector;
+
+//Where shm_ring puts the data, the test writes through a mapping of its own like a producer could
+constexpr const size_t DATA_OFFSET = (sizeof(shm_ring_header) + 63) & ~size_t(63);
+constexpr const size_t CAPACITY = MIN_SHM_RING_SIZE;
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+    if (!passed) {
+        cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+//A consumer ring and the producer's view of the same memory
+struct ring_pair {
+    shm_ring consumer;
+    shm_ring producer;
+    shm_ring_header* header = nullptr;
+    char* data = nullptr;
+
+    ring_pair() {
+        if (!consumer.create(CAPACITY) || !producer.attach(dup(consumer.memory_fd()), dup(consumer.data_ready_fd()), dup(consumer.space_ready_fd()))) {
+            perror("shm_ring");
+            std::exit(EXIT_FAILURE);
+        }
+        void* address = mmap(nullptr, DATA_OFFSET + CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, consumer.memory_fd(), 0);
+        if (address == MAP_FAILED) {
+            perror("mmap");
+            std::exit(EXIT_FAILURE);
+        }
+        header = static_cast<shm_ring_header*>(address);
+        data = static_cast<char*>(address) + DATA_OFFSET;
+    }
+
+    ~ring_pair() {
+        munmap(header, DATA_OFFSET + CAPACITY);
+    }
+
+    //false from drain() is what a corrupt ring should get, with nothing handed out before the corrupt record
+    bool drain(vector<string>& messages) {
+        return consumer.drain([&](string_view message) {
+            messages.emplace_back(message);
+            return true;
+        });
+    }
+
+    //Moves the consumer to position by writing and draining one message that ends there
+    void advance_to(uint64_t position) {
+        vector<string> ignored;
+        check(producer.try_write(string(position - sizeof(uint32_t), 'x')), "filler written");
+        check(drain(ignored) && ignored.size() == 1, "filler drained");
+    }
+};
+
+static void well_formed() {
+    ring_pair ring;
+    for (const char* message : { "one", "two", "three" }) {
+        check(ring.producer.try_write(message), "written");
+    }
+    vector<string> messages;
+    check(ring.drain(messages), "well formed ring drains");
+    check(messages == vector<string>({ "one", "two", "three" }), "messages in order");
+}
+
+//The producer can write the tail in the header, the consumer must not read from where it says
+static void forged_tail() {
+    ring_pair ring;
+    ring.header->tail.store(CAPACITY - 3);
+    ring.header->head.store(CAPACITY - 3 + CAPACITY);
+    const uint32_t length = 1000;
+    std::memcpy(ring.data + CAPACITY - 4, &length, sizeof(length));
+    vector<string> messages;
+    check(!ring.drain(messages), "forged tail and unaligned head rejected");
+    check(messages.empty(), "nothing handed out from a forged tail");
+}
+
+static void unaligned_head() {
+    ring_pair ring;
+    check(ring.producer.try_write("fine"), "written");
+    ring.header->head.store(ring.header->head.load() + 3);
+    vector<string> messages;
+    check(!ring.drain(messages), "unaligned head rejected");
+}
+
+static void head_too_far() {
+    ring_pair ring;
+    ring.header->head.store(CAPACITY + 8);
+    vector<string> messages;
+    check(!ring.drain(messages), "head more than the capacity ahead rejected");
+}
+
+//A length running past the end of the data from a record right before it
+static void length_past_end() {
+    ring_pair ring;
+    ring.advance_to(CAPACITY - 8);
+    ring.header->head.store(CAPACITY - 8 + CAPACITY);
+    for (uint32_t length : { uint32_t(5), uint32_t(1000), uint32_t(100000), uint32_t(UINT32_MAX - 1) }) {
+        std::memcpy(ring.data + CAPACITY - 8, &length, sizeof(length));
+        vector<string> messages;
+        check(!ring.drain(messages), "length past the end of the data rejected");
+        check(messages.empty(), "nothing handed out past the end");
+    }
+}
+
+static void length_past_head() {
+    ring_pair ring;
+    ring.header->head.store(16);
+    const uint32_t length = 64;
+    std::memcpy(ring.data, &length, sizeof(length));
+    vector<string> messages;
+    check(!ring.drain(messages), "length past head rejected");
+}
+
+static void wrap_past_head() {
+    ring_pair ring;
+    ring.advance_to(CAPACITY - 64);
+    ring.header->head.store(CAPACITY - 64 + 8);
+    const uint32_t wrap = UINT32_MAX;
+    std::memcpy(ring.data + CAPACITY - 64, &wrap, sizeof(wrap));
+    vector<string> messages;
+    check(!ring.drain(messages), "wrap marker skipping past head rejected");
+}
+
+int main() {
+    well_formed();
+    forged_tail();
+    unaligned_head();
+    head_too_far();
+    length_past_end();
+    length_past_head();
+    wrap_past_head();
+    if (failures != 0) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "shm_ring: all checks passed\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+#include "timers.hpp"
+#include <algorithm>
+#include <bit>
+#include <memory>
+#include <string>
+
+using std::size_t;
+using std::string;
+using std::vector;
+using std::make_shared;
+using std::max;
+using std::min;
+
+constexpr const uint64_t SLOT_MASK = timer_wheel::LEVEL_SLOTS - 1;
+//Ticks from now the top level can still tell apart
+constexpr const uint64_t WHEEL_SPAN = uint64_t(1) << (timer_wheel::LEVEL_BITS * timer_wheel::LEVELS);
+
+timer_wheel::timer_wheel(uint64_t now_ns)
+    : current(now_ns / TICK_NS) {}
+
+void timer_wheel::schedule(uint64_t key, uint64_t deadline_ns) {
+    //Never before the deadline, and the slot of the current tick has already fired
+    const uint64_t tick = max(deadline_ns / TICK_NS + (deadline_ns % TICK_NS != 0), current + 1);
+    pending++;
+    place({ key, min(tick, current + WHEEL_SPAN - 1) });
+}
+
+//A timer goes to the lowest level whose slots still tell its tick apart from the current one, it moves down a level each time its slot comes round
+void timer_wheel::place(const timer& entry) {
+    const uint64_t delta = entry.tick - current;
+    size_t level = 0;
+    while (level + 1 < LEVELS && delta >= uint64_t(1) << (LEVEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    const size_t slot = (entry.tick >> (LEVEL_BITS * level)) & SLOT_MASK;
+    slots[level][slot].push_back(entry);
+    occupied[level] |= uint64_t(1) << slot;
+}
+
+//Earliest tick at which a level 0 slot fires or a higher slot moves down, so the ticks in between can be skipped
+static uint64_t next_tick(uint64_t current, const uint64_t (&occupied)[timer_wheel::LEVELS]) {
+    uint64_t next = UINT64_MAX;
+    for (size_t level = 0; level < timer_wheel::LEVELS; level++) {
+        if (occupied[level] == 0) {
+            continue;
+        }
+        const unsigned shift = timer_wheel::LEVEL_BITS * level;
+        const uint64_t position = current >> shift;
+        //Bit 0 of rotated is the slot right after position
+        const uint64_t rotated = std::rotr(occupied[level], static_cast<int>((position + 1) & SLOT_MASK));
+        next = min(next, (position + std::countr_zero(rotated) + 1) << shift);
+    }
+    return next;
+}
+
+void timer_wheel::advance(uint64_t now_ns, vector<uint64_t>& expired) {
+    const uint64_t target = now_ns / TICK_NS;
+    while (current < target) {
+        const uint64_t next = next_tick(current, occupied);
+        if (next > target) {
+            current = target;
+            return;
+        }
+        current = next;
+
+        //From the top, what comes down from one level may land in the slot of the next one down that is due now as well
+        for (size_t level = LEVELS - 1; level > 0; level--) {
+            const unsigned shift = LEVEL_BITS * level;
+            if ((current & ((uint64_t(1) << shift) - 1)) != 0) {
+                continue;
+            }
+            const size_t slot = (current >> shift) & SLOT_MASK;
+            if (!(occupied[level] & (uint64_t(1) << slot))) {
+                continue;
+            }
+
+            vector<timer> moving;
+            moving.swap(slots[level][slot]);
+            occupied[level] &= ~(uint64_t(1) << slot);
+            for (const timer& entry : moving) {
+                place(entry);
+            }
+            //Keeps the slot's allocation for next time round
+            moving.clear();
+            slots[level][slot].swap(moving);
+        }
+
+        const size_t slot = current & SLOT_MASK;
+        if (occupied[0] & (uint64_t(1) << slot)) {
+            for (const timer& entry : slots[0][slot]) {
+                expired.push_back(entry.key);
+            }
+            pending -= slots[0][slot].size();
+            slots[0][slot].clear();
+            occupied[0] &= ~(uint64_t(1) << slot);
+        }
+    }
+}
+
+uint64_t timer_wheel::next_deadline() const {
+    const uint64_t next = next_tick(current, occupied);
+    return next == UINT64_MAX ? UINT64_MAX : next * TICK_NS;
+}
+
+const shared_message& heartbeat_message() {
+    static const shared_message ping = make_shared<const string>(HEARTBEAT_PING);
+    return ping;
+}
+
+static uint64_t next_timeout(const connection_timeouts& timeouts, const timeout_config& config, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    if (config.idle_ns != 0) {
+        next = timeouts.read_at + config.idle_ns;
+    }
+    if (config.heartbeat_ns != 0) {
+        next = min(next, max(timeouts.read_at, timeouts.pinged_at) + config.heartbeat_ns);
+    }
+    if (config.write_ns != 0) {
+        next = min(next, (timeouts.backlogged ? timeouts.progress_at : now) + config.write_ns);
+    }
+    return next;
+}
+
+uint64_t start_timeouts(connection_timeouts& timeouts, const outbound_queue& outbound, const timeout_config& config, uint64_t now) {
+    timeouts = connection_timeouts();
+    timeouts.read_at = now;
+    timeouts.written = outbound.total_written;
+    timeouts.progress_at = now;
+    return next_timeout(timeouts, config, now);
+}
+
+timeout_action check_timeouts(connection_timeouts& timeouts, const outbound_queue& outbound, const timeout_config& config, uint64_t now, uint64_t& next) {
+    if (config.idle_ns != 0 && now - timeouts.read_at >= config.idle_ns) {
+        return timeout_action::idle;
+    }
+
+    if (config.write_ns != 0) {
+        if (outbound.empty() || outbound.total_written != timeouts.written) {
+            timeouts.written = outbound.total_written;
+            timeouts.progress_at = now;
+            timeouts.backlogged = !outbound.empty();
+        } else if (!timeouts.backlogged) {
+            //Became stuck some time since the last check, counted from now
+            timeouts.backlogged = true;
+            timeouts.progress_at = now;
+        } else if (now - timeouts.progress_at >= config.write_ns) {
+            return timeout_action::stalled;
+        }
+    }
+
+    timeout_action action = timeout_action::none;
+    if (config.heartbeat_ns != 0 && now - max(timeouts.read_at, timeouts.pinged_at) >= config.heartbeat_ns) {
+        timeouts.pinged_at = now;
+        action = timeout_action::heartbeat;
+    }
+    next = next_timeout(timeouts, config, now);
+    return action;
+}
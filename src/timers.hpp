@@ -0,0 +1,88 @@
+#pragma once
+#include "outbound.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//Hierarchical hashed timer wheel owned by one event loop, scheduling and firing a timer cost the same however many are pending
+//Timers are never cancelled, whoever set one decides when it fires whether it still matters and schedules the next
+struct timer_wheel {
+    //Resolution of every deadline
+    static constexpr const uint64_t TICK_NS = 10000000;
+    static constexpr const unsigned LEVEL_BITS = 6;
+    static constexpr const size_t LEVEL_SLOTS = size_t(1) << LEVEL_BITS;
+    //Level 0 spans 640ms and each level above 64 times the one below, deadlines past the top level, about 48 hours, fire early
+    static constexpr const size_t LEVELS = 4;
+
+    explicit timer_wheel(uint64_t now_ns = 0);
+
+    //key fires once deadline_ns, a metrics_clock() time, has passed, on the next advance for a deadline already gone
+    void schedule(uint64_t key, uint64_t deadline_ns);
+
+    //Appends the key of every timer due by now_ns to expired
+    void advance(uint64_t now_ns, std::vector<uint64_t>& expired);
+
+    //When the next advance may have anything to do, UINT64_MAX while nothing is pending
+    uint64_t next_deadline() const;
+
+    size_t size() const {
+        return pending;
+    }
+
+private:
+    struct timer {
+        uint64_t key;
+        uint64_t tick;
+    };
+
+    void place(const timer& entry);
+
+    //Every tick before and including current has fired
+    uint64_t current = 0;
+    size_t pending = 0;
+    std::vector<timer> slots[LEVELS][LEVEL_SLOTS];
+    //Bit n set while slot n of the level holds a timer
+    uint64_t occupied[LEVELS] = {};
+};
+
+//Per-connection timeouts, each in nanoseconds and 0 when disabled
+struct timeout_config {
+    //Evicts a connection nothing has been read from for this long
+    uint64_t idle_ns = 0;
+    //Sends HEARTBEAT_PING to a connection quiet for this long, a client answering with HEARTBEAT_PONG is never idle
+    uint64_t heartbeat_ns = 0;
+    //Evicts a connection whose queued messages saw no byte written for this long
+    uint64_t write_ns = 0;
+
+    bool enabled() const {
+        return idle_ns != 0 || heartbeat_ns != 0 || write_ns != 0;
+    }
+};
+
+enum class timeout_action {
+    none,
+    heartbeat,
+    idle,
+    stalled,
+};
+
+//What a connection's single pending timer compares against when it fires
+struct connection_timeouts {
+    //metrics_clock() of the last read, set on accept
+    uint64_t read_at = 0;
+    uint64_t pinged_at = 0;
+    //outbound_queue::total_written when the queue was last seen empty or moving, and when that was
+    uint64_t written = 0;
+    uint64_t progress_at = 0;
+    bool backlogged = false;
+};
+
+//HEARTBEAT_PING ready to queue
+const shared_message& heartbeat_message();
+
+//Starts the clocks of a connection accepted at now, returns its first deadline
+uint64_t start_timeouts(connection_timeouts& timeouts, const outbound_queue& outbound, const timeout_config& config, uint64_t now);
+
+//Run when the connection's timer fires, sets next to the deadline to schedule unless the connection is to be evicted
+//A stalled write is only reported once the queue stayed stuck from one check to the next at least write_ns apart, never early
+timeout_action check_timeouts(connection_timeouts& timeouts, const outbound_queue& outbound, const timeout_config& config, uint64_t now, uint64_t& next);
@@ -0,0 +1,172 @@
+#include "main.hpp"
+#include "transport.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::string;
+using std::vector;
+using std::to_string;
+using std::strncmp;
+
+bool identify_peer(int sock, peer_address& peer) {
+    if (peer.addr.ss_family != AF_UNIX) {
+        return true;
+    }
+
+    int type = 0;
+    socklen_t type_size = sizeof(type);
+    if (getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &type_size) == -1) {
+        return false;
+    }
+    peer.packet = type == SOCK_SEQPACKET;
+
+    ucred credentials = {};
+    socklen_t credentials_size = sizeof(credentials);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) == -1) {
+        return false;
+    }
+    peer.pid = credentials.pid;
+    return true;
+}
+
+bool local_address(const string& path, sockaddr_un& addr, socklen_t& length) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    //An abstract name is every byte after the leading NUL up to length, it needs no terminator
+    const bool abstract = !path.empty() && path[0] == '@';
+    if (path.size() + (abstract ? 0 : 1) > sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    path.copy(addr.sun_path, path.size());
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+    }
+    length = offsetof(sockaddr_un, sun_path) + path.size() + (abstract ? 0 : 1);
+    return true;
+}
+
+int open_local_listener(const local_endpoint& endpoint, int backlog) {
+    sockaddr_un addr;
+    socklen_t length;
+    if (!local_address(endpoint.path, addr, length)) {
+        string call = "bind(" + endpoint.path + ")";
+        errno_to_cerr(call.c_str());
+        return -1;
+    }
+
+    int listener = socket(AF_UNIX, (endpoint.packet ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        errno_to_cerr("socket(AF_UNIX, ...)");
+        return -1;
+    }
+
+    //A socket file left by an earlier run would make bind fail, anything else at the path is not ours to delete
+    if (addr.sun_path[0] != '\0') {
+        struct stat status;
+        if (lstat(addr.sun_path, &status) == 0 && !S_ISSOCK(status.st_mode)) {
+            cerr << "bind(" << endpoint.path << "): exists and is not a socket, not replacing it\n";
+            close(listener);
+            return -1;
+        }
+        if (unlink(addr.sun_path) == -1 && errno != ENOENT) {
+            string call = "unlink(" + endpoint.path + ")";
+            errno_to_cerr(call.c_str());
+            close(listener);
+            return -1;
+        }
+    }
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), length) == -1 || listen(listener, backlog) == -1) {
+        string call = "bind(" + endpoint.path + ")";
+        errno_to_cerr(call.c_str());
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+static bool resolve_local(const char* path, bool packet, vector<client_target>& targets) {
+    client_target target;
+    target.family = AF_UNIX;
+    target.type = packet ? SOCK_SEQPACKET : SOCK_STREAM;
+    if (!local_address(path, reinterpret_cast<sockaddr_un&>(target.addr), target.length)) {
+        string call = string("connect(") + path + ")";
+        errno_to_cerr(call.c_str());
+        return false;
+    }
+    targets.push_back(target);
+    return true;
+}
+
+bool resolve_target(const char* argument, vector<client_target>& targets) {
+    if (strncmp(argument, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+        return resolve_local(argument + sizeof(UNIX_PREFIX) - 1, false, targets);
+    }
+    if (strncmp(argument, SEQPACKET_PREFIX, sizeof(SEQPACKET_PREFIX) - 1) == 0) {
+        return resolve_local(argument + sizeof(SEQPACKET_PREFIX) - 1, true, targets);
+    }
+
+    //Brackets are how an IPv6 address is usually written next to a port, getaddrinfo wants it bare
+    string host = argument;
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    //Only families this host has an address in, so a machine without IPv6 does not try it first
+    hints.ai_flags = AI_ADDRCONFIG;
+    addrinfo* found = nullptr;
+    const int error = getaddrinfo(host.c_str(), to_string(PORT).c_str(), &hints, &found);
+    if (error != 0) {
+        cerr << "getaddrinfo(" << host << "): " << gai_strerror(error) << '\n';
+        return false;
+    }
+
+    for (addrinfo* entry = found; entry != nullptr; entry = entry->ai_next) {
+        client_target target;
+        target.family = entry->ai_family;
+        target.type = entry->ai_socktype;
+        target.protocol = entry->ai_protocol;
+        std::memcpy(&target.addr, entry->ai_addr, entry->ai_addrlen);
+        target.length = entry->ai_addrlen;
+        targets.push_back(target);
+    }
+    freeaddrinfo(found);
+    return true;
+}
+
+namespace std {
+    string to_string(const peer_address& peer) {
+        switch (peer.addr.ss_family) {
+            case AF_INET:
+                return to_string(reinterpret_cast<const sockaddr_in&>(peer.addr));
+            case AF_INET6: {
+                const sockaddr_in6& addr = reinterpret_cast<const sockaddr_in6&>(peer.addr);
+                //IPv4 clients of the dual-stack listener read as they did before it
+                if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
+                    sockaddr_in mapped = {};
+                    mapped.sin_family = AF_INET;
+                    mapped.sin_port = addr.sin6_port;
+                    memcpy(&mapped.sin_addr, addr.sin6_addr.s6_addr + 12, sizeof(mapped.sin_addr));
+                    return to_string(mapped);
+                }
+                char text[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &addr.sin6_addr, text, sizeof(text));
+                return '[' + string(text) + "]:" + to_string(ntohs(addr.sin6_port));
+            }
+            case AF_UNIX:
+                return peer.pid == 0 ? string("local") : "local:" + to_string(peer.pid);
+            default:
+                return "unknown";
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+//A server accepts TCP on PORT over IPv4 and IPv6 and, beside it, any number of local sockets for clients on the same host
+//A local path starting with '@' names a socket in the abstract namespace, which leaves no file behind and vanishes with the server
+
+//Prefixes a client argument takes to connect to a local socket instead of a host
+constexpr const char UNIX_PREFIX[] = "unix:";
+constexpr const char SEQPACKET_PREFIX[] = "seqpacket:";
+
+struct local_endpoint {
+    std::string path;
+    //SOCK_SEQPACKET, the kernel keeps message boundaries so frames need neither terminator nor header
+    bool packet = false;
+};
+
+//Whoever is on the other end of a connection, printed in logs and in front of everything it says
+struct peer_address {
+    sockaddr_storage addr = {};
+    //accept() shortens it to what it wrote
+    socklen_t length = sizeof(addr);
+    //Process on the other end of a local socket, whose address is usually empty, 0 otherwise
+    pid_t pid = 0;
+    //Connected over SOCK_SEQPACKET, frames in frame_mode::packet both ways
+    bool packet = false;
+
+    sockaddr* get() {
+        return reinterpret_cast<sockaddr*>(&addr);
+    }
+};
+
+//Completes what accept() leaves out for a local peer, its process and whether it is a SOCK_SEQPACKET one, false with errno set
+//Costs nothing for a TCP peer
+bool identify_peer(int sock, peer_address& peer);
+
+//sun_path for path, abstract for a leading '@', false with ENAMETOOLONG
+bool local_address(const std::string& path, sockaddr_un& addr, socklen_t& length);
+
+//Bound, listening with backlog and non-blocking, -1 once the failure has been reported
+int open_local_listener(const local_endpoint& endpoint, int backlog);
+
+//One way to reach what a client was asked to connect to
+struct client_target {
+    int family = AF_UNSPEC;
+    int type = SOCK_STREAM;
+    int protocol = 0;
+    sockaddr_storage addr = {};
+    socklen_t length = 0;
+};
+
+//UNIX_PREFIX or SEQPACKET_PREFIX then a path, or a host name, IPv4 or IPv6 address served on PORT, resolving to every address in the order to try them
+//False once the failure has been reported
+bool resolve_target(const char* argument, std::vector<client_target>& targets);
+
+namespace std {
+    string to_string(const peer_address& peer);
+}
@@ -0,0 +1,219 @@
+#include "uring.hpp"
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+using std::size_t;
+using std::memset;
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned arg_count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, arg_count));
+}
+
+template <typename T>
+static T* ring_field(void* map, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(map) + offset);
+}
+
+//__DECLARE_FLEX_ARRAY wraps an empty struct which takes a byte in C++, offsetting io_uring_buf_ring::bufs by 8
+static io_uring_buf& ring_entry(io_uring_buf_ring* ring, unsigned index) {
+    return reinterpret_cast<io_uring_buf*>(ring)[index];
+}
+
+uring::~uring() {
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_map != nullptr && cq_map != sq_map) {
+        munmap(cq_map, cq_map_size);
+    }
+    if (sq_map != nullptr) {
+        munmap(sq_map, sq_map_size);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+bool uring::setup(unsigned entries, unsigned completion_entries) {
+    params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = completion_entries;
+
+    fd = io_uring_setup(entries, &params);
+    if (fd == -1) {
+        return false;
+    }
+
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map && cq_map_size > sq_map_size) {
+        sq_map_size = cq_map_size;
+    }
+
+    sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED) {
+        sq_map = nullptr;
+        return false;
+    }
+
+    if (single_map) {
+        cq_map = sq_map;
+    } else {
+        cq_map = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) {
+            cq_map = nullptr;
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_map == MAP_FAILED) {
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+    sq_head = ring_field<unsigned>(sq_map, params.sq_off.head);
+    sq_tail = ring_field<unsigned>(sq_map, params.sq_off.tail);
+    sq_array = ring_field<unsigned>(sq_map, params.sq_off.array);
+    sq_mask = *ring_field<unsigned>(sq_map, params.sq_off.ring_mask);
+    sq_local_tail = *sq_tail;
+
+    cq_head = ring_field<unsigned>(cq_map, params.cq_off.head);
+    cq_tail = ring_field<unsigned>(cq_map, params.cq_off.tail);
+    cq_mask = *ring_field<unsigned>(cq_map, params.cq_off.ring_mask);
+    cqes = ring_field<io_uring_cqe>(cq_map, params.cq_off.cqes);
+
+    //Older kernels lack IORING_REGISTER_PROBE, every opcode is then reported unsupported
+    std::vector<char> probe_storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_storage.data());
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        for (int i = 0; i < probe->ops_len; i++) {
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) {
+                supported[probe->ops[i].op] = 1;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool uring::supports(uint8_t opcode) const {
+    return supported[opcode] != 0;
+}
+
+io_uring_sqe* uring::next_sqe() {
+    const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head >= params.sq_entries) {
+        return nullptr;
+    }
+
+    const unsigned index = sq_local_tail & sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sq_local_tail++;
+    return sqe;
+}
+
+unsigned uring::available() const {
+    return params.sq_entries - (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+}
+
+int uring::submit(unsigned wait_for) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait_for == 0) {
+        return 0;
+    }
+
+    while (true) {
+        int submitted = io_uring_enter(fd, to_submit, wait_for, wait_for == 0 ? 0 : IORING_ENTER_GETEVENTS);
+        if (submitted == -1 && errno == EINTR) {
+            continue;
+        }
+        return submitted;
+    }
+}
+
+io_uring_cqe* uring::peek() {
+    const unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &cqes[head & cq_mask];
+}
+
+void uring::seen() {
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uring_buffer_ring::~uring_buffer_ring() {
+    if (ring != nullptr && buffers != nullptr) {
+        io_uring_buf_reg registration = {};
+        registration.bgid = group;
+        io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+    }
+    if (buffers != nullptr) {
+        munmap(buffers, buffers_size);
+    }
+    delete[] memory;
+}
+
+bool uring_buffer_ring::setup(uring& owner, uint16_t group_id, uint16_t buffer_count, uint32_t size) {
+    group = group_id;
+    count = buffer_count;
+    buffer_size = size;
+
+    //The ring must be page aligned, anonymous mappings always are
+    buffers_size = count * sizeof(io_uring_buf);
+    void* map = mmap(nullptr, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    buffers = static_cast<io_uring_buf_ring*>(map);
+
+    io_uring_buf_reg registration = {};
+    registration.ring_addr = reinterpret_cast<uint64_t>(buffers);
+    registration.ring_entries = count;
+    registration.bgid = group;
+    if (io_uring_register(owner.fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        munmap(buffers, buffers_size);
+        buffers = nullptr;
+        return false;
+    }
+    ring = &owner;
+
+    memory = new char[static_cast<size_t>(count) * buffer_size];
+    for (uint16_t id = 0; id < count; id++) {
+        io_uring_buf& entry = ring_entry(buffers, id);
+        entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+        entry.len = buffer_size;
+        entry.bid = id;
+    }
+    __atomic_store_n(&buffers->tail, count, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void uring_buffer_ring::recycle(uint16_t id) {
+    const uint16_t tail = buffers->tail;
+    io_uring_buf& entry = ring_entry(buffers, tail & (count - 1));
+    entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+    entry.len = buffer_size;
+    entry.bid = id;
+    __atomic_store_n(&buffers->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+//Thin io_uring wrapper over the raw syscalls so liburing is not a build dependency, single threaded use only
+struct uring {
+    int fd = -1;
+    io_uring_params params = {};
+
+    uring() = default;
+    uring(const uring&) = delete;
+    uring& operator=(const uring&) = delete;
+    ~uring();
+
+    //Returns false with errno set when io_uring is unavailable
+    bool setup(unsigned entries, unsigned completion_entries);
+
+    bool supports(uint8_t opcode) const;
+
+    //Zeroed entry, nullptr when the submission queue is full and submit() must run first
+    io_uring_sqe* next_sqe();
+
+    //Free submission entries, linked chains must fit entirely before the next submit()
+    unsigned available() const;
+
+    //Submits everything queued and optionally blocks until wait_for completions are available
+    int submit(unsigned wait_for = 0);
+
+    io_uring_cqe* peek();
+    void seen();
+
+private:
+    void* sq_map = nullptr;
+    size_t sq_map_size = 0;
+    void* cq_map = nullptr;
+    size_t cq_map_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_local_tail = 0;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    uint8_t supported[256] = {};
+};
+
+//Provided buffer ring, the kernel picks a buffer per completion and reports its id in the cqe flags
+struct uring_buffer_ring {
+    uring* ring = nullptr;
+    io_uring_buf_ring* buffers = nullptr;
+    size_t buffers_size = 0;
+    char* memory = nullptr;
+    uint16_t group = 0;
+    uint16_t count = 0;
+    uint32_t buffer_size = 0;
+
+    uring_buffer_ring() = default;
+    uring_buffer_ring(const uring_buffer_ring&) = delete;
+    uring_buffer_ring& operator=(const uring_buffer_ring&) = delete;
+    ~uring_buffer_ring();
+
+    //count must be a power of two, returns false with errno set on failure
+    bool setup(uring& owner, uint16_t group_id, uint16_t buffer_count, uint32_t size);
+
+    char* buffer(uint16_t id) const {
+        return memory + static_cast<size_t>(id) * buffer_size;
+    }
+
+    //Hands a consumed buffer back to the kernel
+    void recycle(uint16_t id);
+};
@@ -0,0 +1,489 @@
+#include "main.hpp"
+#include "server.hpp"
+#include "uring.hpp"
+#include "framer.hpp"
+#include "rooms.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using std::cout;
+using std::cerr;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::make_shared;
+using std::to_string;
+using std::size_t;
+
+constexpr const unsigned URING_ENTRIES = 4096;
+constexpr const unsigned URING_COMPLETION_ENTRIES = URING_ENTRIES * 4;
+
+constexpr const uint16_t URING_BUFFER_GROUP = 0;
+constexpr const uint16_t URING_BUFFER_COUNT = 1024;
+constexpr const uint32_t URING_BUFFER_SIZE = 4096;
+
+//Sends to one connection are linked so they complete in order, the chain is capped so it always fits the submission queue
+constexpr const size_t MAX_LINKED_SENDS = 64;
+
+//A peer that vanished fails every send queued for it, one call site must not flood the log
+static log_limiter send_failures;
+
+enum class uring_operation : uint8_t {
+    accept = 1,
+    recv,
+    send,
+    cancel,
+};
+
+static uint64_t user_data(uring_operation operation, int fd) {
+    return (static_cast<uint64_t>(operation) << 32) | static_cast<uint32_t>(fd);
+}
+
+//Indexed by fd, a slot is only reused once the kernel holds no more operations for it
+struct uring_connection {
+    bool open = false;
+    bool closing = false;
+    bool recv_armed = false;
+    size_t sends_in_flight = 0;
+    peer_address addr;
+    framer frames;
+    //The first sends_in_flight messages are owned by the kernel until their completions arrive
+    outbound_queue outbound;
+    //Reading stopped because a recipient of this connection's messages is at its outbound limit
+    bool paused = false;
+    //Over its limit under the block policy, counted in uring_context::holding
+    bool holding = false;
+    room_membership rooms;
+};
+
+struct uring_context {
+    uring ring;
+    uring_buffer_ring buffers;
+    vector<uring_connection> connections;
+    vector<int> starved;
+    vector<int> paused;
+    size_t holding = 0;
+    outbound_config outbound;
+    room_index<int> rooms;
+    accept_meter accepts;
+};
+
+static io_uring_sqe* uring_sqe(uring& ring) {
+    io_uring_sqe* sqe = ring.next_sqe();
+    while (sqe == nullptr) {
+        if (ring.submit() == -1) {
+            errno_to_cerr("io_uring_enter(...)");
+        }
+        sqe = ring.next_sqe();
+    }
+    return sqe;
+}
+
+static void uring_arm_accept(uring_context& context, int listener) {
+    io_uring_sqe* sqe = uring_sqe(context.ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data(uring_operation::accept, listener);
+}
+
+static void uring_arm_recv(uring_context& context, int fd) {
+    io_uring_sqe* sqe = uring_sqe(context.ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data(uring_operation::recv, fd);
+    context.connections[fd].recv_armed = true;
+}
+
+static void uring_flush(uring_context& context, int fd) {
+    uring_connection& connection = context.connections[fd];
+    if (connection.sends_in_flight != 0 || connection.outbound.empty()) {
+        return;
+    }
+
+    size_t chain = connection.outbound.messages.size() < MAX_LINKED_SENDS ? connection.outbound.messages.size() : MAX_LINKED_SENDS;
+    if (context.ring.available() < chain && context.ring.submit() == -1) {
+        errno_to_cerr("io_uring_enter(...)");
+    }
+
+    for (size_t i = 0; i < chain; i++) {
+        const string& message = *connection.outbound.messages[i];
+        io_uring_sqe* sqe = uring_sqe(context.ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(message.c_str());
+        //A record carries its own boundary, a stream needs the terminator
+        sqe->len = message.size() + (connection.outbound.packet ? 0 : 1);
+        //MSG_WAITALL makes the kernel finish short sends itself instead of breaking the chain
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = i + 1 == chain ? 0 : IOSQE_IO_LINK;
+        sqe->user_data = user_data(uring_operation::send, fd);
+    }
+    connection.sends_in_flight = chain;
+}
+
+//The fd is only closed once every operation referencing it has completed
+static void uring_release(uring_context& context, int fd) {
+    uring_connection& connection = context.connections[fd];
+    if (!connection.closing || connection.recv_armed || connection.sends_in_flight != 0 || !connection.outbound.empty()) {
+        return;
+    }
+
+    if (close(fd) == -1) {
+        string call = "close(" + to_string(connection.addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+    metrics_add(counter::disconnects);
+    log_write(log_level::info, to_string(connection.addr) + " Disconnected");
+    connection = uring_connection();
+}
+
+//Stops the multishot recv, reading resumes once the congested recipients drain
+static void uring_pause(uring_context& context, int fd) {
+    uring_connection& connection = context.connections[fd];
+    if (connection.paused || connection.closing) {
+        return;
+    }
+    connection.paused = true;
+    context.paused.push_back(fd);
+
+    if (connection.recv_armed) {
+        io_uring_sqe* sqe = uring_sqe(context.ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(uring_operation::recv, fd);
+        sqe->user_data = user_data(uring_operation::cancel, fd);
+    }
+}
+
+static void uring_resume_all(uring_context& context) {
+    for (const int& fd : context.paused) {
+        uring_connection& connection = context.connections[fd];
+        connection.paused = false;
+        if (connection.open && !connection.closing && !connection.recv_armed) {
+            uring_arm_recv(context, fd);
+        }
+    }
+    context.paused.clear();
+}
+
+//Paused senders read again once no recipient is over its limit
+static void uring_unhold(uring_context& context, uring_connection& connection) {
+    if (!connection.holding) {
+        return;
+    }
+    connection.holding = false;
+    if (--context.holding == 0) {
+        uring_resume_all(context);
+    }
+}
+
+//Shutting down completes the armed recv with 0, queued messages are still delivered unless abort drops them and fails in-flight sends
+static void uring_disconnect(uring_context& context, int fd, bool abort) {
+    uring_connection& connection = context.connections[fd];
+    if (connection.closing && !abort) {
+        return;
+    }
+    connection.closing = true;
+    uring_unhold(context, connection);
+    context.rooms.remove(fd, connection.rooms);
+
+    if (abort) {
+        connection.outbound.truncate(connection.sends_in_flight);
+    }
+
+    if (shutdown(fd, abort ? SHUT_RDWR : SHUT_RD) == -1 && errno != ENOTCONN) {
+        string call = "shutdown(" + to_string(connection.addr) + ")";
+        errno_to_cerr(call.c_str());
+    }
+    uring_release(context, fd);
+}
+
+//Returns true when a recipient is over its limit under the block policy, the sender must then be paused
+static bool uring_broadcast(uring_context& context, const string& out, room_id room) {
+    bool congested = false;
+    shared_message message = make_shared<const string>(out);
+    //Disconnecting leaves rooms, which would move subscribers around under the loop, so it waits until after
+    vector<int> slow;
+    for (int fd : context.rooms.members(room)) {
+        uring_connection& connection = context.connections[fd];
+        if (connection.closing) {
+            continue;
+        }
+
+        //The ring thread can not wait on a socket, block is applied by pausing the sender instead
+        if (connection.outbound.full(context.outbound.limit)) {
+            if (context.outbound.policy == slow_consumer_policy::drop) {
+                metrics_add(counter::dropped);
+                continue;
+            } else if (context.outbound.policy == slow_consumer_policy::disconnect) {
+                log_write(log_level::warning, to_string(connection.addr) + " Slow consumer, disconnecting");
+                slow.push_back(fd);
+                continue;
+            }
+            if (!connection.holding) {
+                connection.holding = true;
+                context.holding++;
+            }
+            congested = true;
+        }
+
+        connection.outbound.push(message);
+        metrics_record(distribution::outbound_depth, connection.outbound.bytes);
+        uring_flush(context, fd);
+    }
+
+    for (int fd : slow) {
+        uring_disconnect(context, fd, true);
+    }
+    return congested;
+}
+
+static bool uring_on_accept(uring_context& context, int listener, int result, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(context, listener);
+    }
+
+    if (result < 0) {
+        errno = -result;
+        errno_to_cerr("accept(...)");
+        return result == -EMFILE || result == -ENFILE || result == -ENOBUFS || result == -ENOMEM || result == -ECONNABORTED || result == -EINTR;
+    }
+
+    const int fd = result;
+    if (static_cast<size_t>(fd) >= context.connections.size()) {
+        context.connections.resize(fd + 1);
+    }
+
+    uring_connection& connection = context.connections[fd];
+    connection = uring_connection();
+    connection.open = true;
+    if (getpeername(fd, connection.addr.get(), &connection.addr.length) == -1) {
+        errno_to_cerr("getpeername(...)");
+    }
+    if (!identify_peer(fd, connection.addr)) {
+        errno_to_cerr("getsockopt(..., SO_PEERCRED, ...)");
+    }
+    //A record longer than URING_BUFFER_SIZE arrives cut short, multishot recv does not report MSG_TRUNC
+    if (connection.addr.packet) {
+        connection.frames.set_mode(frame_mode::packet);
+        connection.outbound.set_mode(frame_mode::packet);
+    }
+    if (!tune_socket(fd, context.outbound)) {
+        errno_to_cerr("setsockopt(...)");
+    }
+    context.rooms.add(fd, connection.rooms);
+    uring_arm_recv(context, fd);
+    metrics_add(counter::accepts);
+    //Multishot accept completes once per connection
+    context.accepts.drained(1);
+    log_write(log_level::info, to_string(connection.addr) + " Connected");
+    return true;
+}
+
+static void uring_on_recv(uring_context& context, int fd, int result, uint32_t flags) {
+    uring_connection& connection = context.connections[fd];
+    if (!(flags & IORING_CQE_F_MORE)) {
+        connection.recv_armed = false;
+    }
+
+    if (result <= 0) {
+        if (result == -ECANCELED && !connection.closing) {
+            //Cancelled by uring_pause, the connection may have been resumed since
+            if (!connection.paused && !connection.recv_armed) {
+                uring_arm_recv(context, fd);
+            }
+            return;
+        }
+        if (result == -ENOBUFS && !connection.closing) {
+            //Every provided buffer was in use, rearm once this batch of completions has recycled them
+            context.starved.push_back(fd);
+            return;
+        }
+        if (result < 0 && !connection.closing) {
+            errno = -result;
+            string call = "recv(" + to_string(connection.addr) + ")";
+            errno_to_cerr(call.c_str());
+        }
+        uring_disconnect(context, fd, result < 0);
+        uring_release(context, fd);
+        return;
+    }
+
+    const uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+    defer([&]() {
+        context.buffers.recycle(id);
+    });
+
+    if (connection.closing) {
+        uring_release(context, fd);
+        return;
+    }
+
+    //The framer only runs short of space when it still holds frames, consuming them makes room for the rest
+    const char* received = context.buffers.buffer(id);
+    const uint64_t received_at = metrics_clock();
+    size_t consumed = 0;
+    while (consumed != static_cast<size_t>(result)) {
+        const size_t appended = connection.frames.append(received + consumed, result - consumed);
+        consumed += appended;
+
+        string_view message;
+        bool framed = false;
+        while (connection.frames.next(message)) {
+            framed = true;
+            if (context.rooms.handle(message, fd, connection.rooms)) {
+                continue;
+            }
+
+            string out = "(" + to_string(connection.addr) + ") " + connection.rooms.current_prefix;
+            out.append(message);
+            if (uring_broadcast(context, out, connection.rooms.current)) {
+                uring_pause(context, fd);
+            }
+            metrics_record(distribution::broadcast_ns, metrics_clock() - received_at);
+            log_chat(out);
+
+            if (message.rfind(".exit", 0) == 0) {
+                uring_disconnect(context, fd, false);
+                return;
+            }
+        }
+
+        if (appended == 0 && !framed) {
+            errno = EMSGSIZE;
+            string call = "recv(" + to_string(connection.addr) + ")";
+            errno_to_cerr(call.c_str());
+            uring_disconnect(context, fd, true);
+            return;
+        }
+    }
+
+    if (!connection.recv_armed && !connection.paused) {
+        uring_arm_recv(context, fd);
+    }
+}
+
+static void uring_on_send(uring_context& context, int fd, int result) {
+    uring_connection& connection = context.connections[fd];
+    connection.sends_in_flight--;
+    connection.outbound.pop();
+
+    if (!connection.outbound.full(context.outbound.limit)) {
+        uring_unhold(context, connection);
+    }
+
+    if (result >= 0) {
+        metrics_add(counter::bytes_out, result);
+    } else if (result != -ECANCELED) {
+        metrics_add(counter::send_errors);
+    }
+
+    if (result < 0) {
+        if (result != -ECANCELED && result != -EPIPE) {
+            errno = -result;
+            if (send_failures.allow()) {
+                string call = "send(" + to_string(connection.addr) + ")";
+                errno_to_cerr(call.c_str());
+            }
+        }
+        uring_disconnect(context, fd, true);
+    }
+
+    if (connection.sends_in_flight != 0) {
+        return;
+    }
+
+    uring_flush(context, fd);
+    uring_release(context, fd);
+}
+
+//Multishot recv (6.0) landed in the same release as IORING_OP_SEND_ZC, the probe has no flag for it
+static bool uring_usable(const uring& ring) {
+    return
+        ring.supports(IORING_OP_ACCEPT) &&
+        ring.supports(IORING_OP_RECV) &&
+        ring.supports(IORING_OP_SEND) &&
+        ring.supports(IORING_OP_SEND_ZC);
+}
+
+int uring_workers(const vector<int>& listeners, const server_options& options) {
+    uring_context context;
+    context.outbound = options.outbound;
+
+    if (!context.ring.setup(URING_ENTRIES, URING_COMPLETION_ENTRIES)) {
+        errno_to_cerr("io_uring_setup(...)");
+        log_write(log_level::warning, "io_uring unavailable, falling back to poll workers");
+        return asynchronous_workers(listeners, options);
+    }
+
+    if (!uring_usable(context.ring)) {
+        log_write(log_level::warning, "io_uring lacks multishot accept/recv, falling back to poll workers");
+        return asynchronous_workers(listeners, options);
+    }
+
+    if (!context.buffers.setup(context.ring, URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+        errno_to_cerr("io_uring_register(IORING_REGISTER_PBUF_RING)");
+        log_write(log_level::warning, "io_uring lacks provided buffer rings, falling back to poll workers");
+        return asynchronous_workers(listeners, options);
+    }
+
+    //io_uring completes operations on O_NONBLOCK files with EAGAIN instead of waiting for readiness
+    for (int listener : listeners) {
+        int fcntl_flags = fcntl(listener, F_GETFL, 0);
+        if (fcntl_flags == -1 || fcntl(listener, F_SETFL, fcntl_flags & ~O_NONBLOCK) == -1) {
+            errno_to_cerr("fcntl(listener, ...)");
+            return EXIT_FAILURE;
+        }
+        uring_arm_accept(context, listener);
+    }
+    while (true) {
+        if (context.ring.submit(1) == -1) {
+            errno_to_cerr("io_uring_enter(...)");
+            return EXIT_FAILURE;
+        }
+
+        for (io_uring_cqe* cqe = context.ring.peek(); cqe != nullptr; cqe = context.ring.peek()) {
+            const uring_operation operation = static_cast<uring_operation>(cqe->user_data >> 32);
+            const int fd = static_cast<int>(cqe->user_data & 0xFFFFFFFF);
+            const int result = cqe->res;
+            const uint32_t flags = cqe->flags;
+            context.ring.seen();
+
+            switch (operation) {
+                case uring_operation::accept:
+                    if (!uring_on_accept(context, fd, result, flags)) {
+                        return EXIT_FAILURE;
+                    }
+                    break;
+                case uring_operation::recv:
+                    uring_on_recv(context, fd, result, flags);
+                    break;
+                case uring_operation::send:
+                    uring_on_send(context, fd, result);
+                    break;
+                case uring_operation::cancel:
+                    break;
+            }
+        }
+
+        for (const int& fd : context.starved) {
+            if (!context.connections[fd].closing && !context.connections[fd].recv_armed) {
+                uring_arm_recv(context, fd);
+            }
+        }
+        context.starved.clear();
+    }
+
+    return EXIT_SUCCESS;
+}